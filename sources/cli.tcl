@@ -0,0 +1,954 @@
+#
+# ----------------------------------------------------------------------
+# cli.tcl: headless command line mode of the Password Gorilla
+# ----------------------------------------------------------------------
+#
+# gorilla.tcl sources this file before it loads Tk.  If the command line
+# asks for one of the headless queries, the query is run against the
+# database and the application exits without ever building a window.
+# Only msgcat, Itcl, pwsafe (with sha256 and twofish) and ISAAC are
+# loaded for that.
+#
+# The database password is read as the first line of standard input,
+# or of the file descriptor given with --password-fd.
+#
+# With --agent the database is unlocked once and the process stays
+# running to answer --list, --get and --search queries of later calls
+# with --use-agent, so that these do not pay for the key stretching
+# again.  Tcl has no Unix domain sockets, so the agent listens on a TCP
+# port of the loopback interface.  The port and a random token are
+# written to the agent file, which only the user can read, and every
+# request has to present the token within a few seconds of connecting.
+# A request is one frame: the length of the payload in bytes as a
+# decimal number, a newline, and the utf-8 encoded payload, which is a
+# Tcl list.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+
+namespace eval ::gorilla::cli {
+
+	# the options that select headless mode
+	variable queries { --list --get --search --export-csv --verify --verify-all --agent --lock }
+
+	# the queries an agent answers
+	variable agentQueries { --list --get --search --lock }
+
+	# the largest request frame an agent accepts; replies are not limited,
+	# as a --list of a big database easily exceeds it
+	variable maxFrame 65536
+
+	# milliseconds a connection may take to send its request
+	variable requestTimeout 5000
+
+	# state of a running agent: db, index, token, file, timer, done, and
+	# buffer,<chan> and timeout,<chan> for every open connection
+	variable agent
+	array set agent {}
+
+}
+
+proc ::gorilla::CsvField { value separator } {
+
+	# Returns value quoted for one field of a CSV row, following the rules
+	# of ::csv::join: a value containing the separator or a double quote
+	# is enclosed in double quotes, and its double quotes are doubled.
+	#
+	# value - the plain field value
+	# separator - the field separator character
+
+	if { [ string first \" $value ] >= 0 || [ string first $separator $value ] >= 0 } {
+		return "\"[ string map {\" \"\"} $value ]\""
+	}
+	return $value
+
+} ; # end proc gorilla::CsvField
+
+# ----------------------------------------------------------------------
+
+proc ::gorilla::cli::requested { argv } {
+
+	# Returns true if argv contains one of the headless query options
+
+	variable queries
+
+	foreach arg $argv {
+		if { $arg in $queries } {
+			return 1
+		}
+	}
+	return 0
+
+} ; # end proc ::gorilla::cli::requested
+
+# ----------------------------------------------------------------------
+
+proc ::gorilla::cli::usage { } {
+	puts stderr "usage: $::argv0 <query> \[Options\] <database>"
+	puts stderr " Queries:"
+	puts stderr "   --list                 List group, title and user name of all logins."
+	puts stderr "   --get <title>          Print a field of the login with this title."
+	puts stderr "   --search <text>        List the logins whose group, title, user name"
+	puts stderr "                          or URL contain text."
+	puts stderr "   --export-csv <file>    Export the database as CSV, \"-\" for stdout."
+	puts stderr "   --verify               Check that the database opens and is authentic."
+	puts stderr "                          <database> may also be a backup store directory."
+	puts stderr "   --verify-all           Check every database and backup in the directory"
+	puts stderr "                          <database>, trying each password of the list."
+	puts stderr "   --agent                Unlock <database> and answer the queries of"
+	puts stderr "                          --use-agent until the idle timeout locks it."
+	puts stderr "   --lock                 Lock a running agent."
+	puts stderr " Options:"
+	puts stderr "   --group <group>        Only consider logins in this group."
+	puts stderr "   --user <user name>     Only consider logins with this user name (--get)."
+	puts stderr "   --field <field>        Field to print for --get, default password."
+	puts stderr "   --password-fd <fd>     Read the password from this file descriptor"
+	puts stderr "                          instead of stdin."
+	puts stderr "   --password-file <file> Passwords to try for --verify-all, one per line."
+	puts stderr "   --jobs <n>             Files verified at once by --verify-all, default"
+	puts stderr "                          the number of processors."
+	puts stderr "   --use-agent            Ask the running agent instead of a <database>."
+	puts stderr "   --agent-file <file>    Agent file, default [ agentFile "" ]."
+}
+
+# ----------------------------------------------------------------------
+
+proc ::gorilla::cli::load { } {
+
+	# Loads the packages needed to open a database, and seeds ISAAC
+
+	set ::auto_path [ list $::gorilla::Dir [ file join $::gorilla::Dir tcllib ] {*}$::auto_path ]
+	foreach dir [ glob -nocomplain -types d [ file join $::gorilla::Dir itcl* ] ] {
+		lappend ::auto_path $dir
+	}
+
+	package require msgcat
+	namespace eval :: { namespace import msgcat::* }
+
+	uplevel #0 [ list source [ file join $::gorilla::Dir isaac.tcl ] ]
+	package require Itcl
+	package require pwsafe
+
+	# the agent keeps its database for long, so use the smaller layout
+	set ::pwsafe::compactRecords 1
+
+	# the same seed sources as gorilla::InitPRNG, except for the window
+	# system ones
+	set seed "20041201[ clock seconds ][ clock clicks ][ pid ]"
+	catch {
+		set fd [ open /dev/urandom {RDONLY BINARY} ]
+		append seed [ read $fd 992 ]
+		close $fd
+	}
+	::isaac::srand [ ::sha2::sha256 -bin $seed ]
+
+} ; # end proc ::gorilla::cli::load
+
+# ----------------------------------------------------------------------
+
+proc ::gorilla::cli::readPassword { fd } {
+
+	# Reads the first line from standard input, or from file descriptor
+	# fd if it is not empty
+
+	if { $fd eq "" } {
+		set chan stdin
+	} else {
+		set chan [ open /dev/fd/$fd RDONLY ]
+	}
+	fconfigure $chan -translation auto -encoding utf-8
+
+	if { [ gets $chan password ] < 0 } {
+		set password ""
+	}
+	if { $chan ne "stdin" } {
+		close $chan
+	}
+	return $password
+
+} ; # end proc ::gorilla::cli::readPassword
+
+# ----------------------------------------------------------------------
+
+proc ::gorilla::cli::field { db rn field } {
+
+	# Returns the value of a field by name, or "" if the record lacks it
+
+	set number [ dict get {uuid 1 group 2 title 3 user 4 username 4 notes 5 password 6 url 13} $field ]
+	if { [ $db existsField $rn $number ] } {
+		return [ $db getFieldValue $rn $number ]
+	}
+	return ""
+
+} ; # end proc ::gorilla::cli::field
+
+# ----------------------------------------------------------------------
+
+proc ::gorilla::cli::titleIndex { db } {
+
+	# Returns a dict from every title in db to the list of its record
+	# numbers
+
+	set index [ dict create ]
+	foreach rn [ $db getAllRecordNumbers ] {
+		dict lappend index [ field $db $rn title ] $rn
+	}
+	return $index
+
+} ; # end proc ::gorilla::cli::titleIndex
+
+# ----------------------------------------------------------------------
+
+proc ::gorilla::cli::lookup { db opts {index ""} } {
+
+	# Runs a --list, --get or --search query against db.  Returns a list
+	# of the exit status, the lines for stdout and the lines for stderr.
+	#
+	# opts - dict of the parsed command line, see gorilla::cli::main
+	# index - title index of db, see gorilla::cli::titleIndex.  If it is
+	#         given, --get only looks at the records with that title.
+
+	dict with opts {}
+
+	if { $query eq "--get" && $index ne "" } {
+		set candidates [ expr { [ dict exists $index $arg ] ? [ dict get $index $arg ] : "" } ]
+	} else {
+		set candidates [ $db getAllRecordNumbers ]
+	}
+
+	set records [ list ]
+	foreach rn $candidates {
+		if { $has_group && [ field $db $rn group ] ne $group } {
+			continue
+		}
+		lappend records $rn
+	}
+
+	set output [ list ]
+
+	switch -- $query {
+
+		--list -
+		--search {
+			foreach rn $records {
+				set row [ list [ field $db $rn group ] [ field $db $rn title ] [ field $db $rn user ] ]
+				if { $query eq "--search" } {
+					set haystack [ string tolower [ join [ list {*}$row [ field $db $rn url ] ] "\n" ] ]
+					if { [ string first [ string tolower $arg ] $haystack ] < 0 } {
+						continue
+					}
+				}
+				lappend output [ join $row "\t" ]
+			}
+		}
+
+		--get {
+			set found [ list ]
+			foreach rn $records {
+				if { [ field $db $rn title ] eq $arg &&
+				     ( $user eq "" || [ field $db $rn user ] eq $user ) } {
+					lappend found $rn
+				}
+			}
+			if { [ llength $found ] == 0 } {
+				return [ list 2 {} [ list [ mc "No login \"%s\" found." $arg ] ] ]
+			} elseif { [ llength $found ] > 1 } {
+				return [ list 3 {} [ list [ mc "%d logins \"%s\" found, use --group or --user." [ llength $found ] $arg ] ] ]
+			}
+			lappend output [ field $db [ lindex $found 0 ] $field ]
+		}
+
+	} ; # end switch query
+
+	return [ list 0 $output {} ]
+
+} ; # end proc ::gorilla::cli::lookup
+
+# ----------------------------------------------------------------------
+
+proc ::gorilla::cli::processors { } {
+
+	# Returns the number of processors, or 2 if it can not be found out
+
+	if { [ info exists ::env(NUMBER_OF_PROCESSORS) ] } {
+		return $::env(NUMBER_OF_PROCESSORS)
+	}
+	if { ! [ catch {
+		set chan [ open /proc/cpuinfo RDONLY ]
+		set cpuinfo [ read $chan ]
+		close $chan
+	} ] } {
+		set count [ regexp -all -line {^processor\s*:} $cpuinfo ]
+		if { $count > 0 } {
+			return $count
+		}
+	}
+	return 2
+
+} ; # end proc ::gorilla::cli::processors
+
+# ----------------------------------------------------------------------
+
+proc ::gorilla::cli::verifyAll { directory passwords jobs } {
+
+	# Verifies every database and backup file in directory with
+	# pwsafe::verifyFiles, trying each of the passwords.  The files are
+	# handed out in batches of up to eight, whose key stretches share the
+	# lanes of the multi-buffer sha256 kernel.  Up to jobs batches are
+	# verified at the same time, each in a worker thread with its own
+	# interpreter; without the Thread package they are verified one after
+	# the other.  Prints the result of every file and returns 0 if all
+	# passed, 1 otherwise.
+
+	set files [ lsort -dictionary [ glob -nocomplain -types f -directory $directory \
+		*.psafe3 *.psafe3~ *.bak *.dat ] ]
+	if { [ llength $files ] == 0 } {
+		puts stderr [ mc "No password databases found in \"%s\"." $directory ]
+		return 1
+	}
+
+	# spread the files over all jobs before filling the lanes
+
+	set size [ expr { min( 8, ( [ llength $files ] + $jobs - 1 ) / $jobs ) } ]
+	set batches [ list ]
+	for { set i 0 } { $i < [ llength $files ] } { incr i $size } {
+		lappend batches [ lrange $files $i [ expr { $i + $size - 1 } ] ]
+	}
+
+	array set results {}
+
+	if { $jobs > 1 && [ llength $batches ] > 1 && ! [ catch { package require Thread } ] } {
+		set init [ list namespace eval ::gorilla [ list set Dir $::gorilla::Dir ] ]
+		append init \n [ list source [ file join $::gorilla::Dir cli.tcl ] ]
+		append init \n ::gorilla::cli::load
+
+		set pool [ tpool::create -minworkers 1 -maxworkers $jobs -initcmd $init ]
+		set pending [ list ]
+		foreach batch $batches {
+			set job [ tpool::post $pool [ list pwsafe::verifyFiles $batch $passwords ] ]
+			set jobFiles($job) $batch
+			lappend pending $job
+		}
+		while { [ llength $pending ] } {
+			foreach job [ tpool::wait $pool $pending pending ] {
+				if { [ catch { tpool::get $pool $job } batchResults ] } {
+					set batchResults [ lrepeat [ llength $jobFiles($job) ] \
+						[ list fail $batchResults ] ]
+				}
+				foreach file $jobFiles($job) result $batchResults {
+					set results($file) $result
+				}
+			}
+		}
+		tpool::release $pool
+	} else {
+		foreach batch $batches {
+			if { [ catch { pwsafe::verifyFiles $batch $passwords } batchResults ] } {
+				set batchResults [ lrepeat [ llength $batch ] [ list fail $batchResults ] ]
+			}
+			foreach file $batch result $batchResults {
+				set results($file) $result
+			}
+		}
+	}
+
+	set counts [ dict create pass 0 fail 0 "wrong password" 0 ]
+	foreach file $files {
+		lassign $results($file) status detail
+		dict incr counts $status
+		switch -- $status {
+			pass {
+				lassign $detail records index notes
+				set line [ mc "%d records, password %d" $records [ expr { $index + 1 } ] ]
+				if { $notes ne "" } {
+					append line "; " $notes
+				}
+				puts [ format "%-15s %s: %s" PASS $file $line ]
+			}
+			fail {
+				puts [ format "%-15s %s: %s" FAIL $file $detail ]
+			}
+			default {
+				puts [ format "%-15s %s" WRONG-PASSWORD $file ]
+			}
+		}
+	}
+	puts [ mc "%d passed, %d failed, %d wrong password" [ dict get $counts pass ] \
+		[ dict get $counts fail ] [ dict get $counts "wrong password" ] ]
+
+	return [ expr { [ dict get $counts pass ] == [ llength $files ] ? 0 : 1 } ]
+
+} ; # end proc ::gorilla::cli::verifyAll
+
+# ----------------------------------------------------------------------
+
+proc ::gorilla::cli::main { argv } {
+
+	# Runs the headless query given on the command line.  Returns the exit
+	# status: 0 on success, 1 on usage errors, if the database can not be
+	# opened or verified, or if the agent can not be reached, 2 if --get
+	# finds no login, 3 if --get finds more than one.
+
+	variable agentQueries
+
+	set opts [ dict create query "" arg "" group "" has_group 0 user "" field password ]
+	set fd ""
+	set database ""
+	set useAgent 0
+	set agentFile ""
+	set passwordFile ""
+	set jobs [ processors ]
+
+	for { set i 0 } { $i < [ llength $argv ] } { incr i } {
+		set arg [ lindex $argv $i ]
+		switch -- $arg {
+			--list -
+			--verify -
+			--verify-all -
+			--agent -
+			--lock {
+				dict set opts query $arg
+			}
+			--get -
+			--search -
+			--export-csv {
+				dict set opts query $arg
+				dict set opts arg [ lindex $argv [ incr i ] ]
+			}
+			--group {
+				dict set opts group [ lindex $argv [ incr i ] ]
+				dict set opts has_group 1
+			}
+			--user {
+				dict set opts user [ lindex $argv [ incr i ] ]
+			}
+			--field {
+				dict set opts field [ lindex $argv [ incr i ] ]
+			}
+			--password-fd {
+				set fd [ lindex $argv [ incr i ] ]
+			}
+			--password-file {
+				set passwordFile [ lindex $argv [ incr i ] ]
+			}
+			--jobs {
+				set jobs [ lindex $argv [ incr i ] ]
+			}
+			--use-agent {
+				set useAgent 1
+			}
+			--agent-file {
+				set agentFile [ lindex $argv [ incr i ] ]
+			}
+			default {
+				if { $database ne "" || [ string match -* $arg ] } {
+					usage
+					return 1
+				}
+				set database $arg
+			}
+		}
+	}
+
+	set query [ dict get $opts query ]
+	if { $query eq "--lock" } {
+		set useAgent 1
+	}
+
+	if { $i > [ llength $argv ] \
+		|| ( $useAgent && ( $database ne "" || $query ni $agentQueries ) ) \
+		|| ( ! $useAgent && $database eq "" ) \
+		|| [ dict get $opts field ] ni {uuid group title user username notes password url} \
+		|| ! [ string is integer -strict $jobs ] || $jobs < 1 } {
+		usage
+		return 1
+	}
+
+	set agentFile [ agentFile $agentFile ]
+
+	if { $useAgent } {
+		package require msgcat
+		namespace eval :: { namespace import msgcat::* }
+		return [ agentQuery $agentFile $opts ]
+	}
+
+	load
+
+	if { $query eq "--verify-all" } {
+		if { $passwordFile ne "" } {
+			set chan [ open $passwordFile RDONLY ]
+			fconfigure $chan -translation auto -encoding utf-8
+			set passwords [ lsearch -all -inline -not [ split [ read $chan ] \n ] "" ]
+			close $chan
+		} else {
+			set passwords [ list [ readPassword $fd ] ]
+		}
+		set status [ verifyAll $database $passwords $jobs ]
+		pwsafe::int::randomizeVar passwords
+		return $status
+	}
+
+	set password [ readPassword $fd ]
+
+	# a backup store directory can be verified as well
+
+	if { $query eq "--verify" && [ file isdirectory $database ] } {
+		set errors [ pwsafe::store::verify $database $password ]
+		pwsafe::int::randomizeVar password
+		foreach error $errors {
+			puts stderr $error
+		}
+		if { [ llength $errors ] > 0 } {
+			return 1
+		}
+		puts "OK [ llength [ pwsafe::store::snapshots $database ] ] snapshots"
+		return 0
+	}
+
+	if { [ catch { set db [ pwsafe::createFromFile $database $password ] } oops ] } {
+		pwsafe::int::randomizeVar password
+		puts stderr [ mc "Can not open password database \"%s\": %s" $database $oops ]
+		return 1
+	}
+	pwsafe::int::randomizeVar password
+
+	set status 0
+
+	switch -- $query {
+
+		--list -
+		--get -
+		--search {
+			lassign [ lookup $db $opts ] status output errors
+			foreach line $output {
+				puts $line
+			}
+			foreach line $errors {
+				puts stderr $line
+			}
+			pwsafe::int::randomizeVar output
+		}
+
+		--export-csv {
+			set target [ dict get $opts arg ]
+			if { $target eq "-" } {
+				set out stdout
+			} else {
+				set out [ open $target {WRONLY CREAT TRUNC} 0600 ]
+			}
+			fconfigure $out -encoding utf-8 -buffering full
+
+			set columns { uuid group title url user password notes }
+			puts $out [ join $columns , ]
+			foreach rn [ $db getAllRecordNumbers ] {
+				if { [ dict get $opts has_group ] && [ field $db $rn group ] ne [ dict get $opts group ] } {
+					continue
+				}
+				set sep ""
+				foreach column $columns {
+					set value [ field $db $rn $column ]
+					if { $column eq "notes" } {
+						set value [ string map {\\ \\\\ \n \\n} $value ]
+					}
+					puts -nonewline $out $sep[ ::gorilla::CsvField $value , ]
+					set sep ,
+					pwsafe::int::randomizeVar value
+				}
+				puts $out ""
+			}
+
+			if { $out ne "stdout" } {
+				close $out
+			} else {
+				flush $out
+			}
+		}
+
+		--verify {
+			# only a failed authentication fails, other warnings are notes
+			foreach warning [ $db cget -warningsDuringOpen ] {
+				puts stderr $warning
+			}
+			if { [ pwsafe::authenticationFailed $db ] } {
+				set status 1
+			}
+			if { $status == 0 } {
+				puts "OK [ llength [ $db getAllRecordNumbers ] ] records"
+			}
+		}
+
+		--agent {
+			# the agent owns db from here on and deletes it when it locks
+			return [ agentServe $db $agentFile ]
+		}
+
+	} ; # end switch query
+
+	itcl::delete object $db
+	return $status
+
+} ; # end proc ::gorilla::cli::main
+
+# ----------------------------------------------------------------------
+# Agent
+# ----------------------------------------------------------------------
+#
+
+proc ::gorilla::cli::agentFile { name } {
+
+	# Returns the normalized name of the agent file, the default if name
+	# is empty
+
+	if { $name eq "" } {
+		set name [ file join ~ .gorilla-agent ]
+	}
+	return [ file normalize $name ]
+
+} ; # end proc ::gorilla::cli::agentFile
+
+# ----------------------------------------------------------------------
+
+proc ::gorilla::cli::writeFrame { chan payload } {
+
+	# Sends the list payload as one frame
+
+	set bytes [ encoding convertto utf-8 $payload ]
+	puts -nonewline $chan "[ string length $bytes ]\n$bytes"
+	flush $chan
+
+} ; # end proc ::gorilla::cli::writeFrame
+
+# ----------------------------------------------------------------------
+
+proc ::gorilla::cli::parseFrame { bufferVar { limit "" } } {
+
+	# Takes one complete frame from the front of the binary string in
+	# bufferVar.  Returns a list of the state and the payload: "ok" and
+	# the payload, "incomplete" if more data is needed, or "error" if the
+	# data can not be the start of a frame, or its payload is longer than
+	# limit bytes.
+
+	upvar 1 $bufferVar buffer
+
+	set newline [ string first \n $buffer ]
+	if { $newline < 0 } {
+		if { [ string length $buffer ] > 10 } {
+			return [ list error {} ]
+		}
+		return [ list incomplete {} ]
+	}
+
+	set length [ string range $buffer 0 [ expr { $newline - 1 } ] ]
+	if { ! [ string is digit -strict $length ] || [ string length $length ] > 10
+	     || ( $limit ne "" && $length > $limit ) } {
+		return [ list error {} ]
+	}
+
+	set end [ expr { $newline + $length } ]
+	if { [ string length $buffer ] <= $end } {
+		return [ list incomplete {} ]
+	}
+
+	set payload [ encoding convertfrom utf-8 [ string range $buffer [ expr { $newline + 1 } ] $end ] ]
+	set buffer [ string range $buffer [ expr { $end + 1 } ] end ]
+	return [ list ok $payload ]
+
+} ; # end proc ::gorilla::cli::parseFrame
+
+# ----------------------------------------------------------------------
+
+proc ::gorilla::cli::agentServe { db file } {
+
+	# Serves the queries of --use-agent against db until the agent locks.
+	# Returns the exit status.
+
+	variable agent
+
+	set agent(db) $db
+	set agent(index) [ titleIndex $db ]
+	binary scan [ ::isaac::bytes 16 ] H* agent(token)
+	set agent(file) $file
+	set agent(done) 0
+
+	if { [ catch { set server [ socket -server ::gorilla::cli::agentAccept -myaddr 127.0.0.1 0 ] } oops ] } {
+		puts stderr [ mc "The agent can not listen: %s" $oops ]
+		agentLock
+		return 1
+	}
+	set port [ lindex [ fconfigure $server -sockname ] 2 ]
+
+	# a new file, so that it is created with the restricted permissions
+
+	if { [ catch {
+		file delete $file
+		set out [ open $file {WRONLY CREAT EXCL} 0600 ]
+		puts $out "$port $agent(token)"
+		close $out
+	} oops ] } {
+		puts stderr [ mc "The agent file \"%s\" can not be written: %s" $file $oops ]
+		close $server
+		agentLock
+		return 1
+	}
+
+	puts [ mc "Agent ready, see %s" $file ]
+	flush stdout
+
+	agentArrangeIdleTimeout
+	vwait ::gorilla::cli::agent(done)
+
+	close $server
+	return 0
+
+} ; # end proc ::gorilla::cli::agentServe
+
+# ----------------------------------------------------------------------
+
+proc ::gorilla::cli::agentArrangeIdleTimeout { } {
+
+	# Restarts the idle timer from the IdleTimeout and LockOnIdleTimeout
+	# preferences of the database, like gorilla::ArrangeIdleTimeout does
+
+	variable agent
+
+	if { [ info exists agent(timer) ] } {
+		after cancel $agent(timer)
+		unset agent(timer)
+	}
+
+	set minutes [ $agent(db) getPreference IdleTimeout ]
+	if { ! [ $agent(db) getPreference LockOnIdleTimeout ] || $minutes <= 0 } {
+		return
+	}
+	set agent(timer) [ after [ expr { $minutes * 60000 } ] ::gorilla::cli::agentLock ]
+
+} ; # end proc ::gorilla::cli::agentArrangeIdleTimeout
+
+# ----------------------------------------------------------------------
+
+proc ::gorilla::cli::agentLock { } {
+
+	# Wipes the unlocked database and the token, removes the agent file
+	# and ends the agent
+
+	variable agent
+
+	if { [ info exists agent(timer) ] } {
+		after cancel $agent(timer)
+	}
+
+	foreach name [ array names agent buffer,* ] {
+		agentClose [ string range $name 7 end ]
+	}
+
+	if { [ info exists agent(file) ] && [ info exists agent(token) ] } {
+		# only remove the file if it is still ours
+		catch {
+			set in [ open $agent(file) r ]
+			set content [ read $in ]
+			close $in
+			if { [ lindex $content 1 ] eq $agent(token) } {
+				file delete $agent(file)
+			}
+			pwsafe::int::randomizeVar content
+		}
+	}
+
+	foreach name { token index } {
+		if { [ info exists agent($name) ] } {
+			pwsafe::int::randomizeVar agent($name)
+		}
+	}
+	if { [ info exists agent(db) ] } {
+		itcl::delete object $agent(db)
+	}
+
+	array unset agent
+	set agent(done) 1
+
+} ; # end proc ::gorilla::cli::agentLock
+
+# ----------------------------------------------------------------------
+
+proc ::gorilla::cli::agentAccept { chan address port } {
+
+	# A connection that did not send its request in time is dropped, so
+	# that idle clients can not pile up open connections
+
+	variable agent
+	variable requestTimeout
+
+	fconfigure $chan -translation binary -blocking 0
+	set agent(buffer,$chan) ""
+	set agent(timeout,$chan) [ after $requestTimeout [ list ::gorilla::cli::agentClose $chan ] ]
+	fileevent $chan readable [ list ::gorilla::cli::agentRead $chan ]
+
+} ; # end proc ::gorilla::cli::agentAccept
+
+# ----------------------------------------------------------------------
+
+proc ::gorilla::cli::agentRead { chan } {
+
+	# Collects the request frame of a connection and answers it.  Every
+	# connection carries one request.
+
+	variable agent
+	variable maxFrame
+
+	if { [ catch { append agent(buffer,$chan) [ read $chan ] } ] } {
+		agentClose $chan
+		return
+	}
+
+	lassign [ parseFrame agent(buffer,$chan) $maxFrame ] state payload
+
+	switch -- $state {
+		incomplete {
+			if { [ eof $chan ] } {
+				agentClose $chan
+			}
+			return
+		}
+		error {
+			agentClose $chan
+			return
+		}
+	}
+
+	set reply [ agentAnswer $payload ]
+	pwsafe::int::randomizeVar payload
+
+	catch {
+		fconfigure $chan -blocking 1
+		writeFrame $chan $reply
+	}
+	pwsafe::int::randomizeVar reply
+	agentClose $chan
+
+	if { [ info exists agent(lock) ] } {
+		agentLock
+	}
+
+} ; # end proc ::gorilla::cli::agentRead
+
+# ----------------------------------------------------------------------
+
+proc ::gorilla::cli::agentClose { chan } {
+
+	variable agent
+
+	if { [ info exists agent(timeout,$chan) ] } {
+		after cancel $agent(timeout,$chan)
+	}
+	catch { close $chan }
+	unset -nocomplain agent(buffer,$chan) agent(timeout,$chan)
+
+} ; # end proc ::gorilla::cli::agentClose
+
+# ----------------------------------------------------------------------
+
+proc ::gorilla::cli::tokenEqual { token expected } {
+
+	# Compares a token with the expected one in a time that does not
+	# depend on where they differ, so that the agent token can not be
+	# guessed one character at a time
+
+	if { [ string length $token ] != [ string length $expected ] } {
+		return 0
+	}
+	set diff 0
+	foreach a [ split $token "" ] b [ split $expected "" ] {
+		set diff [ expr { $diff | ( [ scan $a %c ] ^ [ scan $b %c ] ) } ]
+	}
+	return [ expr { $diff == 0 } ]
+
+} ; # end proc ::gorilla::cli::tokenEqual
+
+# ----------------------------------------------------------------------
+
+proc ::gorilla::cli::agentAnswer { payload } {
+
+	# Returns the reply to a request payload {token opts}: the list of the
+	# exit status, stdout lines and stderr lines, as from lookup
+
+	variable agent
+	variable agentQueries
+
+	set refused [ list 1 {} [ list [ mc "The agent refused the request." ] ] ]
+
+	if { [ catch { lassign $payload token opts ; dict size $opts } ]
+	     || [ llength $payload ] != 2 || ! [ tokenEqual $token $agent(token) ] } {
+		return $refused
+	}
+	pwsafe::int::randomizeVar token
+
+	foreach key { query arg group has_group user field } {
+		if { ! [ dict exists $opts $key ] } {
+			return $refused
+		}
+	}
+	if { [ dict get $opts query ] ni $agentQueries
+	     || ! [ string is boolean -strict [ dict get $opts has_group ] ]
+	     || [ dict get $opts field ] ni {uuid group title user username notes password url} } {
+		return $refused
+	}
+
+	if { [ dict get $opts query ] eq "--lock" } {
+		set agent(lock) 1
+		return [ list 0 {} {} ]
+	}
+
+	agentArrangeIdleTimeout
+	return [ lookup $agent(db) $opts $agent(index) ]
+
+} ; # end proc ::gorilla::cli::agentAnswer
+
+# ----------------------------------------------------------------------
+
+proc ::gorilla::cli::agentQuery { file opts } {
+
+	# Sends the query in opts to the agent named in file and prints its
+	# reply.  Returns the exit status.
+
+	if { [ catch {
+		set in [ open $file r ]
+		lassign [ read $in ] port token
+		close $in
+		set chan [ socket 127.0.0.1 $port ]
+	} oops ] } {
+		puts stderr [ mc "No agent is running: %s" $oops ]
+		return 1
+	}
+
+	fconfigure $chan -translation binary
+	set buffer ""
+	if { [ catch {
+		writeFrame $chan [ list $token $opts ]
+		while { ! [ eof $chan ] } {
+			append buffer [ read $chan ]
+		}
+		close $chan
+	} oops ] } {
+		catch { close $chan }
+		puts stderr [ mc "The agent did not answer: %s" $oops ]
+		return 1
+	}
+
+	lassign [ parseFrame buffer ] state reply
+	if { $state ne "ok" || [ catch { lassign $reply status output errors } ] } {
+		puts stderr [ mc "The agent did not answer: %s" $state ]
+		return 1
+	}
+
+	foreach line $output {
+		puts $line
+	}
+	foreach line $errors {
+		puts stderr $line
+	}
+	return $status
+
+} ; # end proc ::gorilla::cli::agentQuery
@@ -46,6 +46,81 @@ namespace eval ::gorilla {
 	variable PicsDir [ file join $::gorilla::Dir pics ]
 }
 
+# ----------------------------------------------------------------------
+# Startup timeline
+# ----------------------------------------------------------------------
+#
+# Every package load and init phase up to the password prompt of the
+# open dialog is recorded here.  With --startup-timeline the list is
+# printed to stderr once the prompt is shown.
+
+namespace eval ::gorilla::startup {
+	variable start [ clock microseconds ]
+	variable last $start
+	variable timeline [ list ]
+	variable show [ expr { "--startup-timeline" in $::argv } ]
+}
+
+proc ::gorilla::startup::mark { phase } {
+
+	# Records the time spent since the previous mark under the name phase
+
+	variable last
+	variable timeline
+
+	set now [ clock microseconds ]
+	lappend timeline $phase [ expr { $now - $last } ] $now
+	set last $now
+
+} ; # end proc ::gorilla::startup::mark
+
+proc ::gorilla::startup::report { } {
+
+	# Prints the timeline to stderr if it was asked for, but only once
+
+	variable start
+	variable timeline
+	variable show
+
+	if { ! $show } {
+		return
+	}
+	set show 0
+
+	puts stderr [ format "%-28s %10s %10s" phase ms total ]
+	foreach { phase elapsed now } $timeline {
+		puts stderr [ format "%-28s %10.1f %10.1f" $phase \
+			[ expr { $elapsed / 1000.0 } ] [ expr { ( $now - $start ) / 1000.0 } ] ]
+	}
+
+} ; # end proc ::gorilla::startup::report
+
+proc ::gorilla::startup::backends { } {
+
+	# Logs to stderr which Twofish and sha256 implementations were
+	# loaded. Without the C accelerators both run in Tcl and opening a
+	# database is much slower; "make" in the top directory builds them
+	# for this machine.
+
+	set backends [ pwsafe::int::cryptoBackends ]
+	puts stderr [ format "Password Gorilla: twofish %s, sha256 %s" \
+		[ dict get $backends twofish ] [ dict get $backends sha256 ] ]
+
+} ; # end proc ::gorilla::startup::backends
+
+# ----------------------------------------------------------------------
+# The headless queries (--list, --get, --export-csv, --verify) run
+# without Tk, so they are dispatched before Tk is loaded
+# ----------------------------------------------------------------------
+#
+
+source [ file join $::gorilla::Dir cli.tcl ]
+
+if { [ ::gorilla::cli::requested $argv ] } {
+	exit [ ::gorilla::cli::main $argv ]
+}
+::gorilla::startup::mark cli.tcl
+
 # ----------------------------------------------------------------------
 # Make sure that our prerequisite packages are available. Don't want
 # that to fail with a cryptic error message.
@@ -61,6 +136,7 @@ if {[catch {package require Tk 8.5} oops]} {
 	puts "Reason: '$oops'"
 	exit 1
 }
+::gorilla::startup::mark "package Tk"
 
 # Fix the issue of TTk widgets having different default background colors
 # from Tk widgets (esp.  toplevel widgets) by automatically placing a TTk
@@ -122,7 +198,10 @@ proc load-package { args } {
 
 	foreach package $args {
 
-		if { [ catch "package require $package" catchResult catchOptions ] } {
+		set failed [ catch "package require $package" catchResult catchOptions ]
+		::gorilla::startup::mark "package $package"
+
+		if { $failed } {
 
 			# a package load error occurred - create log file and report to user
 
@@ -202,6 +281,7 @@ load-package msgcat
 namespace import msgcat::*
 
 mcload [file join $::gorilla::Dir msgs]
+::gorilla::startup::mark "msgs catalog"
 # The message files will be loaded according to the system's actual
 # language. During initialization of Gorilla's preferences the command
 # 'mclocale' will set the language accoring to Gorilla's resource file.
@@ -210,10 +290,11 @@ mcload [file join $::gorilla::Dir msgs]
 # without regard to the Unix LOCALE configuration
 
 #
-# The isaac and viewhelp packages should be in the current directory
+# The isaac package should be in the current directory.  viewhelp.tcl is
+# only sourced when the help is first opened, see gorilla::Help
 #
 
-foreach file {isaac.tcl viewhelp.tcl} {
+foreach file {isaac.tcl} {
 	if {[catch {source [file join $::gorilla::Dir $file]} oops]} {
 		wm withdraw .
 		tk_messageBox -type ok -icon error -default ok \
@@ -224,6 +305,7 @@ foreach file {isaac.tcl viewhelp.tcl} {
 			distribution.\n\nError message: %s" $file $oops ]
 		exit 1
 	}
+	::gorilla::startup::mark $file
 } ; unset file
 
 #
@@ -256,16 +338,13 @@ set auto_path [ list $::gorilla::Dir [ file join $::gorilla::Dir tcllib ] {*}$au
 # Initialize the Tcl modules system to look into modules/ directory
 ::tcl::tm::add [ file join $::gorilla::Dir modules ]
 
-foreach package {Itcl pwsafe tooltip PWGprogress} {
+# tooltip is only used by the preferences dialog and is loaded there
+
+foreach package {Itcl pwsafe PWGprogress} {
 	load-package $package
 } ; unset package
 
-#
-# If installed, we can use the uuid package (part of Tcllib) to generate
-# UUIDs for new logins, but we don't depend on it.
-#
-
-catch {package require uuid}
+::gorilla::startup::backends
 
 # Detect whether or not the file containing download sites exists
 set ::gorilla::hasDownloadsFile [ file exists [ file join $::gorilla::Dir downloads.txt ] ]
@@ -300,6 +379,8 @@ proc gorilla::Init {} {
 	catch {unset ::gorilla::statusClearId}
 	catch {unset ::gorilla::clipboardClearId}
 	catch {unset ::gorilla::idleTimeoutTimerId}
+	catch {unset ::gorilla::watchTimerId}
+	set ::gorilla::watchBusy 0
 
 	if {[llength [trace info variable ::gorilla::status]] == 0} {
 		trace add variable ::gorilla::status write ::gorilla::StatusModified
@@ -319,9 +400,12 @@ proc gorilla::Init {} {
 		autoclearMultiplier    { 1       { {value} { expr { ( [ string is integer $value ] ) && ( $value >= 0 ) } } }         }
 		autocopyUserid         { 0       { {value} { string is boolean $value } }                                             }
 		backupPath             { {}      { {value} { file exists $value } }                                                   }
+		backupStore            { 0       { {value} { string is boolean $value } }                                             }
+		backupStoreKeep        { 30      { {value} { expr { ( [ string is integer $value ] ) && ( $value >= 0 ) } } }         }
 		browser-exe            { {}      { {value} { return true } }                                                          }
 		browser-param          { {}      { {value} { return true } }                                                          }
 		caseSensitiveFind      { 0       { {value} { string is boolean $value } }                                             }
+		compactRecords         { 1       { {value} { string is boolean $value } }                                             }
 		clearClipboardAfter    { 0       { {value} { expr { ( [ string is integer $value ] ) && ( $value >= 0 ) } } }         }
 		defaultVersion         { 3       { {value} { expr { ( [ string is integer $value ] ) && ( $value >= 0 ) } } }         }
 		doubleClickAction      { nothing { {value} { return true } }                                                          }
@@ -343,6 +427,7 @@ proc gorilla::Init {} {
 		hideLogins             { 0       { {value} { string is boolean $value } }                                             }
 		iconifyOnAutolock      { 0       { {value} { string is boolean $value } }                                             }
 		idleTimeoutDefault     { 5       { {value} { expr { ( [ string is integer $value ] ) && ( $value >= 0 ) } } }         }
+		keyStretchTclCeiling   { 10      { {value} { expr { ( [ string is integer $value ] ) && ( $value >= 0 ) } } }         }
 		keepBackupFile         { 0       { {value} { string is boolean $value } }                                             }
 		lang                   { en      { {value} { return true } }                                                          }
 		lockDatabaseAfter      { 0       { {value} { expr { ( [ string is integer $value ] ) && ( $value >= 0 ) } } }         }
@@ -352,6 +437,7 @@ proc gorilla::Init {} {
 		saveImmediatelyDefault { 0       { {value} { string is boolean $value } }                                             }
 		timeStampBackup        { 0       { {value} { string is boolean $value } }                                             }
 		unicodeSupport         { 1       { {value} { expr { ( [ string is integer $value ] ) && ( $value >= 0 ) } } }         }
+		watchInterval          { 5       { {value} { expr { ( [ string is integer $value ] ) && ( $value >= 0 ) } } }         }
 
 	} ; # end set ::gorilla::preferences(all-preferences)
 
@@ -447,11 +533,14 @@ proc gorilla::InitGui {} {
 		"[ mc File ]" file {"[ mc New ] ..."         {}   gorilla::New         ""
 		                    "[ mc Open ] ..."        {}   gorilla::Open        $menu_meta+O
 		                    "[ mc Merge ] ..."       open gorilla::Merge       ""
+		                    "[ mc "Merge with Base" ] ..." open gorilla::MergeWithBase ""
 		                    "[ mc Save ]"            save gorilla::Save        $menu_meta+S
 		                    "[ mc "Save As" ] ..."   open gorilla::SaveAs      ""
+		                    "[ mc "Restore Backup" ] ..." open gorilla::RestoreBackup ""
 		                    separator                ""   ""                   ""
 		                    "[ mc Export ] ..."      open gorilla::Export      ""
 		                    "[ mc Import ] ..."      open gorilla::Import      ""
+		                    "[ mc "Check Import" ] ..." open {gorilla::Import "" 1} ""
 		                    separator                mac  ""                   ""
 		                    "[ mc Preferences ] ..." mac  gorilla::Preferences ""
 		                    separator                mac  ""                   ""
@@ -483,14 +572,24 @@ proc gorilla::InitGui {} {
 				
 		"[ mc Security ]" security {"[ mc "Password Policy" ] ..."        open gorilla::PasswordPolicy            ""
 				            "[ mc Customize ] ..."                open gorilla::DatabasePreferencesDialog ""
+				            "[ mc "Rotate Passwords" ] ..."       open gorilla::RotatePasswords           ""
+				            "[ mc "Password Audit" ] ..."         open gorilla::PasswordAudit             ""
 				            separator                             ""   ""                                 ""
 				            "[ mc "Change Master Password" ] ..." open gorilla::ChangePassword            ""
 				            separator                             ""   ""                                 ""
 				            "[ mc "Lock now" ]"                   open gorilla::LockDatabase              $menu_meta+L
 				           }
 
+		"[ mc Vaults ]" vaults {"[ mc "Open Vaults" ] ..."         vaults gorilla::OpenVaults ""
+				        "[ mc "Find in All Vaults" ] ..." open gorilla::FindInVaults ""
+				        "[ mc "Close Vault" ]"            open gorilla::CloseVault   ""
+				        separator                         ""   ""                    ""
+				       }
+
 		"[ mc Help ]" help {"[ mc Help ] ..." mac  gorilla::Help    ""
 				    "[ mc License ] ..."          ""   gorilla::License ""
+				    "[ mc Timings ] ..."          ""   gorilla::Timings ""
+				    "[ mc "Memory Report" ] ..."  open gorilla::MemoryReport ""
 				    "[ mc "Look for Update"]"     dld  gorilla::versionLookup ""
 				    separator                     mac  ""  ""
 				    "[ mc About ] ..."            mac tkAboutDialog ""
@@ -623,22 +722,26 @@ proc gorilla::InitGui {} {
 
 	catch {bind . <MouseWheel> "$tree yview scroll \[expr {-%D/120}\] units"}
 
-	bind . <$meta-o> {.mbar.file invoke 1}
-	bind . <$meta-s> {.mbar.file invoke 3}
-	bind . <$meta-x> {.mbar.file invoke 11}
+	# the entries are looked up by their label, as their positions change
+	# whenever the menus get new entries
+
+	bind . <$meta-o> [list gorilla::InvokeMenuEntry .mbar.file "[mc Open] ..."]
+	bind . <$meta-s> [list gorilla::InvokeMenuEntry .mbar.file [mc Save]]
+	bind . <$meta-x> [list gorilla::InvokeMenuEntry .mbar.file [mc Exit]]
 	
-	bind . <$meta-u> {.mbar.edit invoke 0}
-	bind . <$meta-p> {.mbar.edit invoke 1}
-	bind . <$meta-w> {.mbar.edit invoke 2}
-	bind . <$meta-c> {.mbar.edit invoke 4}
-	bind . <$meta-f> {.mbar.edit invoke 6}
-	bind . <$meta-g> {.mbar.edit invoke 7}
+	bind . <$meta-u> [list gorilla::InvokeMenuEntry .mbar.edit [mc "Copy Username"]]
+	bind . <$meta-p> [list gorilla::InvokeMenuEntry .mbar.edit [mc "Copy Password"]]
+	bind . <$meta-w> [list gorilla::InvokeMenuEntry .mbar.edit [mc "Copy URL"]]
+	bind . <$meta-c> [list gorilla::InvokeMenuEntry .mbar.edit [mc "Clear Clipboard"]]
+	bind . <$meta-f> [list gorilla::InvokeMenuEntry .mbar.edit "[mc Find] ..."]
+	bind . <$meta-g> [list gorilla::InvokeMenuEntry .mbar.edit [mc "Find next"]]
 
-	bind . <$meta-a> {.mbar.login invoke 0}
-	bind . <$meta-e> {.mbar.login invoke 1}
-	bind . <$meta-v> {.mbar.login invoke 2}
+	bind . <$meta-a> [list gorilla::InvokeMenuEntry .mbar.login [mc "Add Login"]]
+	bind . <$meta-e> [list gorilla::InvokeMenuEntry .mbar.login [mc "Edit Login"]]
+	bind . <$meta-v> [list gorilla::InvokeMenuEntry .mbar.login [mc "View Login"]]
 
-	bind . <$meta-l> {.mbar.security invoke 5}
+	# locking must not depend on the position of "Lock now"
+	bind . <$meta-l> gorilla::LockDatabase
 
 	# bind . <$meta-L> "gorilla::Reload"
 	# bind . <$meta-R> "gorilla::Refresh"
@@ -780,6 +883,51 @@ proc gorilla::InitPRNG {{seed ""}} {
 
 } ; # end proc gorilla::InitPRNG
 
+proc gorilla::GenerateUUIDs {{count 1}} {
+
+	# Returns a list of count random (version 4, RFC 4122) UUIDs in their
+	# usual string representation.  The random bits are taken from the
+	# ISAAC generator seeded by InitPRNG, in one block for all of them.
+	#
+	# count - the number of UUIDs to generate
+
+	set uuids [ list ]
+	set random [ ::isaac::bytes [ expr { 16 * $count } ] ]
+
+	for { set i 0 } { $i < $count } { incr i } {
+		binary scan [ string range $random [ expr { 16 * $i } ] [ expr { 16 * $i + 15 } ] ] \
+			H8H4H4H4H12 time_low time_mid time_hi clock_seq node
+
+		# set the version (4) and variant (10x) bits
+		set time_hi "4[ string range $time_hi 1 end ]"
+		set clock_seq "[ string index 89ab89ab89ab89ab [ scan [ string index $clock_seq 0 ] %x ] ][ string range $clock_seq 1 end ]"
+
+		lappend uuids "$time_low-$time_mid-$time_hi-$clock_seq-$node"
+	}
+
+	pwsafe::int::randomizeVar random
+	return $uuids
+
+} ; # end proc gorilla::GenerateUUIDs
+
+proc gorilla::InvokeMenuEntry {menu label} {
+
+	# Invokes the command entry of menu with the label, like a click on
+	# it; nothing happens if it is disabled or not there
+
+	set last [$menu index end]
+	if {$last eq "none"} {
+		return
+	}
+	for {set index 0} {$index <= $last} {incr index} {
+		if {[$menu type $index] eq "command" && \
+			[$menu entrycget $index -label] eq $label} {
+			$menu invoke $index
+			return
+		}
+	}
+}
+
 proc setmenustate {widget tag_pattern state} {
 	if {$tag_pattern eq "all"} {
 		foreach {menu_name menu_widget menu_itemlist} $::gorilla::menu_desc {
@@ -882,6 +1030,9 @@ proc gorilla::TreeNodeSelectionChanged {} {
 
 proc gorilla::TreeNodeDouble {node} {
 	ArrangeIdleTimeout
+	if {[StillLoading]} {
+		return
+	}
 	focus $::gorilla::widgets(tree)
 	$::gorilla::widgets(tree) see $node
 
@@ -922,6 +1073,9 @@ proc gorilla::TreeNodeDouble {node} {
 
 proc gorilla::TreeNodePopup {node} {
 	ArrangeIdleTimeout
+	if {[StillLoading]} {
+		return
+	}
 	TreeNodeSelect $node
 
 	set xpos [expr [winfo pointerx .] + 5]
@@ -1145,6 +1299,14 @@ proc gorilla::CollectTicks {} {
 proc gorilla::New {} {
 	ArrangeIdleTimeout
 
+	#
+	# A database that is still being read is given up, see Open
+	#
+
+	if {[info exists ::gorilla::loading]} {
+		StopLoading
+	}
+
 	#
 	# If the current database was modified, give user a chance to think
 	#
@@ -1254,6 +1416,7 @@ proc gorilla::New {} {
 		gorilla::SaveAs
 	}
 	UpdateMenu
+	UpdateVaultsMenu
 }
 
 # ----------------------------------------------------------------------
@@ -1268,7 +1431,12 @@ proc gorilla::DestroyOpenDatabaseDialog {} {
 ;# proc gorilla::OpenDatabase {title defaultFile} {}
 	
 # proc gorilla::OpenDatabase {title {defaultFile ""}} {
-proc gorilla::OpenDatabase {title {defaultFile ""} {allowNew 0}} {
+proc gorilla::OpenDatabase {title {defaultFile ""} {allowNew 0} {progressive 0}} {
+
+	# With progressive 1, only the header of a V3 file is read here, and
+	# the records are left to pwsafe::continueReading.  The open is then
+	# timed as a pwsafe::timing operation, whose handle is the fourth
+	# element of the result; the caller ends it.
 
 	ArrangeIdleTimeout
 	set top .openDialog
@@ -1403,6 +1571,9 @@ proc gorilla::OpenDatabase {title {defaultFile ""} {allowNew 0}} {
 	set ::gorilla::collectedTicks [list [clock clicks]]
 	gorilla::InitPRNG [join $::gorilla::collectedTicks -] ;# not a very good seed yet
 
+	::gorilla::startup::mark "password prompt"
+	::gorilla::startup::report
+
 	while {42} {
 		ArrangeIdleTimeout
 		set ::gorilla::guimutex 0
@@ -1463,9 +1634,18 @@ proc gorilla::OpenDatabase {title {defaultFile ""} {allowNew 0}} {
 			set pvar [ ::gorilla::progress init -win $aframe.info -message [ mc "Opening ... %d %%" ] -max 200 ]
 			
 
+			set timing ""
+			if { $progressive } {
+				set openCommand pwsafe::openFile
+				set timing [ pwsafe::timing::begin open $fileName ]
+			} else {
+				set openCommand pwsafe::createFromFile
+			}
+
 #set a [ clock milliseconds ]
-			if { [ catch { set newdb [ pwsafe::createFromFile $fileName $password \
-						 $pvar ] } oops ] } {
+			if { [ catch { set newdb [ $openCommand $fileName $password \
+						 $pvar $timing ] } oops ] } {
+				pwsafe::timing::end $timing
 				pwsafe::int::randomizeVar password
 				::gorilla::progress finished $aframe.info
 				. configure -cursor $dotOldCursor
@@ -1589,7 +1769,7 @@ proc gorilla::OpenDatabase {title {defaultFile ""} {allowNew 0}} {
 	#
 
 	ArrangeIdleTimeout
-	return [list "Open" $fileName $newdb]
+	return [list "Open" $fileName $newdb $timing]
 }
 
 #
@@ -1602,6 +1782,14 @@ proc gorilla::OpenDatabase {title {defaultFile ""} {allowNew 0}} {
 
 proc gorilla::Open {{defaultFile ""}} {
 
+	#
+	# A database that is still being read is given up for the new one
+	#
+
+	if {[info exists ::gorilla::loading]} {
+		StopLoading
+	}
+
 	#
 	# If the current database was modified, give user a chance to think
 	#
@@ -1635,10 +1823,11 @@ proc gorilla::Open {{defaultFile ""}} {
 		set ::gorilla::collectedTicks [list [clock clicks]]
 		gorilla::InitPRNG [join $::gorilla::collectedTicks -] ;# not a very good seed yet
 		set fileName [file join $::gorilla::Dir ../unit-tests testdb.psafe3]
-		set newdb [pwsafe::createFromFile $fileName test ::gorilla::openPercent]
-		set openInfo [list "Open" $fileName $newdb ]
+		set timing [pwsafe::timing::begin open $fileName]
+		set newdb [pwsafe::createFromFile $fileName test ::gorilla::openPercent $timing]
+		set openInfo [list "Open" $fileName $newdb $timing]
 	} else {
-		set openInfo [OpenDatabase [mc "Open Password Database"] $defaultFile 1]
+		set openInfo [OpenDatabase [mc "Open Password Database"] $defaultFile 1 1]
 	}
 	
 	set action [lindex $openInfo 0]
@@ -1652,15 +1841,32 @@ proc gorilla::Open {{defaultFile ""}} {
 
 	set fileName [lindex $openInfo 1]
 	set newdb [lindex $openInfo 2]
+	set timing [lindex $openInfo 3]
 	set nativeName [file nativename $fileName]
 
 	wm title . "Password Gorilla - $nativeName"
 
-	if {[info exists ::gorilla::db]} {
-		itcl::delete object $::gorilla::db
+	#
+	# The records of a file that is read from the event loop are shown
+	# as they come, see LoadRecords.  The current database is kept until
+	# the file is authenticated, to be put back if it is not.
+	#
+
+	if {[pwsafe::isReading $newdb]} {
+		set previous ""
+		if {[info exists ::gorilla::db]} {
+			set previous [ActiveVault]
+		}
+		set ::gorilla::loading [dict create db $newdb fileName $fileName \
+			previous $previous records 0 timing $timing]
+		set ::gorilla::status [mc "Reading password database %s ..." $nativeName]
+	} else {
+		if {[info exists ::gorilla::db]} {
+			itcl::delete object $::gorilla::db
+		}
+		set ::gorilla::status [mc "Password database %s loaded." $nativeName ]
 	}
 
-	set ::gorilla::status [mc "Password database %s loaded." $nativeName ]
 	set ::gorilla::fileName $fileName
 	set ::gorilla::db $newdb
 	set ::gorilla::dirty 0
@@ -1680,169 +1886,818 @@ proc gorilla::Open {{defaultFile ""}} {
 		-values [list Root]
 
 	FocusRootNode
-	AddAllRecordsToTree
+
+	if {[info exists ::gorilla::loading]} {
+		UpdateMenu
+		UpdateVaultsMenu
+		pwsafe::continueReading $newdb gorilla::LoadRecords gorilla::LoadDone
+		return "Open"
+	}
+
+	# the tree build is added to the timing report of the open
+	pwsafe::timing::measure $timing "tree build" AddAllRecordsToTree
+	pwsafe::timing::count $timing "tree nodes" [ llength [ array names ::gorilla::groupNodes ] ]
+	pwsafe::timing::end $timing
+
+	WatchFile $newdb $fileName
+
 	UpdateMenu
+	UpdateVaultsMenu
 	return "Open"
 }
 
-#
-# ----------------------------------------------------------------------
-# Non-modal password add/edit dialog boxes
-# ----------------------------------------------------------------------
-#
-
-#
-# Put everything into a namespace so that there is no interference with the
-# rest of PWGorilla
-#
-# The code will be ready for refactoring in regard to OO facilities in Tcl/Tk 8.6
-#
+proc gorilla::LoadRecords {db rns} {
 
-namespace eval ::gorilla::LoginDialog { 
+	# Adds the records rns of the database that Open reads to the tree
 
-	namespace path ::gorilla
+	if {![info exists ::gorilla::loading] || [dict get $::gorilla::loading db] ne $db} {
+		return
+	}
 
-	variable seq 0
-	
-	# The idle-windows list and the push/pop procs are used to impliment
-	# window reuse like in the rest of PWGorilla.  However the normal
-	# PWGorilla method of window reuse does not work when there are
-	# multiple windows to be remembered.  Idle-windows is a stack of
-	# toplevel names that are not in use and push/pop manipulate that
-	# stack in the obvious manner
-	 
-	variable idle-windows [ list ]
+	pwsafe::timing::measure [dict get $::gorilla::loading timing] "tree build" {AddRecordsToTree $rns}
+	dict incr ::gorilla::loading records [llength $rns]
+	set ::gorilla::status [mc "Reading password database %s ... %d logins" \
+		[file nativename [dict get $::gorilla::loading fileName]] \
+		[dict get $::gorilla::loading records]]
+}
 
-	namespace import ::tcl::mathop::+ ::tcl::mathop::* ::tcl::mathop::/ 
+proc gorilla::LoadDone {db authentic message} {
 
-	# arbiter is a dict used to prevent more than one open edit dialog for an
-	# individual db record number
+	# Called when the database that Open reads is complete.  If the file
+	# is authentic, the database replaces the previous one for good, else
+	# the previous one is put back.
 
-	variable arbiter [ dict create ]
-  
-# -----------------------------------------------------------------------------
+	if {![info exists ::gorilla::loading] || [dict get $::gorilla::loading db] ne $db} {
+		return
+	}
 
-	proc push { win } {
+	set loading $::gorilla::loading
+	unset ::gorilla::loading
+	set previous [dict get $loading previous]
+	set nativeName [file nativename [dict get $loading fileName]]
+	set timing [dict get $loading timing]
 
-		# add an window name to the end of the namespace variable idle-windows
-		# win - the window name to "push" onto the idle-windows stack variable
-		# Side-effect: Modifes namespace variable idle-windows.
-		#
-		# This is used to maintain a list of "inactive" withdrawn dialogs for
-		# reuse in future edit requests.  Such avoids having to rebuild both the
-		# dialog as well as the dialog state space and GUI handling procs.
+	if {$authentic} {
+		if {$previous ne ""} {
+			itcl::delete object [dict get $previous db]
+		}
+		pwsafe::timing::count $timing "tree nodes" [ llength [ array names ::gorilla::groupNodes ] ]
+		pwsafe::timing::end $timing
+		WatchFile $db [dict get $loading fileName]
+		set ::gorilla::status [mc "Password database %s loaded." $nativeName ]
+		UpdateMenu
+		UpdateVaultsMenu
+		return
+	}
 
-		variable idle-windows
-		lappend idle-windows $win
-	} ; # end proc push
+	pwsafe::timing::end $timing
+	itcl::delete object $db
+	RestorePrevious $previous
+	set message [mc "Can not open password database \"%s\": %s" $nativeName $message]
+	set ::gorilla::status $message
+	tk_messageBox -parent . -type ok -icon error -default ok \
+		-title [mc "Error Opening Database"] -message $message
+}
 
-# -----------------------------------------------------------------------------
+proc gorilla::StopLoading {} {
 
-	# see http://wiki.tcl.tk/1923
-	proc K { x y } { set x }
+	# Gives up the database that Open reads, and puts the previous one back
 
-# -----------------------------------------------------------------------------
+	set loading $::gorilla::loading
+	unset ::gorilla::loading
+	pwsafe::stopReading [dict get $loading db]
+	pwsafe::timing::end [dict get $loading timing]
+	itcl::delete object [dict get $loading db]
+	RestorePrevious [dict get $loading previous]
+}
 
-	proc pop { } {
+proc gorilla::RestorePrevious {previous} {
 
-		# Remove a window name from the stack in the idle-windows namespace variable.
-		# Side-effect: Modifes namespace variable idle-windows.
-		#
-		# This is used to maintain a list of "inactive" withdrawn dialogs for
-		# reuse in future edit requests.  Such avoids having to rebuild both the
-		# dialog as well as the dialog state space and GUI handling procs.
+	# Makes previous, a vault dict of ActiveVault or "", the current
+	# database again after an open that did not complete
 
-		variable idle-windows
-		return [ K [ lindex ${idle-windows} end ] [ set idle-windows [ lrange ${idle-windows} 0 end-1 ] ] ]
-		# returns the name of the window that was popped from the stack.
+	if {$previous eq ""} {
+		unset -nocomplain ::gorilla::db ::gorilla::fileName
+		set ::gorilla::dirty 0
+		wm title . "Password Gorilla"
+		$::gorilla::widgets(tree) selection set ""
+		$::gorilla::widgets(tree) delete [$::gorilla::widgets(tree) children {}]
+		catch {array unset ::gorilla::groupNodes}
+	} else {
+		set ::gorilla::db [dict get $previous db]
+		set ::gorilla::dirty [dict get $previous dirty]
+		if {[dict get $previous fileName] ne ""} {
+			set ::gorilla::fileName [dict get $previous fileName]
+			wm title . "Password Gorilla - [file nativename $::gorilla::fileName]"
+		} else {
+			unset -nocomplain ::gorilla::fileName
+			wm title . "Password Gorilla"
+		}
+		RebuildTree
 	}
+	UpdateMenu
+	UpdateVaultsMenu
+}
 
-# -----------------------------------------------------------------------------
+proc gorilla::StillLoading {} {
 
-	proc info { } {
-		# A testing proc for debugging purposes
-		variable idle-windows
-		return "idle-windows -> '${idle-windows}'"
-		# returns the contents of the idle-windows namespace variable stack
+	# Returns 1 while Open still reads the database, and says so in the
+	# status line.  Nothing is copied, edited or saved before the whole
+	# file is read and authenticated.
+
+	if {[info exists ::gorilla::loading]} {
+		set ::gorilla::status [mc "Please wait until the password database is read completely."]
+		return 1
 	}
+	return 0
+}
 
-# -----------------------------------------------------------------------------
+#
+# ----------------------------------------------------------------------
+# Workspace of several open databases (vaults)
+# ----------------------------------------------------------------------
+#
+# The active vault is the one in ::gorilla::db, ::gorilla::fileName and
+# ::gorilla::dirty, shown in the tree; everything else works on it as
+# before.  The other open vaults are kept in ::gorilla::vaults, indexed
+# by an id, as a dict with the keys db, fileName and dirty.  Switching
+# exchanges the active vault with one of them and rebuilds the tree, so
+# that no key stretching is needed again.
+#
 
-	# parameters ================================================================
-	# -rn       - record number to edit, default of -999 means create new record
-	# -group    - initial group name to use for creation of a new record
-	# -treenode - the ttk::treeview node ID for editing an existing record
-	#           + This is simply passed through to the final Ok proc for use
-	#           + in updating an existing record in the treeview.
-	# ===========================================================================
+proc gorilla::RebuildTree {} {
 
-	proc LoginDialog { args } {
+	# Replaces the tree by the groups and logins of ::gorilla::db
 
-		# Open a dialog to edit/create an entry in the login DB.
-		#
-		# -rn - Record number from Itcl login DB to edit.  Magic record number
-		#  -999 is defined to mean edit a new (blank) record.  Defaults to -999
-		#  if not provided.
-		#
-		# -group - Set initial "group" name to apply to a new record.  This
-		#  initializes the "group" field of the edit dialog.
-		#
-		# -treenode - The ttk::treeview node ID of an existing record when a
-		#  user requests editing of an existing record.  This is used to update
-		#  the tree display when a user clicks "Ok" to their changes.
-		#
-		# Requirements: If -rn is not -999 then the record number must exist in
-		# the Itcl DB when called.  In addition, to edit an existing record, the
-		# -treenode value must also be passed in.
-		#
-		# Additionally, a simple check is made such that there is a one to one
-		# mapping of existing record numbers to open edit dialogs.  It is
-		# disallowed to edit the exact same record in two independent dialogs
-		# simultaneously.
+	if {[info exists ::gorilla::fileName]} {
+		set rootName [file nativename $::gorilla::fileName]
+	} else {
+		set rootName [mc "<New Database>"]
+	}
 
-		variable arbiter
+	$::gorilla::widgets(tree) selection set ""
+	$::gorilla::widgets(tree) delete [$::gorilla::widgets(tree) children {}]
+	catch {array unset ::gorilla::groupNodes}
 
-		if { 0 != [ expr { [ llength $args ] % 2 } ] } {
-			error "[ namespace current ]::LoginDialog: Must have an even number of arguments."
-		}
+	$::gorilla::widgets(tree) insert {} end -id "RootNode" \
+		-open 1 \
+		-image $::gorilla::images(group) \
+		-text $rootName \
+		-values [list Root]
 
-		ArrangeIdleTimeout
+	FocusRootNode
+	AddAllRecordsToTree
 
-		# very simple command line handling, first set default values, then
-		# overwrite those valies with args (if any)
+	if {$::gorilla::dirty} {
+		$::gorilla::widgets(tree) item "RootNode" -tags red
+	}
+}
 
-		array set {} [ list -rn -999 -group "" -treenode "" ]
-		array set {} $args
+proc gorilla::VaultName {fileName} {
+	if {$fileName eq ""} {
+		return [mc "<New Database>"]
+	}
+	return [file tail $fileName]
+}
 
-		# a bit of sanity checking of the inputs
-		if { $(-rn) != -999 } {
-			# != -999 means an attempt to edit an existing record
-			if { $(-treenode) eq "" } {
-				error "[ namespace current ]::LoginDialog: Editing an existing record requires that -treenode option be non-null."
-			}
-			if { ! [ $::gorilla::db existsRecord $(-rn) ] } {
-				error "[ namespace current ]::LoginDialog: Can not edit a record number ('$(-rn)') which does not exist in the database."
-			}
+proc gorilla::ActiveVault {} {
 
-			# should only have one dialog open per unique record entry in the db
+	# Returns the vault dict of the active vault
 
-			if { [ dict exists $arbiter $(-rn) ] } {
-				wm deiconify [ dict get $arbiter $(-rn) ]
-				raise [ dict get $arbiter $(-rn) ]
-				return
-			}
+	return [dict create db $::gorilla::db \
+		fileName [expr {[info exists ::gorilla::fileName] ? $::gorilla::fileName : ""}] \
+		dirty $::gorilla::dirty]
+}
 
-		} ; # end if -rn != -999
+proc gorilla::AddVault {db fileName} {
 
+	# Adds db as an open vault that is not active, and returns its id
 
-		set top [ pop ] 
-		if { $top ne "" } {
+	set id vault[incr ::gorilla::vaultSeq]
+	set ::gorilla::vaults($id) [dict create db $db fileName $fileName dirty 0]
+	WatchFile $db $fileName
+	UpdateVaultsMenu
+	return $id
+}
 
-			set pvns [ get-pvns-from-toplevel $top ]
+proc gorilla::SwitchVault {id} {
 
-			wm deiconify $top
+	# Makes the vault id the active one, and keeps the active one among
+	# the others
 
-		} else {
+	ArrangeIdleTimeout
+
+	if {[info exists ::gorilla::isLocked] && $::gorilla::isLocked} {
+		return
+	}
+	if {[StillLoading]} {
+		UpdateVaultsMenu
+		return
+	}
+	if {![info exists ::gorilla::vaults($id)]} {
+		return
+	}
+
+	set vault $::gorilla::vaults($id)
+	unset ::gorilla::vaults($id)
+
+	if {[info exists ::gorilla::db]} {
+		set ::gorilla::vaults($id) [ActiveVault]
+	}
+
+	set ::gorilla::db [dict get $vault db]
+	set ::gorilla::dirty [dict get $vault dirty]
+	if {[dict get $vault fileName] ne ""} {
+		set ::gorilla::fileName [dict get $vault fileName]
+		wm title . "Password Gorilla - [file nativename $::gorilla::fileName]"
+	} else {
+		unset -nocomplain ::gorilla::fileName
+		wm title . "Password Gorilla"
+	}
+
+	RebuildTree
+	UpdateMenu
+	UpdateVaultsMenu
+	ArrangeIdleTimeout
+
+	set ::gorilla::status [mc "Switched to %s." [VaultName [dict get $vault fileName]]]
+}
+
+proc gorilla::UpdateVaultsMenu {} {
+
+	# Lists the open vaults at the end of the Vaults menu, the active one
+	# checked.  They can not be switched to while a database is read.
+
+	set menu $::gorilla::widgets(main).vaults
+	set state [expr {[info exists ::gorilla::loading] ? "disabled" : "normal"}]
+	set first [llength $::gorilla::tag_list(vaults)]
+	if {[$menu index end] ne "none" && [$menu index end] >= $first} {
+		$menu delete $first end
+	}
+
+	if {[info exists ::gorilla::db]} {
+		set active [ActiveVault]
+		$menu add radiobutton -label [VaultName [dict get $active fileName]] \
+			-variable ::gorilla::activeVaultMenu -value active -state $state
+	}
+	foreach id [lsort -dictionary [array names ::gorilla::vaults]] {
+		$menu add radiobutton \
+			-label [VaultName [dict get $::gorilla::vaults($id) fileName]] \
+			-variable ::gorilla::activeVaultMenu -value $id -state $state \
+			-command [list gorilla::SwitchVault $id]
+	}
+	set ::gorilla::activeVaultMenu active
+}
+
+proc gorilla::VaultPasswordsDialog {fileNames} {
+
+	# Asks for the passwords of several databases in one dialog.  Returns
+	# the list of passwords, or an empty list if the dialog is canceled.
+
+	set top .vaultPasswords
+	toplevel $top -class "Gorilla"
+	wm title $top [mc "Open Vaults"]
+
+	set f [ttk::frame $top.f -padding {10 10}]
+	set row 0
+	foreach fileName $fileNames {
+		ttk::label $f.l$row -text [file tail $fileName]
+		ttk::entry $f.e$row -show "*" -width 30
+		grid $f.l$row $f.e$row -sticky w -padx 5 -pady 3
+		bind $f.e$row <Return> "set ::gorilla::guimutex 1"
+		incr row
+	}
+	pack $f -side top -fill both -expand 1
+
+	ttk::frame $top.buts
+	ttk::button $top.buts.b1 -width 15 -text [mc "OK"] \
+		-command "set ::gorilla::guimutex 1"
+	ttk::button $top.buts.b2 -width 15 -text [mc "Cancel"] \
+		-command "set ::gorilla::guimutex 2"
+	pack $top.buts.b1 $top.buts.b2 -side left -padx 20
+	pack $top.buts -side top -pady 10
+	wm protocol $top WM_DELETE_WINDOW "set ::gorilla::guimutex 2"
+
+	update idletasks
+	raise $top
+	focus $f.e0
+	catch {grab $top}
+
+	set ::gorilla::guimutex 0
+	vwait ::gorilla::guimutex
+
+	set passwords [list]
+	if {$::gorilla::guimutex == 1} {
+		for {set i 0} {$i < $row} {incr i} {
+			lappend passwords [$f.e$i get]
+		}
+	}
+	catch {grab release $top}
+	destroy $top
+	return $passwords
+}
+
+proc gorilla::OpenVaults {} {
+
+	# Opens several databases at once and adds them to the workspace.
+	# Their key stretching runs concurrently, see pwsafe::createFromFiles.
+
+	ArrangeIdleTimeout
+
+	# the event loop runs while the vaults are unlocked
+
+	if {[info exists ::gorilla::unlockingVaults]} {
+		set ::gorilla::status [mc "Please wait until the vaults are unlocked."]
+		return
+	}
+
+	set types {
+		{{Password Database Files} {.psafe3 .dat}}
+		{{All Files} *}
+	}
+	set fileNames [tk_getOpenFile -parent . -multiple 1 -filetypes $types \
+		-title [mc "Open Vaults"]]
+	if {[llength $fileNames] == 0} {
+		return
+	}
+
+	# a vault that is open already is not opened twice
+
+	set open [list]
+	if {[info exists ::gorilla::fileName]} {
+		lappend open [file normalize $::gorilla::fileName]
+	}
+	foreach id [array names ::gorilla::vaults] {
+		lappend open [file normalize [dict get $::gorilla::vaults($id) fileName]]
+	}
+	set fileNames [lmap fileName $fileNames {
+		if {[file normalize $fileName] in $open} continue
+		set fileName
+	}]
+	if {[llength $fileNames] == 0} {
+		set ::gorilla::status [mc "These vaults are open already."]
+		return
+	}
+
+	set passwords [VaultPasswordsDialog $fileNames]
+	if {[llength $passwords] == 0} {
+		return
+	}
+
+	set ::gorilla::status [mc "Unlocking %d vaults ..." [llength $fileNames]]
+	. configure -cursor watch
+	update idletasks
+
+	set ::gorilla::unlockingVaults 1
+	try {
+		set results [pwsafe::createFromFiles $fileNames $passwords]
+	} finally {
+		unset ::gorilla::unlockingVaults
+	}
+	pwsafe::int::randomizeVar passwords
+
+	. configure -cursor ""
+
+	set failed ""
+	set opened 0
+	foreach fileName $fileNames result $results {
+		lassign $result status value
+		if {$status ne "ok"} {
+			append failed "[file tail $fileName]: $value\n"
+			continue
+		}
+		incr opened
+		if {[info exists ::gorilla::db]} {
+			AddVault $value $fileName
+		} else {
+			SwitchVault [AddVault $value $fileName]
+		}
+	}
+
+	set ::gorilla::status [mc "%d vaults opened." $opened]
+	if {$failed ne ""} {
+		tk_messageBox -parent . -type ok -icon error -default ok \
+			-title [mc "Open Vaults"] \
+			-message [mc "These vaults could not be opened:\n%s" $failed]
+	}
+}
+
+proc gorilla::CloseVault {} {
+
+	# Closes the active vault and switches to another open one
+
+	ArrangeIdleTimeout
+
+	set ids [lsort -dictionary [array names ::gorilla::vaults]]
+	if {[llength $ids] == 0} {
+		tk_messageBox -parent . -type ok -icon info -default ok \
+			-title [mc "Close Vault"] \
+			-message [mc "This is the only open vault."]
+		return
+	}
+
+	if {$::gorilla::dirty} {
+		set answer [tk_messageBox -parent . \
+			-type yesnocancel -icon warning -default yes \
+			-title [mc "Save changes?"] \
+			-message [mc "The current password database is modified.\
+			Do you want to save the database?"]]
+		if {$answer == "yes"} {
+			if {[info exists ::gorilla::fileName]} {
+				set result [::gorilla::Save]
+			} else {
+				set result [::gorilla::SaveAs]
+			}
+			if {$result ne "GORILLA_OK"} {
+				return
+			}
+		} elseif {$answer != "no"} {
+			return
+		}
+	}
+
+	set db $::gorilla::db
+	unset ::gorilla::db
+	itcl::delete object $db
+	SwitchVault [lindex $ids 0]
+}
+
+proc gorilla::SaveVaults {} {
+
+	# Asks whether to save the vaults other than the active one that are
+	# modified, switching to each of them.  Returns 0 if the user cancels.
+
+	set asked [list]
+	while 1 {
+		set next ""
+		foreach id [array names ::gorilla::vaults] {
+			set vault $::gorilla::vaults($id)
+			if {[dict get $vault dirty] && [dict get $vault db] ni $asked} {
+				set next $id
+				break
+			}
+		}
+		if {$next eq ""} {
+			return 1
+		}
+		SwitchVault $next
+		lappend asked $::gorilla::db
+
+		set answer [tk_messageBox -parent . \
+			-type yesnocancel -icon warning -default yes \
+			-title [mc "Save changes?"] \
+			-message [mc "The vault %s is modified. Do you want to save it?" \
+				[VaultName [dict get [ActiveVault] fileName]]]]
+		if {$answer == "yes"} {
+			if {[info exists ::gorilla::fileName]} {
+				set result [::gorilla::Save]
+			} else {
+				set result [::gorilla::SaveAs]
+			}
+			if {$result ne "GORILLA_OK"} {
+				return 0
+			}
+		} elseif {$answer == "no"} {
+			set ::gorilla::dirty 0
+		} else {
+			return 0
+		}
+	}
+}
+
+proc gorilla::FindInAllVaults {text} {
+
+	# Returns the logins of all open vaults whose group, title, user name,
+	# URL or notes contain text, ignoring case, as a list of vault id
+	# ("active" for the active vault), record number and label
+
+	set vaults [list active [ActiveVault]]
+	foreach id [lsort -dictionary [array names ::gorilla::vaults]] {
+		lappend vaults $id $::gorilla::vaults($id)
+	}
+
+	set found [list]
+	foreach {id vault} $vaults {
+		set db [dict get $vault db]
+		set name [VaultName [dict get $vault fileName]]
+		foreach rn [$db getAllRecordNumbers] {
+			set values [dict create]
+			foreach {field number} {group 2 title 3 user 4 notes 5 url 13} {
+				if {[$db existsField $rn $number]} {
+					dict set values $field [$db getFieldValue $rn $number]
+				} else {
+					dict set values $field ""
+				}
+			}
+			if {[string first [string tolower $text] \
+					[string tolower [join [dict values $values] \n]]] < 0} {
+				continue
+			}
+			set label "$name: "
+			if {[dict get $values group] ne ""} {
+				append label [dict get $values group] " / "
+			}
+			append label [dict get $values title]
+			if {[dict get $values user] ne ""} {
+				append label " \[" [dict get $values user] "\]"
+			}
+			lappend found [list $id $rn $label]
+		}
+	}
+	return $found
+}
+
+proc gorilla::FindInVaults {} {
+
+	# Searches all open vaults and lists the logins found.  Show switches
+	# to the vault of a login and selects it in the tree; the copy buttons
+	# do that and copy the user name or password.
+
+	ArrangeIdleTimeout
+
+	set top .findInVaults
+
+	if {![info exists ::gorilla::toplevel($top)]} {
+		toplevel $top -class "Gorilla"
+		wm title $top [mc "Find in All Vaults"]
+
+		set f [ttk::frame $top.search -padding {10 10}]
+		ttk::label $f.l -text [mc "Find"]
+		ttk::entry $f.e -textvariable ::gorilla::vaultFindText -width 30
+		ttk::button $f.b -text [mc "Find"] -command gorilla::FindInVaultsRefresh
+		pack $f.l $f.e -side left -padx 3
+		pack $f.b -side left -padx 10
+		pack $f -side top -fill x
+		bind $f.e <Return> gorilla::FindInVaultsRefresh
+
+		listbox $top.lb -width 70 -height 20 -yscrollcommand "$top.vsb set"
+		ttk::scrollbar $top.vsb -orient vertical -command "$top.lb yview"
+		lower [ttk::frame $top.dummy]
+		pack $top.dummy -fill both -expand 1
+		grid $top.lb $top.vsb -sticky nsew -in $top.dummy
+		grid columnconfigure $top.dummy 0 -weight 1
+		grid rowconfigure $top.dummy 0 -weight 1
+		bind $top.lb <Double-Button-1> {gorilla::FindInVaultsShow ""}
+
+		set botframe [ttk::frame $top.botframe]
+		ttk::button $botframe.show -text [mc "Show"] \
+			-command {gorilla::FindInVaultsShow ""}
+		ttk::button $botframe.user -text [mc "Copy Username"] \
+			-command {gorilla::FindInVaultsShow Username}
+		ttk::button $botframe.pass -text [mc "Copy Password"] \
+			-command {gorilla::FindInVaultsShow Password}
+		ttk::button $botframe.close -text [mc "Close"] \
+			-command "gorilla::DestroyTextFileDialog $top"
+		pack $botframe.show $botframe.user $botframe.pass $botframe.close \
+			-side left -padx 5
+		pack $botframe -side top -pady 10
+
+		set ::gorilla::toplevel($top) $top
+		wm protocol $top WM_DELETE_WINDOW "gorilla::DestroyTextFileDialog $top"
+	}
+
+	update idletasks
+	wm deiconify $top
+	raise $top
+	focus $top.search.e
+}
+
+proc gorilla::FindInVaultsRefresh {} {
+	set top .findInVaults
+	$top.lb delete 0 end
+	set ::gorilla::vaultFindResults [list]
+	if {[info exists ::gorilla::isLocked] && $::gorilla::isLocked} {
+		return
+	}
+	if {![info exists ::gorilla::db] || $::gorilla::vaultFindText eq ""} {
+		return
+	}
+	set ::gorilla::vaultFindResults [FindInAllVaults $::gorilla::vaultFindText]
+	foreach result $::gorilla::vaultFindResults {
+		$top.lb insert end [lindex $result 2]
+	}
+	set ::gorilla::status [mc "%d logins found." [llength $::gorilla::vaultFindResults]]
+}
+
+proc gorilla::FindInVaultsShow {copy} {
+
+	# Shows the login selected in the Find in All Vaults window, and
+	# copies its user name or password if copy is Username or Password
+
+	if {[info exists ::gorilla::isLocked] && $::gorilla::isLocked} {
+		return
+	}
+
+	set sel [.findInVaults.lb curselection]
+	if {[llength $sel] == 0} {
+		return
+	}
+	lassign [lindex $::gorilla::vaultFindResults [lindex $sel 0]] id rn
+
+	if {$id ne "active"} {
+		set db [dict get $::gorilla::vaults($id) db]
+		SwitchVault $id
+		if {$::gorilla::db ne $db} {
+			return
+		}
+
+		# the results name the vaults by id, which changed now
+
+		set ::gorilla::vaultFindResults [lmap result $::gorilla::vaultFindResults {
+			switch -- [lindex $result 0] $id {
+				lset result 0 active
+			} active {
+				lset result 0 $id
+			}
+			set result
+		}]
+	}
+
+	set tree $::gorilla::widgets(tree)
+	set pending [$tree children {}]
+	while {[llength $pending]} {
+		set pending [lassign $pending node]
+		set data [$tree item $node -values]
+		if {[lindex $data 0] == "Login"} {
+			if {[lindex $data 1] == $rn} {
+				set parent [$tree parent $node]
+				while {$parent ne ""} {
+					$tree item $parent -open 1
+					set parent [$tree parent $parent]
+				}
+				$tree see $node
+				$tree selection set $node
+				UpdateMenu
+				break
+			}
+		} else {
+			lappend pending {*}[$tree children $node]
+		}
+	}
+
+	if {$copy ne ""} {
+		CopyToClipboard $copy
+	}
+}
+
+#
+# ----------------------------------------------------------------------
+# Non-modal password add/edit dialog boxes
+# ----------------------------------------------------------------------
+#
+
+#
+# Put everything into a namespace so that there is no interference with the
+# rest of PWGorilla
+#
+# The code will be ready for refactoring in regard to OO facilities in Tcl/Tk 8.6
+#
+
+namespace eval ::gorilla::LoginDialog { 
+
+	namespace path ::gorilla
+
+	variable seq 0
+	
+	# The idle-windows list and the push/pop procs are used to impliment
+	# window reuse like in the rest of PWGorilla.  However the normal
+	# PWGorilla method of window reuse does not work when there are
+	# multiple windows to be remembered.  Idle-windows is a stack of
+	# toplevel names that are not in use and push/pop manipulate that
+	# stack in the obvious manner
+	 
+	variable idle-windows [ list ]
+
+	namespace import ::tcl::mathop::+ ::tcl::mathop::* ::tcl::mathop::/ 
+
+	# arbiter is a dict used to prevent more than one open edit dialog for an
+	# individual db record number
+
+	variable arbiter [ dict create ]
+  
+# -----------------------------------------------------------------------------
+
+	proc push { win } {
+
+		# add an window name to the end of the namespace variable idle-windows
+		# win - the window name to "push" onto the idle-windows stack variable
+		# Side-effect: Modifes namespace variable idle-windows.
+		#
+		# This is used to maintain a list of "inactive" withdrawn dialogs for
+		# reuse in future edit requests.  Such avoids having to rebuild both the
+		# dialog as well as the dialog state space and GUI handling procs.
+
+		variable idle-windows
+		lappend idle-windows $win
+	} ; # end proc push
+
+# -----------------------------------------------------------------------------
+
+	# see http://wiki.tcl.tk/1923
+	proc K { x y } { set x }
+
+# -----------------------------------------------------------------------------
+
+	proc pop { } {
+
+		# Remove a window name from the stack in the idle-windows namespace variable.
+		# Side-effect: Modifes namespace variable idle-windows.
+		#
+		# This is used to maintain a list of "inactive" withdrawn dialogs for
+		# reuse in future edit requests.  Such avoids having to rebuild both the
+		# dialog as well as the dialog state space and GUI handling procs.
+
+		variable idle-windows
+		return [ K [ lindex ${idle-windows} end ] [ set idle-windows [ lrange ${idle-windows} 0 end-1 ] ] ]
+		# returns the name of the window that was popped from the stack.
+	}
+
+# -----------------------------------------------------------------------------
+
+	proc info { } {
+		# A testing proc for debugging purposes
+		variable idle-windows
+		return "idle-windows -> '${idle-windows}'"
+		# returns the contents of the idle-windows namespace variable stack
+	}
+
+# -----------------------------------------------------------------------------
+
+	# parameters ================================================================
+	# -rn       - record number to edit, default of -999 means create new record
+	# -group    - initial group name to use for creation of a new record
+	# -treenode - the ttk::treeview node ID for editing an existing record
+	#           + This is simply passed through to the final Ok proc for use
+	#           + in updating an existing record in the treeview.
+	# ===========================================================================
+
+	proc LoginDialog { args } {
+
+		# Open a dialog to edit/create an entry in the login DB.
+		#
+		# -rn - Record number from Itcl login DB to edit.  Magic record number
+		#  -999 is defined to mean edit a new (blank) record.  Defaults to -999
+		#  if not provided.
+		#
+		# -group - Set initial "group" name to apply to a new record.  This
+		#  initializes the "group" field of the edit dialog.
+		#
+		# -treenode - The ttk::treeview node ID of an existing record when a
+		#  user requests editing of an existing record.  This is used to update
+		#  the tree display when a user clicks "Ok" to their changes.
+		#
+		# Requirements: If -rn is not -999 then the record number must exist in
+		# the Itcl DB when called.  In addition, to edit an existing record, the
+		# -treenode value must also be passed in.
+		#
+		# Additionally, a simple check is made such that there is a one to one
+		# mapping of existing record numbers to open edit dialogs.  It is
+		# disallowed to edit the exact same record in two independent dialogs
+		# simultaneously.
+
+		variable arbiter
+
+		if { 0 != [ expr { [ llength $args ] % 2 } ] } {
+			error "[ namespace current ]::LoginDialog: Must have an even number of arguments."
+		}
+
+		ArrangeIdleTimeout
+
+		# very simple command line handling, first set default values, then
+		# overwrite those valies with args (if any)
+
+		array set {} [ list -rn -999 -group "" -treenode "" ]
+		array set {} $args
+
+		# a bit of sanity checking of the inputs
+		if { $(-rn) != -999 } {
+			# != -999 means an attempt to edit an existing record
+			if { $(-treenode) eq "" } {
+				error "[ namespace current ]::LoginDialog: Editing an existing record requires that -treenode option be non-null."
+			}
+			if { ! [ $::gorilla::db existsRecord $(-rn) ] } {
+				error "[ namespace current ]::LoginDialog: Can not edit a record number ('$(-rn)') which does not exist in the database."
+			}
+
+			# should only have one dialog open per unique record entry in the db
+
+			if { [ dict exists $arbiter $(-rn) ] } {
+				wm deiconify [ dict get $arbiter $(-rn) ]
+				raise [ dict get $arbiter $(-rn) ]
+				return
+			}
+
+		} ; # end if -rn != -999
+
+
+		set top [ pop ] 
+		if { $top ne "" } {
+
+			set pvns [ get-pvns-from-toplevel $top ]
+
+			wm deiconify $top
+
+		} else {
 
 			variable seq
 			set top [ toplevel .nmLoginDialog$seq ]
@@ -2364,10 +3219,14 @@ namespace eval ::gorilla::LoginDialog {
 				set modified 0
 				set now [clock seconds]
 
+				# the changed fields are collected and set at once,
+				# see dbset fields
+
+				set changes [ list ]
+				set removed [ list ]
+
 				if { [ dbget uuid $rn ] eq "" } {
-					if { ! [ catch { package present uuid } ] } {
-						dbset uuid $rn [uuid::uuid generate]
-					}                              
+					lappend changes uuid [ ::gorilla::GenerateUUIDs ]
 				}
 
 				foreach element [ list {*}$varlist notes ] {
@@ -2383,13 +3242,13 @@ namespace eval ::gorilla::LoginDialog {
 					if { $new_value ne $old_value } {
 						set modified 1
 						if { $new_value eq "" } {
-							dbunset $element $rn
+							lappend removed $element
 						} else {
 
-							dbset $element $rn $new_value
+							lappend changes $element $new_value
 
 							if { $element eq "password" } {
-								dbset last-pass-change $rn $now
+								lappend changes last-pass-change $now
 							} ; # end if element eq password
 
 						} ; # end if new_value eq ""
@@ -2406,7 +3265,18 @@ namespace eval ::gorilla::LoginDialog {
 				} ; # end foreach element
 				
 				if { $modified } {
-					dbset last-modified $rn $now
+					lappend changes last-modified $now
+				}
+
+				# set before removing, so that the record never runs
+				# out of fields on the way
+				if { [ llength $changes ] > 0 } {
+					dbset fields $rn $changes
+					::pwsafe::int::randomizeVar changes
+				}
+
+				foreach element $removed {
+					dbunset $element $rn
 				}
 
 				return $modified
@@ -2569,6 +3439,9 @@ proc gorilla::EditLogin {} {
 	# modal version is deprecated, renamed to gorilla::EditLoginModal
 	# since version 1.5.3.4 only the non-modal version is used
 	
+	if {[StillLoading]} {
+		return
+	}
 	::gorilla::LoginDialog::EditLogin
 }
 
@@ -3022,45 +3895,131 @@ proc gorilla::MoveTreeNode {node dest} {
 		return
 	}
 
-	#
-	# Move recursively
-	#
-
-	MoveTreeNodeRek $node [pwsafe::db::splitGroup $destgroup]
+	set newParents [pwsafe::db::splitGroup $destgroup]
+	lappend newParents [$::gorilla::widgets(tree) item $node -text]
+	MoveGroupNode $node [pwsafe::db::concatGroups $newParents]
 	MarkDatabaseAsDirty
 }
 
 #
-# Moves the children of tree node to the newParents group
+# Returns the group names in ::gorilla::groupNodes that are groupName
+# or one of its subgroups
 #
 
-proc gorilla::MoveTreeNodeRek {node newParents} {
-	set nodedata [$::gorilla::widgets(tree) item $node -values]
-	set nodename [$::gorilla::widgets(tree) item $node -text]
-
-	lappend newParents $nodename
-	set newParentName [pwsafe::db::concatGroups $newParents]
-	set newParentNode [AddGroupToTree $newParentName]
+proc gorilla::SubgroupNames {groupName} {
+	set names [list]
+	foreach name [array names ::gorilla::groupNodes] {
+		if {$name eq $groupName || [string first "$groupName." $name] == 0} {
+			lappend names $name
+		}
+	}
+	return $names
+}
 
-	foreach child [$::gorilla::widgets(tree) children $node] {
-		set childdata [$::gorilla::widgets(tree) item $child -values]
-		set childtype [lindex $childdata 0]
+#
+# Returns the record numbers of all logins below a tree node
+#
 
-		if {$childtype == "Login"} {
-			set rn [lindex $childdata 1]
-			$::gorilla::db setFieldValue $rn 2 $newParentName
-			$::gorilla::widgets(tree) delete $child
-			AddRecordToTree $rn
+proc gorilla::SubtreeRecords {node} {
+	set rns [list]
+	set pending [$::gorilla::widgets(tree) children $node]
+	while {[llength $pending]} {
+		set pending [lassign $pending child]
+		set data [$::gorilla::widgets(tree) item $child -values]
+		if {[lindex $data 0] == "Login"} {
+			lappend rns [lindex $data 1]
 		} else {
-			MoveTreeNodeRek $child $newParents
+			lappend pending {*}[$::gorilla::widgets(tree) children $child]
 		}
 	}
+	return $rns
+}
+
+#
+# Moves the group of tree node, with all its logins and subgroups, to
+# the full group name newGroupName. The group field of all the records
+# is rewritten in one update of the database, and the keys of
+# ::gorilla::groupNodes are changed by prefix. If no group of that name
+# exists yet, the subtree is moved in place and only its new parent is
+# sorted; otherwise its children are merged into the existing group.
+#
+
+proc gorilla::MoveGroupNode {node newGroupName} {
+	set tree $::gorilla::widgets(tree)
+	set oldGroupName [lindex [$tree item $node -values] 1]
+
+	if {$oldGroupName eq $newGroupName} {
+		return
+	}
+
+	set prefixLength [string length $oldGroupName]
+	set updates [dict create]
+	foreach rn [SubtreeRecords $node] {
+		set group [::gorilla::dbget group $rn]
+		dict set updates $rn [list 2 \
+			$newGroupName[string range $group $prefixLength end]]
+	}
+	$::gorilla::db updateRecords $updates
+
+	set newParents [pwsafe::db::splitGroup $newGroupName]
+	set newParentNode [AddGroupToTree \
+		[pwsafe::db::concatGroups [lrange $newParents 0 end-1]]]
+
+	if {[info exists ::gorilla::groupNodes($newGroupName)]} {
+		MergeGroupNode $node $oldGroupName $newGroupName
+		return
+	}
+
+	$tree move $node $newParentNode end
+	$tree item $node -text [lindex $newParents end]
+	RenameGroupNodes $oldGroupName $newGroupName $oldGroupName
+	SortTreeChildren $newParentNode
+}
+
+#
+# Merges the tree of group node into the existing group newGroupName,
+# subgroup by subgroup, after MoveGroupNode has updated the records
+#
 
-	set oldGroupName [lindex $nodedata 1]
+proc gorilla::MergeGroupNode {node oldGroupName newGroupName} {
+	set tree $::gorilla::widgets(tree)
+	set target $::gorilla::groupNodes($newGroupName)
+	set prefixLength [string length $oldGroupName]
+
+	foreach child [$tree children $node] {
+		set data [$tree item $child -values]
+		if {[lindex $data 0] == "Login"} {
+			$tree move $child $target end
+			continue
+		}
+		set childGroup [lindex $data 1]
+		set childNewGroup $newGroupName[string range $childGroup $prefixLength end]
+		if {[info exists ::gorilla::groupNodes($childNewGroup)]} {
+			MergeGroupNode $child $childGroup $childNewGroup
+		} else {
+			$tree move $child $target end
+			RenameGroupNodes $oldGroupName $newGroupName $childGroup
+		}
+	}
+	SortTreeChildren $target
 	unset ::gorilla::groupNodes($oldGroupName)
-	$::gorilla::widgets(tree) item $newParentNode \
-		-open [$::gorilla::widgets(tree) item $node -open]
-	$::gorilla::widgets(tree) delete $node
+	$tree delete $node
+}
+
+#
+# Changes the prefix oldPrefix of group groupName and of all its
+# subgroups to newPrefix, in ::gorilla::groupNodes and in the tree
+#
+
+proc gorilla::RenameGroupNodes {oldPrefix newPrefix groupName} {
+	set prefixLength [string length $oldPrefix]
+	foreach name [SubgroupNames $groupName] {
+		set groupNode $::gorilla::groupNodes($name)
+		unset ::gorilla::groupNodes($name)
+		set newName $newPrefix[string range $name $prefixLength end]
+		set ::gorilla::groupNodes($newName) $groupNode
+		$::gorilla::widgets(tree) item $groupNode -values [list Group $newName]
+	}
 }
 
 
@@ -3102,30 +4061,26 @@ proc gorilla::DeleteGroup {} {
 	}
 
 	set ::gorilla::status [mc "Group deleted."]
-	gorilla::DeleteGroupRek $node
+	gorilla::DeleteGroupNode $node
 
 	if {$hadchildren} {
 		MarkDatabaseAsDirty
 	}
 }
 
-proc gorilla::DeleteGroupRek {node} {
-	set children [$::gorilla::widgets(tree) children $node]
+proc gorilla::DeleteGroupNode {node} {
 
-	foreach child $children {
-		set data [$::gorilla::widgets(tree) item $child -values]
-		set type [lindex $data 0]
+	# Deletes the group of tree node with all its logins and subgroups;
+	# the subtree is deleted from the tree at once
 
-		if {$type == "Login"} {
-			$::gorilla::db deleteRecord [lindex $data 1]
-			$::gorilla::widgets(tree) delete $child
-		} else {
-			DeleteGroupRek $child
-		}
+	foreach rn [SubtreeRecords $node] {
+		$::gorilla::db deleteRecord $rn
 	}
 
 	set groupName [lindex [$::gorilla::widgets(tree) item $node -values] 1]
-	unset ::gorilla::groupNodes($groupName)
+	foreach name [SubgroupNames $groupName] {
+		unset ::gorilla::groupNodes($name)
+	}
 	$::gorilla::widgets(tree) delete $node
 }
 
@@ -3319,36 +4274,11 @@ proc gorilla::RenameGroup {} {
 		return
 	}
 
-	#
-	# Move recursively
-	#
-
 	if {$newGroup != ""} {
 		lappend newParents $newGroup
 	}
 
-	set newParentName [pwsafe::db::concatGroups $newParents]
-	set newParentNode [AddGroupToTree $newParentName]
-
-	foreach child [$::gorilla::widgets(tree) children $node] {
-		set childdata [$::gorilla::widgets(tree) item $child -values]
-		set childtype [lindex $childdata 0]
-
-		if {$childtype == "Login"} {
-			set rn [lindex $childdata 1]
-			$::gorilla::db setFieldValue $rn 2 $newParentName
-			$::gorilla::widgets(tree) delete $child
-			AddRecordToTree $rn
-		} else {
-			MoveTreeNodeRek $child $newParents
-		}
-
-	}
-
-	unset ::gorilla::groupNodes($fullGroupName)
-	$::gorilla::widgets(tree) item $newParentNode \
-		-open [$::gorilla::widgets(tree) item $node -open]
-	$::gorilla::widgets(tree) delete $node
+	MoveGroupNode $node [pwsafe::db::concatGroups $newParents]
 	set ::gorilla::status [mc "Group renamed."]
 	MarkDatabaseAsDirty
 }
@@ -3421,50 +4351,62 @@ proc gorilla::Export {} {
 		return
 	}
 
-	load-package csv
-
 	::gorilla::Feedback [ mc "Exporting ..." ]
 
-	fconfigure $txtFile -encoding utf-8	
+	# Rows are written field by field into a fully buffered channel, so no
+	# per-row list of plaintext values is built and each value can be
+	# scrubbed right after it went out.
+
+	fconfigure $txtFile -encoding utf-8 -buffering full -buffersize 65536
 
 	set separator [subst -nocommands -novariables $::gorilla::preference(exportFieldSeparator)]
 
 	# output a csv header describing what data values are present in each
-	# column of the csv file
+	# column of the csv file, and collect the db field numbers of the
+	# exported columns in the same order
 
-	set csv_data [ list uuid group title url user ] 
+	set columns [ list uuid 1 group 2 title 3 url 13 user 4 ]
 
 	if { $::gorilla::preference(exportIncludePassword) } { 
-		lappend csv_data password
+		lappend columns password 6
 	}
 
 	if { $::gorilla::preference(exportIncludeNotes) } {
-		lappend csv_data notes
+		lappend columns notes 5
 	}
 
-	puts $txtFile [ ::csv::join $csv_data $separator ]
+	set sep ""
+	set fields [ list ]
+	foreach { name field } $columns {
+		puts -nonewline $txtFile $sep[ CsvField $name $separator ]
+		set sep $separator
+		lappend fields $field
+	}
+	puts $txtFile ""
 
 	# now output the contents of the database
 
 	foreach rn [$::gorilla::db getAllRecordNumbers] {
 
-		set csv_data [ list [ dbget uuid  $rn ] [ dbget group $rn ] \
-		                    [ dbget title $rn ] [ dbget url $rn   ] \
-		                    [ dbget user  $rn ] ]
+		set sep ""
+		foreach field $fields {
+			if { [ $::gorilla::db existsField $rn $field ] } {
+				set value [ $::gorilla::db getFieldValue $rn $field ]
+			} else {
+				set value ""
+			}
 
-		# Password - optional export 
-		if {$::gorilla::preference(exportIncludePassword)} {
-			lappend csv_data [ dbget password $rn ]
-		}
+			# Notes - need to escape newlines and slashes.  CsvField will
+			# handle escaping the separator and double quotes
+			if { $field == 5 } {
+				set value [ string map {\\ \\\\ \n \\n} $value ]
+			}
 
-		# Notes - need to escape newlines and slashes.  The CSV module will
-		# handle escaping commas and double quotes
-		
-		if {$::gorilla::preference(exportIncludeNotes)} {
-			lappend csv_data [ string map {\\ \\\\ \n \\n} [ dbget notes $rn ] ]
+			puts -nonewline $txtFile $sep[ CsvField $value $separator ]
+			set sep $separator
+			pwsafe::int::randomizeVar value
 		}
-
-		puts $txtFile [ ::csv::join $csv_data $separator ]
+		puts $txtFile ""
 
 	} ; # end foreach rn in gorilla db
 
@@ -3481,10 +4423,14 @@ proc gorilla::Export {} {
 # ----------------------------------------------------------------------
 #
 
-proc gorilla::Import { {input_file ""} } {
+proc gorilla::Import { {input_file ""} {dryrun 0} } {
 
 	# Import a csv file and add the entries therein to the currently open
 	# database
+	#
+	# input_file - the csv file to import, asked for if empty
+	# dryrun - if true, only parse and validate the file and report what
+	#          would be imported, without changing the database
 
 	ArrangeIdleTimeout
 
@@ -3529,7 +4475,7 @@ proc gorilla::Import { {input_file ""} } {
 				last-pass-change lifetime notes password title
 				url user uuid }
 
-	if { [ catch { set columns_present [ ::csv::split [ gets $infd ] ] } oops ] } {
+	if { [ catch { set columns_present [ CsvSplit [ gets $infd ] ] } oops ] } {
 		ErrorPopup [ mc "Error parsing CSV file" ] \
 		           "[ mc "Error parsing first line of CSV file, unable to continue." ]\n$oops"
 		catch { close $infd }
@@ -3583,109 +4529,82 @@ proc gorilla::Import { {input_file ""} } {
 	}
 	
 	set new_add_counter 0
+	set new_records [ list ]
 
-	foreach line [ split [ read $infd [ file size $input_file ] ] "\n" ] {
+	# The file is processed in batches of lines.  Each batch is parsed and
+	# validated first, then its valid rows are turned into records in one
+	# go.  The tree is not touched until all batches are done.
 
-#		puts "line: $line"
-		
-		if { [ catch { set data [ ::csv::split $line ] } oops ] } {
-			lappend error_lines [ list "Unable to parse as CSV" $line ]
-			continue
-		} ; # end if catch csv::split
+	set lines [ split [ read $infd [ file size $input_file ] ] "\n" ]
+	set total_lines [ llength $lines ]
+	set batch_size 500
 
-		if { [ llength $data ] == 0 } { 
-			continue
-		}
-		
-		if { [ llength $data ] != [ llength $columns_present ] } {
-			lappend error_lines [ list "Unequal number of columns" $line ]
-			continue
-		}
+	::gorilla::progress init -win . -message [ mc "Importing (%d %% done)" ]
 
-		set newrn [ $::gorilla::db createRecord ]
-#		puts "newrn: $newrn"		
+	for { set first 0 } { $first < $total_lines } { incr first $batch_size } {
 
-		set no_errors 1
+		set rows [ list ]
 
-		foreach key $columns_present value $data {
+		foreach line [ lrange $lines $first [ expr { $first + $batch_size - 1 } ] ] {
 
-#			puts "key: $key value $value"
-			switch -exact -- $key {
+			set row [ ImportRow $columns_present $line ]
 
-				group {
-					if { [ catch { ::pwsafe::db::splitGroup $value } ] } {
-						lappend error_lines [ list "Invalid group name" $line ]
-						set no_errors 0
-					}
-					dbset group $newrn $value
+			if { [ lindex $row 0 ] eq "error" } {
+				foreach reason [ lindex $row 1 ] {
+					lappend error_lines [ list $reason $line ]
 				}
+			} elseif { [ lindex $row 0 ] eq "ok" } {
+				lappend rows [ lindex $row 1 ]
+			}
 
-				uuid {
-					# uuid is allowed to be empty, but if not empty it must be in
-					# this format: f29b9ef7-9e62-41e1-7dfd-14ae13986059
-					if { ( $value ne "" ) && 
-					     ( ! [ regexp {^[[:xdigit:]]{8}-[[:xdigit:]]{4}-[[:xdigit:]]{4}-[[:xdigit:]]{4}-[[:xdigit:]]{12}$} $value ] ) } {
-#					puts "invalid uuid $value"
-						lappend error_lines [ list "Invalid UUID field" $line ]
-						set no_errors 0
-					}
-					dbset uuid $newrn $value
-				}
+		} ; # end foreach line in batch
 
-				create-time -
-				last-access -
-				last-modified -
-				last-pass-change -
-				lifetime {
-					if { [ catch { set time [ clock scan $value -format "%Y-%m-%d %k-%M-%S %z" ] } ] } {
-						lappend error_lines [ list "Invalid time: field $key" $line ]
-						set no_errors 0
-					} else {
-						dbset $key $newrn $time
-					}
-				}
+		if { $dryrun } {
+			incr new_add_counter [ llength $rows ]
+		} else {
+			set uuids [ list ]
+			if { "uuid" ni $columns_present } {
+				set uuids [ GenerateUUIDs [ llength $rows ] ]
+			}
 
-				notes {
-					dbset notes $newrn [ subst -nocommands -novariables $value ]
+			foreach newrn [ $::gorilla::db createRecords [ llength $rows ] ] fields $rows uuid $uuids {
+
+				# setup some reasonable defaults if certain items are not provided
+				# in the CSV file.  All fields of the record are set at once.
+
+				if { [ info exists default_group_name ] } {
+					lappend fields group $default_group_name
+				}
+				
+				if { $uuid ne "" } {
+					lappend fields uuid $uuid
+				}
+				
+				if { "title" ni $columns_present } {
+					lappend fields title "Newly Imported [ clock format [ clock seconds ] ]"
 				}
 
-				default { dbset $key $newrn $value }
+				dbset fields $newrn $fields
+				pwsafe::int::randomizeVar fields
 
-			} ; # end switch
+				lappend new_records $newrn
+				incr new_add_counter
 
-		} ; # end foreach key/value
-		
-#		puts ""
+			} ; # end foreach newrn
+		}
 
-		if { $no_errors } {
-			# setup some reasonable defaults if certain items are not provided
-			# in the CSV file
+		pwsafe::int::randomizeVar rows
+		::gorilla::progress update-pbar . [ expr { int( 100. * min( $first + $batch_size, $total_lines ) / $total_lines ) } ]
 
-			if { [ info exists default_group_name ] } {
-#				puts "setting a default group"
-				dbset group $newrn $default_group_name
-			}
-			
-			if {  ( "uuid" ni $columns_present ) 
-				&& ( ! [ catch { package present uuid } ] ) } {
-#				puts "setting a new uuid"
-				dbset uuid $newrn [uuid::uuid generate]
-			}
-			
-			if { "title" ni $columns_present } {
-#				puts "setting a default title"
-				dbset title $newrn "Newly Imported [ clock format [ clock seconds ] ]"
-			}
+	} ; # end for each batch of lines in input file
 
-			AddRecordToTree $newrn
-			incr new_add_counter
-			
-		} else {
-			$::gorilla::db deleteRecord $newrn
-		}
+	pwsafe::int::randomizeVar lines
+	::gorilla::progress finished .
+
+	if { [ llength $new_records ] > 0 } {
+		AddRecordsToTree $new_records
+	}
 
-	} ; # end foreach line in input file
-	
 	if { [ info exists error_lines ] } {
 		if { $::gorilla::DEBUG(CSVIMPORT) } {
 			. configure -cursor $myOldCursor
@@ -3709,7 +4628,9 @@ proc gorilla::Import { {input_file ""} } {
 		} ; # end if answer eq yes
 	} ; # end if exists error_lines
 	
-	if { $new_add_counter > 0 } {
+	if { $dryrun } {
+		set ::gorilla::status "$new_add_counter [ mc "record(s) can be imported." ]"
+	} elseif { $new_add_counter > 0 } {
 		set ::gorilla::status "$new_add_counter [ mc "record(s) successfully imported." ]"
 		MarkDatabaseAsDirty
 	}
@@ -3721,6 +4642,100 @@ proc gorilla::Import { {input_file ""} } {
 
 } ; # end proc gorilla::Import
 
+proc gorilla::CsvSplit { line } {
+
+	# Splits one line of comma separated values like ::csv::split does.
+	# Lines without double quotes, which are the vast majority in an
+	# import, take the shortcut through the builtin split command.
+	#
+	# line - the line to split
+
+	if { [ string first \" $line ] < 0 && [ string first \0 $line ] < 0 \
+		&& [ string first \1 $line ] < 0 } {
+		return [ split $line , ]
+	}
+	return [ ::csv::split $line ]
+
+} ; # end proc gorilla::CsvSplit
+
+proc gorilla::ImportRow { columns_present line } {
+
+	# Parses and validates one line of an import file.  Returns one of
+	#
+	#   ok fields      - fields is a list of dbset item names and values
+	#   error reasons  - the line can not be imported
+	#   empty {}       - an empty line, to be skipped silently
+	#
+	# columns_present - the column names from the first line of the file
+	# line - the line to import
+
+	if { [ catch { set data [ CsvSplit $line ] } oops ] } {
+		return [ list error [ list "Unable to parse as CSV" ] ]
+	} ; # end if catch CsvSplit
+
+	if { [ llength $data ] == 0 } { 
+		return [ list empty {} ]
+	}
+	
+	if { [ llength $data ] != [ llength $columns_present ] } {
+		return [ list error [ list "Unequal number of columns" ] ]
+	}
+
+	set fields [ list ]
+	set reasons [ list ]
+
+	foreach key $columns_present value $data {
+
+		switch -exact -- $key {
+
+			group {
+				if { [ catch { ::pwsafe::db::splitGroup $value } ] } {
+					lappend reasons "Invalid group name"
+				}
+				lappend fields group $value
+			}
+
+			uuid {
+				# uuid is allowed to be empty, but if not empty it must be in
+				# this format: f29b9ef7-9e62-41e1-7dfd-14ae13986059
+				if { ( $value ne "" ) && 
+				     ( ! [ regexp {^[[:xdigit:]]{8}-[[:xdigit:]]{4}-[[:xdigit:]]{4}-[[:xdigit:]]{4}-[[:xdigit:]]{12}$} $value ] ) } {
+					lappend reasons "Invalid UUID field"
+				}
+				lappend fields uuid $value
+			}
+
+			create-time -
+			last-access -
+			last-modified -
+			last-pass-change -
+			lifetime {
+				if { [ catch { set time [ clock scan $value -format "%Y-%m-%d %k-%M-%S %z" ] } ] } {
+					lappend reasons "Invalid time: field $key"
+				} else {
+					lappend fields $key $time
+				}
+			}
+
+			notes {
+				lappend fields notes [ subst -nocommands -novariables $value ]
+			}
+
+			default { lappend fields $key $value }
+
+		} ; # end switch
+
+	} ; # end foreach key/value
+
+	if { [ llength $reasons ] > 0 } {
+		pwsafe::int::randomizeVar fields
+		return [ list error $reasons ]
+	}
+
+	return [ list ok $fields ]
+
+} ; # end proc gorilla::ImportRow
+
 proc gorilla::ErrorPopup {title message} {
 
 	# a small helper proc to encapsulate all the details of opening a
@@ -3814,7 +4829,11 @@ proc gorilla::CloseDialog { top } {
 	}
 }
 
-proc gorilla::Merge {} {
+proc gorilla::Merge {{baseIndex ""}} {
+	# baseIndex - optional index of a common ancestor database as built by
+	#             MergeBaseIndex.  If given, logins that were changed on
+	#             one side only are merged without reporting a conflict.
+
 	set openInfo [OpenDatabase [mc "Merge Password Database"] "" 0]
 	# set openInfo [OpenDatabase "Merge Password Database" "" 0]
 	# enthält [list $fileName $newdb]
@@ -3839,12 +4858,41 @@ proc gorilla::Merge {} {
 	set addedReport [list]
 	set conflictReport [list]
 	set identicalReport [list]
+	set resolvedReport [list]
 	set totalRecords [llength [$newdb getAllRecordNumbers]]
 
+	#
+	# In a three-way merge logins are matched by their UUID first, so
+	# that a login renamed on one side is still found.
+	#
+
+	if {$baseIndex ne ""} {
+		array set uuidRecords {}
+		array set recordNodes {}
+		set pending [list RootNode]
+		while {[llength $pending]} {
+			set pending [lassign $pending parent]
+			foreach child [$::gorilla::widgets(tree) children $parent] {
+				lassign [$::gorilla::widgets(tree) item $child -values] type crn
+				if {$type eq "Group"} {
+					lappend pending $child
+				} elseif {$type eq "Login"} {
+					set recordNodes($crn) $child
+				}
+			}
+		}
+		foreach crn [$::gorilla::db getAllRecordNumbers] {
+			if {[$::gorilla::db existsField $crn 1]} {
+				set uuidRecords([$::gorilla::db getFieldValue $crn 1]) $crn
+			}
+		}
+	}
+
 	::gorilla::progress init -win . -message [mc "Merging (%d %% done)"]
 
 	foreach nrn [$newdb getAllRecordNumbers] {
 		unset -nocomplain rn node
+		set resolved 0
 		
 		incr totalLogins
 
@@ -3873,7 +4921,17 @@ proc gorilla::Merge {} {
 
 		set found 0
 
-		if {$ngroup == "" || [info exists ::gorilla::groupNodes($ngroup)]} {
+		if {$baseIndex ne "" && [$newdb existsField $nrn 1]} {
+			set nuuid [$newdb getFieldValue $nrn 1]
+			if {[info exists uuidRecords($nuuid)] && \
+				[info exists recordNodes($uuidRecords($nuuid))]} {
+				set rn $uuidRecords($nuuid)
+				set node $recordNodes($rn)
+				set found 1
+			}
+		}
+
+		if {!$found && ($ngroup == "" || [info exists ::gorilla::groupNodes($ngroup)])} {
 			if {$ngroup != ""} {
 				set parent $::gorilla::groupNodes($ngroup)
 			} else {
@@ -4002,6 +5060,27 @@ proc gorilla::Merge {} {
 				}
 			}
 		}
+
+		#
+		# With a common ancestor at hand, differences made on one side
+		# only are not conflicts.  Take them over into the current login.
+		#
+
+		if {$found && !$identical && $baseIndex ne ""} {
+			lassign [MergeThreeWay $baseIndex $newdb $nrn $rn] status detail
+			if {$status eq "resolved"} {
+				set resolved 1
+				MergeApplyFields $newdb $nrn $rn $detail
+				if {[llength $detail] > 0} {
+					$::gorilla::widgets(tree) delete $node
+					set node [AddRecordToTree $rn]
+					set recordNodes($rn) $node
+				}
+			} elseif {$status eq "conflict"} {
+				set reason $detail
+			}
+		}
+
 		# not found
 		#
 		# If the two records are not identical, then we have a conflict.
@@ -4013,32 +5092,10 @@ proc gorilla::Merge {} {
 		# Else, append " - merged <timestamp>" to the new record.
 		#
 
-		if {$found && !$identical} {
-			set timestampFormat "%Y-%m-%d %H:%M:%S"
-
-			if {[$newdb existsField $nrn 3]} {
-				set title [$newdb getFieldValue $nrn 3]
-			} else {
-				set title "<No Title>"
-			}
-
-			if {[set index [string first " - modified " $title]] >= 0} {
-				set title [string range $title 0 [expr {$index-1}]]
-			} elseif {[set index [string first " - merged " $title]] >= 0} {
-				set title [string range $title 0 [expr {$index-1}]]
-			}
-
-			if {[$newdb existsField $nrn 12]} {
-				append title " - modified " [clock format \
-			[$newdb getFieldValue $nrn 12] \
-				-format $timestampFormat]
-			} else {
-				append title " - merged " [clock format \
-				[clock seconds] \
-				-format $timestampFormat]
-			}
-			$newdb setFieldValue $nrn 3 $title
-			pwsafe::int::randomizeVar title
+		if {$found && !$identical && !$resolved} {
+			$newdb setFieldValue $nrn 3 [MergeConflictTitle \
+				[expr {[$newdb existsField $nrn 3] ? [$newdb getFieldValue $nrn 3] : "<No Title>"}] \
+				[expr {[$newdb existsField $nrn 12] ? [$newdb getFieldValue $nrn 12] : ""}]]
 		}
 
 		#
@@ -4047,13 +5104,23 @@ proc gorilla::Merge {} {
 		# but not identical.
 		#
 
-		if {!$found || !$identical} {
+		if {$resolved} {
+			set report [mc "Resolved login %s" $ntitle]
+			if {$ngroup != ""} {
+				append report " [mc "(in group %s)" $ngroup]"
+			}
+			append report "."
+			lappend resolvedReport [ list $report $rn ]
+		} elseif {!$found || !$identical} {
 			set oldrn [ expr { [ info exists rn ] ? $rn : "" } ]
 			set rn [$::gorilla::db createRecord]
 
+			set fieldValues [list]
 			foreach field [$newdb getFieldsForRecord $nrn] {
-				$::gorilla::db setFieldValue $rn $field   [$newdb getFieldValue $nrn $field]
+				lappend fieldValues $field [$newdb getFieldValue $nrn $field]
 			}
+			$::gorilla::db setFieldValues $rn $fieldValues
+			pwsafe::int::randomizeVar fieldValues
 
 			set oldnode [ expr { [ info exists node ] ? $node : "" } ]
 			set node [AddRecordToTree $rn]
@@ -4120,6 +5187,11 @@ proc gorilla::Merge {} {
 		[ expr { $numConflicts == 1 ? [ mc "conflict" ] : [ mc "conflicts" ] } ] \
 	]
 
+	if {$baseIndex ne ""} {
+		append message "\n" [ mc "%d resolved against the common ancestor." \
+			[llength $resolvedReport] ]
+	}
+
 	set ::gorilla::status $message
 
 	if {$numConflicts > 0} {
@@ -4241,11 +5313,36 @@ proc gorilla::Merge {} {
 			$text tag bind link$seq <Button-1> " ::gorilla::ViewEntry [ lindex $report 1 ]
 								::gorilla::ViewEntry [ lindex $report 2 ]"
 
-			$text insert end "[ lindex $report 0 ]\n" link$seq
-			incr seq
+			$text insert end "[ lindex $report 0 ]\n" link$seq
+			incr seq
+		}
+	} else {
+		$text insert end "None.\n"
+	}
+
+	if {$baseIndex ne ""} {
+		$text insert end "\n"
+		$text insert end [string repeat "-" 70]
+		$text insert end "\n"
+		$text insert end "[mc "Resolved Logins"]\n"
+		$text insert end [string repeat "-" 70]
+		$text insert end "\n"
+		$text insert end "\n"
+
+		if {[llength $resolvedReport] > 0} {
+			foreach report $resolvedReport {
+				$text tag configure link$seq -foreground blue -underline true
+
+				$text tag bind link$seq <Enter> [ list $text configure -cursor hand2 ]
+				$text tag bind link$seq <Leave> [ list $text configure -cursor $default_cursor ]
+				$text tag bind link$seq <Button-1> " ::gorilla::ViewEntry [ lindex $report 1 ] "
+
+				$text insert end "[ lindex $report 0 ]\n" link$seq
+				incr seq
+			}
+		} else {
+			$text insert end "None.\n"
 		}
-	} else {
-		$text insert end "None.\n"
 	}
 
 	$text insert end "\n"
@@ -4296,10 +5393,671 @@ proc gorilla::Merge {} {
 #	focus $botframe.but
 } ; # end ::gorilla::Merge
 
+# ----------------------------------------------------------------------
+# Three-way merge against a common ancestor
+# ----------------------------------------------------------------------
+#
+# A two-way merge can only tell that two logins differ, not which side
+# changed them.  Given a base database - typically the last backup that
+# SaveBackup wrote before the copies diverged - a field that was changed
+# on one side only can be taken over without asking.  Only fields that
+# were changed differently on both sides are left for the conflict
+# dialog.
+#
+# The base database is reduced to an index of keyed field digests
+# right after it was opened, so that its plaintext does not have to be
+# kept around for the duration of the merge.
+#
+
+proc gorilla::MergeWithBase {} {
+	set defaultFile ""
+	if {[info exists ::gorilla::fileName]} {
+		set defaultFile [LatestBackupFile $::gorilla::fileName]
+	}
+
+	set openInfo [OpenDatabase [mc "Select Common Ancestor Database"] $defaultFile 0]
+
+	if {[lindex $openInfo 0] != "Open"} {
+		return
+	}
+
+	set basedb [lindex $openInfo 2]
+	set baseIndex [MergeBaseIndex $basedb]
+	itcl::delete object $basedb
+
+	Merge $baseIndex
+}
+
+proc gorilla::LatestBackupFile { filename } {
+	# Returns the name of the most recent backup of filename that
+	# SaveBackup could have written, or an empty string if there is none.
+	#
+	# filename - name of current database containing full path
+	#
+
+	if { $::gorilla::preference(backupPath) eq "" } {
+		set backupPath [ file dirname $filename ]
+	} else {
+		set backupPath $::gorilla::preference(backupPath)
+	}
+
+	# only the names SaveBackup writes: a pattern like "work-*" would
+	# also match a sibling database such as work-personal.psafe3
+
+	set escape { \\ \\\\ * \\* ? \\? [ \\[ ] \\] \{ \\\{ \} \\\} }
+	set rootName [ string map $escape [ file rootname [ file tail $filename ] ] ]
+	set extension [ string map $escape [ file extension $filename ] ]
+	set stamp "[ string repeat {[0-9]} 4 ][ string repeat {-[0-9][0-9]} 5 ]"
+	set candidates [ glob -nocomplain -types f -directory $backupPath -- \
+		"$rootName.bak" \
+		"$rootName-$stamp$extension" \
+		"[ string map $escape [ file tail $filename ] ]~" ]
+
+	set latest ""
+	set latestTime -1
+	foreach candidate $candidates {
+		if { [ file normalize $candidate ] eq [ file normalize $filename ] } {
+			continue
+		}
+		set mtime [ file mtime $candidate ]
+		if { $mtime > $latestTime } {
+			set latest $candidate
+			set latestTime $mtime
+		}
+	}
+
+	return $latest
+}
+
+proc gorilla::MergeDigest { key value } {
+	# Keyed digest of a single field value.  The key is random and only
+	# lives for one merge, so the digests can not be matched against
+	# anything outside of it.
+
+	return [ sha2::sha256 -bin "$key$value" ]
+}
+
+proc gorilla::MergeRecordKey { db rn } {
+	# Identifies a record across databases: by its UUID if it has one,
+	# else by group, title and user name like the two-way merge does.
+
+	if { [ $db existsField $rn 1 ] } {
+		return [ list uuid [ $db getFieldValue $rn 1 ] ]
+	}
+
+	set key [ list login ]
+	foreach field {2 3 4} {
+		lappend key [ expr { [ $db existsField $rn $field ] ? [ $db getFieldValue $rn $field ] : "" } ]
+	}
+	return $key
+}
+
+proc gorilla::MergeRecordDigests { key db rn } {
+	# Returns a dict of field number -> keyed digest for all fields of
+	# record rn that take part in a merge.  The UUID and the timestamps
+	# are skipped, and so are empty fields, which the merge treats like
+	# missing ones.
+
+	set digests [ dict create ]
+
+	foreach field [ $db getFieldsForRecord $rn ] {
+		if { $field in {1 7 8 9 12} } {
+			continue
+		}
+		set value [ $db getFieldValue $rn $field ]
+		if { $value ne "" } {
+			dict set digests $field [ MergeDigest $key $value ]
+		}
+		pwsafe::int::randomizeVar value
+	}
+
+	return $digests
+}
+
+proc gorilla::MergeBaseIndex { basedb } {
+	# Reduces the base database of a three-way merge to a dict holding the
+	# digest key and, per record key, the last modification time and the
+	# field digests of that record.
+
+	set key [ pwsafe::int::randomString 16 ]
+	set records [ dict create ]
+
+	foreach rn [ $basedb getAllRecordNumbers ] {
+		set mtime ""
+		if { [ $basedb existsField $rn 12 ] } {
+			set mtime [ $basedb getFieldValue $rn 12 ]
+		}
+		dict set records [ MergeRecordKey $basedb $rn ] \
+			[ dict create mtime $mtime digests [ MergeRecordDigests $key $basedb $rn ] ]
+	}
+
+	return [ dict create key $key records $records ]
+}
+
+proc gorilla::MergeThreeWay { baseIndex newdb nrn rn } {
+	# Decides a login that differs between the current database (rn) and
+	# the merged one (nrn) with the help of the base index.
+	#
+	# Returns one of
+	#
+	#   nobase {}         - the login is not in the base database
+	#   resolved fields   - fields changed on the merged side only; copying
+	#                       them from nrn to rn completes the merge
+	#   conflict reason   - at least one field was changed on both sides
+	#
+
+	set records [ dict get $baseIndex records ]
+	set recordKey [ MergeRecordKey $newdb $nrn ]
+
+	if { ! [ dict exists $records $recordKey ] } {
+		# UUIDs may go AWOL between Password Safe clones, so also try the
+		# login key of the current record
+		set recordKey [ MergeRecordKey $::gorilla::db $rn ]
+		if { ! [ dict exists $records $recordKey ] } {
+			return [ list nobase {} ]
+		}
+	}
+
+	set base [ dict get $records $recordKey ]
+	set baseMtime [ dict get $base mtime ]
+
+	set nmtime [ expr { [ $newdb existsField $nrn 12 ] ? [ $newdb getFieldValue $nrn 12 ] : "" } ]
+	set mtime  [ expr { [ $::gorilla::db existsField $rn 12 ] ? [ $::gorilla::db getFieldValue $rn 12 ] : "" } ]
+
+	#
+	# A record whose modification time is still that of the base was not
+	# edited on that side, so the other side wins as a whole without
+	# looking at individual fields.
+	#
+
+	if { $baseMtime ne "" && $nmtime eq $baseMtime } {
+		return [ list resolved {} ]
+	}
+
+	set key [ dict get $baseIndex key ]
+	set ndigests [ MergeRecordDigests $key $newdb $nrn ]
+	set digests  [ MergeRecordDigests $key $::gorilla::db $rn ]
+	set bdigests [ dict get $base digests ]
+
+	set fields [ lsort -integer -unique [ concat \
+		[ dict keys $ndigests ] [ dict keys $digests ] [ dict keys $bdigests ] ] ]
+
+	if { $baseMtime ne "" && $mtime eq $baseMtime } {
+		set changed [ list ]
+		foreach field $fields {
+			if { ! [ string equal [ DictGetDefault $ndigests $field ] [ DictGetDefault $digests $field ] ] } {
+				lappend changed $field
+			}
+		}
+		return [ list resolved $changed ]
+	}
+
+	set changed [ list ]
+	set both [ list ]
+
+	foreach field $fields {
+		set n [ DictGetDefault $ndigests $field ]
+		set o [ DictGetDefault $digests  $field ]
+		set b [ DictGetDefault $bdigests $field ]
+
+		if { [ string equal $n $o ] || [ string equal $n $b ] } {
+			# same on both sides, or changed in the current database only
+			continue
+		}
+		if { [ string equal $o $b ] } {
+			lappend changed $field
+		} else {
+			lappend both $field
+		}
+	}
+
+	if { [ llength $both ] > 0 } {
+		set names [ list ]
+		foreach field $both {
+			if { $field < [ llength $::gorilla::fieldNames ] } {
+				lappend names [ lindex $::gorilla::fieldNames $field ]
+			} else {
+				lappend names "field number $field"
+			}
+		}
+		return [ list conflict "[ join $names ", " ] changed in both databases" ]
+	}
+
+	return [ list resolved $changed ]
+}
+
+proc gorilla::MergeConflictTitle { title mtime } {
+	# Returns the title for the merged copy of a login in conflict:
+	# the title with " - modified <last modification time>" appended,
+	# or " - merged <now>" if the login has no modification time.  A
+	# suffix from an earlier merge is replaced.
+
+	set timestampFormat "%Y-%m-%d %H:%M:%S"
+
+	if { [ set index [ string first " - modified " $title ] ] >= 0 } {
+		set title [ string range $title 0 [ expr { $index - 1 } ] ]
+	} elseif { [ set index [ string first " - merged " $title ] ] >= 0 } {
+		set title [ string range $title 0 [ expr { $index - 1 } ] ]
+	}
+
+	if { $mtime ne "" } {
+		append title " - modified " [ clock format $mtime -format $timestampFormat ]
+	} else {
+		append title " - merged " [ clock format [ clock seconds ] -format $timestampFormat ]
+	}
+	return $title
+}
+
+proc gorilla::DictGetDefault { dict key {default ""} } {
+	if { [ dict exists $dict $key ] } {
+		return [ dict get $dict $key ]
+	}
+	return $default
+}
+
+proc gorilla::MergeApplyFields { newdb nrn rn fields } {
+	# Copies the given fields of record nrn in the merged database over
+	# to record rn of the current database.  Fields that are empty on the
+	# merged side are removed.  The password and record modification
+	# times follow the copied values.
+
+	foreach field $fields {
+		if { [ $newdb existsField $nrn $field ] && \
+			[ $newdb getFieldValue $nrn $field ] ne "" } {
+			$::gorilla::db setFieldValue $rn $field [ $newdb getFieldValue $nrn $field ]
+		} else {
+			$::gorilla::db unsetFieldValue $rn $field
+		}
+	}
+
+	if { 6 in $fields && [ $newdb existsField $nrn 8 ] } {
+		$::gorilla::db setFieldValue $rn 8 [ $newdb getFieldValue $nrn 8 ]
+	}
+
+	if { [ llength $fields ] > 0 && [ $newdb existsField $nrn 12 ] } {
+		set nmtime [ $newdb getFieldValue $nrn 12 ]
+		if { ! [ $::gorilla::db existsField $rn 12 ] || \
+			[ $::gorilla::db getFieldValue $rn 12 ] < $nmtime } {
+			$::gorilla::db setFieldValue $rn 12 $nmtime
+		}
+	}
+}
+
+
+# ----------------------------------------------------------------------
+# Changes of the database file by other programs
+# ----------------------------------------------------------------------
+#
+# Another Password Gorilla, or a sync tool, may rewrite the open
+# database file.  Plain Tcl has no file change notification, so the
+# file is polled every watchInterval seconds.  When it changed, the new
+# version is read with the password of the open database, in a worker
+# thread if the Thread package is there, see pwsafe::readRecords, so
+# that the key stretching and decryption do not block the GUI.
+#
+# The records of both are matched by MergeRecordKey and compared against
+# the base, the records as they were when the file was last read or
+# written.  The base is a pwsafe::db snapshot: it holds the records
+# still encrypted, and costs nothing for records that are not changed
+# afterwards.  Logins changed, added or deleted in the file only are
+# taken over; logins changed differently in both are conflicts, which
+# are added as a copy like a merge does and go to conflict-dialog.
+#
+# ::gorilla::watch is indexed by the db object, the value is a dict
+# with the file name, its stamp, the base, and the stamp of a version
+# of the file that could not be read, which is not tried again.
+#
+
+proc gorilla::FileStamp { fileName } {
+	# Returns what tells whether fileName was rewritten: its modification
+	# time, size and inode.  Empty if the file can not be accessed.
+
+	if { [ catch { file stat $fileName stat } ] } {
+		return ""
+	}
+	return [ list $stat(mtime) $stat(size) $stat(ino) ]
+}
+
+proc gorilla::WatchFile { db fileName } {
+	# Takes the records of db as the base for later changes of fileName,
+	# which db was just read from or written to
+
+	set ::gorilla::watch($db) [ dict create fileName $fileName \
+		stamp [ FileStamp $fileName ] base [ $db snapshot ] failed "" ]
+}
+
+proc gorilla::ArrangeWatchFile {} {
+	if { [ info exists ::gorilla::watchTimerId ] } {
+		after cancel $::gorilla::watchTimerId
+		unset ::gorilla::watchTimerId
+	}
+
+	set seconds $::gorilla::preference(watchInterval)
+	if { $seconds > 0 } {
+		set ::gorilla::watchTimerId [ after [ expr { $seconds * 1000 } ] ::gorilla::WatchFileTimeout ]
+	}
+}
+
+proc gorilla::WatchFileTimeout {} {
+	unset -nocomplain ::gorilla::watchTimerId
+	CheckFileChanged
+	ArrangeWatchFile
+}
+
+proc gorilla::CheckFileChanged { {markDirty 1} } {
+	# Takes over the changes of the file of the active vault, if it was
+	# rewritten since it was last read or written.  Returns
+	#
+	#   unchanged - nothing to do, or the vault can not be checked now
+	#   changed   - the changes were taken over
+	#   error     - the file changed, but can not be read
+	#   busy      - the file is being read already
+	#
+	# markDirty - 0 leaves the database as it is also after a conflict,
+	#             for Save, which is about to write it anyway
+
+	foreach db [ array names ::gorilla::watch ] {
+		if { [ info commands $db ] eq "" } {
+			unset ::gorilla::watch($db)
+		}
+	}
+
+	if { $::gorilla::watchBusy } {
+		return busy
+	}
+	if { ! [ info exists ::gorilla::db ] || ! [ info exists ::gorilla::fileName ] || \
+		( [ info exists ::gorilla::isLocked ] && $::gorilla::isLocked ) || \
+		! [ info exists ::gorilla::watch($::gorilla::db) ] } {
+		return unchanged
+	}
+
+	set db $::gorilla::db
+	set fileName [ dict get $::gorilla::watch($db) fileName ]
+	set stamp [ FileStamp $fileName ]
+
+	if { $fileName ne $::gorilla::fileName || $stamp eq "" || \
+		$stamp eq [ dict get $::gorilla::watch($db) stamp ] } {
+		return unchanged
+	}
+	if { $stamp eq [ dict get $::gorilla::watch($db) failed ] } {
+		return error
+	}
+
+	set ::gorilla::watchBusy 1
+	set ::gorilla::status [ mc "The database file was changed, reading it ..." ]
+
+	set password [ $db getPassword ]
+	set failed [ catch { pwsafe::readRecords $fileName $password } fileRecords ]
+	pwsafe::int::randomizeVar password
+
+	set ::gorilla::watchBusy 0
+
+	if { $failed } {
+		if { [ info exists ::gorilla::watch($db) ] } {
+			dict set ::gorilla::watch($db) failed $stamp
+		}
+		set ::gorilla::status [ mc "The changed database file can not be read: %s" $fileRecords ]
+		return error
+	}
+
+	#
+	# The event loop ran meanwhile: the vault may have been switched,
+	# locked or closed, or the file changed again.  Try again later then.
+	#
+
+	if { ! [ info exists ::gorilla::db ] || $::gorilla::db ne $db || \
+		( [ info exists ::gorilla::isLocked ] && $::gorilla::isLocked ) || \
+		! [ info exists ::gorilla::watch($db) ] || [ FileStamp $fileName ] ne $stamp } {
+		pwsafe::int::randomizeVar fileRecords
+		return unchanged
+	}
+
+	set result [ ApplyFileChanges $fileRecords ]
+	pwsafe::int::randomizeVar fileRecords
+	dict set ::gorilla::watch($db) stamp $stamp
+
+	lassign $result updated added deleted conflicts
+	set numConflicts [ expr { [ llength $conflicts ] / 4 } ]
+
+	set ::gorilla::status [ mc "Database file changed: %d logins updated, %d added, %d deleted, %d conflicts." \
+		$updated $added $deleted $numConflicts ]
+
+	if { $numConflicts > 0 } {
+		lappend ::gorilla::merge_conflict_data {*}$conflicts
+		if { $markDirty } {
+			MarkDatabaseAsDirty
+		}
+		UpdateMenu
+		catch { ::gorilla::conflict-dialog $conflicts }
+	}
+	return changed
+}
+
+proc gorilla::FieldsRecordKey { fields } {
+	# MergeRecordKey of a record given as a dict of field type and value
+
+	if { [ dict exists $fields 1 ] } {
+		return [ list uuid [ dict get $fields 1 ] ]
+	}
+
+	set key [ list login ]
+	foreach field {2 3 4} {
+		lappend key [ DictGetDefault $fields $field ]
+	}
+	return $key
+}
+
+proc gorilla::ApplyFileChanges { fileRecords } {
+	# Applies the changes that the new version of the file of the active
+	# vault made against the base, and makes the records that are now the
+	# same as in the file the new base.  Returns the numbers of logins
+	# updated, added and deleted, and the list of conflicts for
+	# conflict-dialog.
+	#
+	# fileRecords - the records of the file, see pwsafe::readRecords
+
+	set db $::gorilla::db
+	set tree $::gorilla::widgets(tree)
+	set base [ dict get $::gorilla::watch($db) base ]
+	set current [ $db snapshot ]
+
+	# the merged copies of open conflicts have the key of their login
+	set copies [ list ]
+	foreach { crn mrn cnode mnode } [ expr { [ info exists ::gorilla::merge_conflict_data ] ? \
+		$::gorilla::merge_conflict_data : "" } ] {
+		lappend copies $mrn
+	}
+
+	array set recordNodes {}
+	set pending [ list RootNode ]
+	while { [ llength $pending ] } {
+		set pending [ lassign $pending parent ]
+		foreach child [ $tree children $parent ] {
+			lassign [ $tree item $child -values ] type crn
+			if { $type eq "Group" } {
+				lappend pending $child
+			} elseif { $type eq "Login" } {
+				set recordNodes($crn) $child
+			}
+		}
+	}
+
+	array set localRecords {}
+	array set localKeys {}
+	foreach rn [ $db getAllRecordNumbers ] {
+		if { $rn in $copies } {
+			continue
+		}
+		set key [ MergeRecordKey $db $rn ]
+		set localRecords($key) $rn
+		set localKeys($rn) $key
+	}
+
+	#
+	# A base record that was not changed since is read from the database,
+	# only the changed ones from their snapshot
+	#
+
+	array set baseRecords {}
+	dict for { rn token } $base {
+		if { $rn in $copies } {
+			continue
+		}
+		if { [ dict exists $current $rn ] && [ dict get $current $rn ] eq $token } {
+			set baseRecords($localKeys($rn)) [ list $rn {} ]
+		} else {
+			set fields [ $db snapshotFields $token ]
+			set baseRecords([ FieldsRecordKey $fields ]) [ list $rn $fields ]
+		}
+	}
+
+	set updated 0
+	set added 0
+	set deleted 0
+	set conflicts [ list ]
+	set fileFields ""
+	set localFields ""
+	set baseFields ""
+	array set fileKeys {}
+
+	dict for { nrn fileFields } $fileRecords {
+		set key [ FieldsRecordKey $fileFields ]
+		set fileKeys($key) 1
+
+		set brn ""
+		set baseFields ""
+		if { [ info exists baseRecords($key) ] } {
+			lassign $baseRecords($key) brn baseFields
+			if { $baseFields eq "" } {
+				set baseFields [ $db snapshotFields [ dict get $current $brn ] ]
+			}
+			if { $fileFields eq $baseFields } {
+				# not changed in the file
+				continue
+			}
+		}
+
+		if { ! [ info exists localRecords($key) ] } {
+			#
+			# New in the file, or changed there and deleted here: the
+			# change wins over the deletion
+			#
+
+			if { $brn ne "" } {
+				dict unset base $brn
+			}
+			set rn [ $db createRecord ]
+			$db setFieldValues $rn $fileFields
+			dict set base $rn [ dict get [ $db snapshot $rn ] $rn ]
+			AddRecordToTree $rn
+			incr added
+			continue
+		}
+
+		set rn $localRecords($key)
+		set localFields [ $db snapshotFields [ dict get $current $rn ] ]
+
+		if { $localFields eq $fileFields } {
+			dict set base $rn [ dict get $current $rn ]
+			continue
+		}
+
+		if { $baseFields ne "" && $localFields eq $baseFields } {
+			# changed in the file only
+			$db setFieldValues $rn $fileFields
+			foreach field [ dict keys $localFields ] {
+				if { ! [ dict exists $fileFields $field ] } {
+					$db unsetFieldValue $rn $field
+				}
+			}
+			dict set base $rn [ dict get [ $db snapshot $rn ] $rn ]
+			if { [ info exists recordNodes($rn) ] } {
+				$tree delete $recordNodes($rn)
+			}
+			set recordNodes($rn) [ AddRecordToTree $rn ]
+			incr updated
+			continue
+		}
+
+		#
+		# Changed in both: the version of the file becomes the base of
+		# the login, so that it is not reported again, and is added as
+		# a copy with a modified title
+		#
+
+		set copy [ $db createRecord ]
+		$db setFieldValues $copy $fileFields
+		dict set base $rn [ dict get [ $db snapshot $copy ] $copy ]
+		$db setFieldValue $copy 3 [ MergeConflictTitle \
+			[ DictGetDefault $fileFields 3 "<No Title>" ] [ DictGetDefault $fileFields 12 ] ]
+		set node [ AddRecordToTree $copy ]
+
+		set parent [ $tree parent $node ]
+		while { $parent ne "RootNode" } {
+			$tree item $parent -open 1
+			set parent [ $tree parent $parent ]
+		}
+
+		lappend conflicts $rn $copy \
+			[ expr { [ info exists recordNodes($rn) ] ? $recordNodes($rn) : "" } ] $node
+	}
+
+	#
+	# Deleted in the file: deleted here too, unless changed here
+	#
+
+	foreach key [ array names baseRecords ] {
+		if { [ info exists fileKeys($key) ] } {
+			continue
+		}
+		lassign $baseRecords($key) brn baseFields
+		dict unset base $brn
+		if { ! [ info exists localRecords($key) ] } {
+			continue
+		}
+		set rn $localRecords($key)
+		if { $baseFields ne "" && [ $db snapshotFields [ dict get $current $rn ] ] ne $baseFields } {
+			continue
+		}
+		$db deleteRecord $rn
+		if { [ info exists recordNodes($rn) ] } {
+			$tree delete $recordNodes($rn)
+		}
+		incr deleted
+	}
+
+	dict set ::gorilla::watch($db) base $base
+	pwsafe::int::randomizeVar fileFields localFields baseFields
+	return [ list $updated $added $deleted $conflicts ]
+}
 
 proc gorilla::Save {} {
 	ArrangeIdleTimeout
 
+	if { [ StillLoading ] } {
+		return GORILLA_SAVEERROR
+	}
+
+	#
+	# If another program rewrote the file since it was read, take its
+	# changes over first instead of overwriting them
+	#
+
+	switch -- [ CheckFileChanged 0 ] {
+		busy {
+			set ::gorilla::status [ mc "The database file was changed and is being read. Please save again afterwards." ]
+			return GORILLA_SAVEERROR
+		}
+		error {
+			set answer [ tk_messageBox -parent . -type yesno -icon warning -default no \
+				-title [ mc "Database File Changed" ] \
+				-message [ mc "The database file was changed by another program, but can not be read with the password of this database. Do you want to overwrite it?" ] ]
+			if { $answer ne "yes" } {
+				return GORILLA_SAVEERROR
+			}
+		}
+	}
+
 	#
 	# Test for write access to the pwsafe database
 	#
@@ -4362,8 +6120,11 @@ proc gorilla::Save {} {
 	# avoid gray area during save
 	update
 
+	set timing [ pwsafe::timing::begin save $::gorilla::fileName ]
+
 	if { [ catch { pwsafe::writeToFile $::gorilla::db $nativeName $majorVersion \
-			$pvar } oops ] } {
+			$pvar $timing } oops ] } {
+		pwsafe::timing::end $timing
 		::gorilla::progress finished .status
 		
 		. configure -cursor $myOldCursor
@@ -4373,10 +6134,12 @@ proc gorilla::Save {} {
 	}
 
 	::gorilla::progress finished .status
+	WatchFile $::gorilla::db $::gorilla::fileName
 	
 	# The actual data are saved. Now take care of a backup file
 
-	set message [ gorilla::SaveBackup $::gorilla::fileName ]
+	set message [ pwsafe::timing::measure $timing backup { gorilla::SaveBackup $::gorilla::fileName } ]
+	pwsafe::timing::end $timing
 
 	if { $message ne "GORILLA_OK" } {
 		. configure -cursor $myOldCursor
@@ -4400,20 +6163,14 @@ proc gorilla::Save {} {
 		}
 	}
 
-	# The actual data are saved. Now take care of a backup file
+	# The backup was taken right after writing the file above; another
+	# SaveBackup here would add a second snapshot to the backup store
 
 	if {$::gorilla::preference(keepBackupFile)} {
-		set message [ gorilla::SaveBackup $::gorilla::fileName ]
-		if { [lindex $message 0] ne "GORILLA_OK" } {
-			# gorilla::ErrorPopup  [lindex $message 0] [lindex $message 1]
-			set ::gorilla::status [mc "Password database saved but backup copy failed: [lindex $message 1]." ]
-			return GORILLA_SAVEBACKUPERROR
-		} else {
-			set ::gorilla::status [mc "Password database saved with backup copy." ]
-			return GORILLA_OK
-		}
+		set ::gorilla::status [mc "Password database saved with backup copy." ]
+	} else {
+		set ::gorilla::status [mc "Password database saved."] 
 	}
-	set ::gorilla::status [mc "Password database saved."] 
 	
 	return GORILLA_OK
 }
@@ -4427,6 +6184,10 @@ proc gorilla::Save {} {
 proc gorilla::SaveAs {} {
 	ArrangeIdleTimeout
 
+	if { [ StillLoading ] } {
+		return GORILLA_SAVEERROR
+	}
+
 	if {![info exists ::gorilla::db]} {
 		gorilla::ErrorPopup [ mc "Nothing To Save" ] \
 		[ mc "No password database to save." ]
@@ -4489,6 +6250,7 @@ proc gorilla::SaveAs {} {
 	# The actual data are saved. Now take care of a backup file
 
   set ::gorilla::fileName $fileName
+	WatchFile $::gorilla::db $::gorilla::fileName
 	set message [ gorilla::SaveBackup $::gorilla::fileName ]
 
 	if { $message ne "GORILLA_OK" } {
@@ -4524,21 +6286,9 @@ proc gorilla::SaveAs {} {
 	
 	UpdateMenu
 
-	# The actual data are saved. Now take care of a backup file
+	# the backup was already taken above; another SaveBackup here would
+	# add a second snapshot to the backup store
 
-	if {$::gorilla::preference(keepBackupFile)} {
-		set message [ gorilla::SaveBackup $::gorilla::fileName ]
-		if { [lindex $message 0] ne "GORILLA_OK" } {
-			# gorilla::ErrorPopup  [lindex $message 0] [lindex $message 1]
-			set ::gorilla::status [mc "Password database saved but backup copy failed: [lindex $message 1]." ]
-			return GORILLA_SAVEBACKUPERROR
-		} else {
-			set ::gorilla::status [mc "Password database saved with backup copy." ]
-			return GORILLA_OK
-		}
-	}
-	set ::gorilla::status [mc "Password database saved."] 
-	
 	return GORILLA_OK
   
 } ; # end proc gorilla::SaveAs
@@ -4607,6 +6357,19 @@ proc gorilla::SaveBackup { filename } {
 		}
 	} ; # end if backupPath preference
 	
+	# with the backup store, only the changed records of this save are
+	# added as a new snapshot instead of copying the whole file
+
+	if { $::gorilla::preference(backupStore) } {
+		set storeDir [ pwsafe::store::directory $backupPath $filename ]
+		if { [ catch { pwsafe::store::addSnapshot $storeDir $::gorilla::db \
+				[ file tail $filename ] $::gorilla::preference(backupStoreKeep) } oops ] } {
+			return [ list $errorType [ mc "Failed to add a snapshot to the backup store %s:\n%s" \
+				[ file nativename $storeDir ] $oops ] ]
+		}
+		return GORILLA_OK
+	}
+
 	set backupFile [ file join $backupPath $backupFileName ]
 
 	if {[catch {
@@ -4619,6 +6382,130 @@ proc gorilla::SaveBackup { filename } {
 	return GORILLA_OK
 } ;# end of proc gorilla::SaveBackup
 
+proc gorilla::RestoreBackup {} {
+
+	# Shows the snapshots in the backup store of the current database and
+	# lets the user write one of them to a new database file
+
+	ArrangeIdleTimeout
+
+	if { ! [ info exists ::gorilla::fileName ] } {
+		return
+	}
+
+	if { $::gorilla::preference(backupPath) eq "" } {
+		set backupPath [ file dirname $::gorilla::fileName ]
+	} else {
+		set backupPath $::gorilla::preference(backupPath)
+	}
+	set storeDir [ pwsafe::store::directory $backupPath $::gorilla::fileName ]
+	set snapshots [ lreverse [ pwsafe::store::snapshots $storeDir ] ]
+
+	if { [ llength $snapshots ] == 0 } {
+		tk_messageBox -parent . -type ok -icon info -default ok \
+			-title [ mc "Restore Backup" ] \
+			-message [ mc "There are no snapshots in the backup store %s." [ file nativename $storeDir ] ]
+		return
+	}
+
+	set top .restoreBackup
+
+	if {![info exists ::gorilla::toplevel($top)]} {
+		toplevel $top -class "Gorilla"
+		wm title $top [ mc "Restore Backup" ]
+
+		set w [ ttk::frame $top.f -padding {10 10} ]
+		ttk::label $w.l -text [ mc "Snapshots, newest first:" ]
+		listbox $w.lb -height 15 -width 40 -yscrollcommand [ list $w.vsb set ]
+		ttk::scrollbar $w.vsb -orient vertical -command [ list $w.lb yview ]
+		ttk::frame $w.buttons
+		ttk::button $w.buttons.restore -text [ mc "Restore" ] \
+			-command [ list gorilla::RestoreBackupSnapshot $top ]
+		ttk::button $w.buttons.close -text [ mc "Close" ] \
+			-command [ list gorilla::DestroyDialog $top ]
+		pack $w.buttons.restore $w.buttons.close -side left -padx 10
+
+		grid $w.l - -sticky w
+		grid $w.lb $w.vsb -sticky news
+		grid $w.buttons - -pady {10 0}
+		grid columnconfigure $w 0 -weight 1
+		grid rowconfigure $w 1 -weight 1
+		pack $w -fill both -expand 1
+
+		bind $w.lb <Double-Button-1> [ list gorilla::RestoreBackupSnapshot $top ]
+
+		set ::gorilla::toplevel($top) $top
+		wm protocol $top WM_DELETE_WINDOW [ list gorilla::DestroyDialog $top ]
+	} else {
+		wm deiconify $top
+	}
+
+	set ::gorilla::restoreStoreDir $storeDir
+	$top.f.lb delete 0 end
+	$top.f.lb insert end {*}$snapshots
+	$top.f.lb selection set 0
+
+	raise $top
+	focus $top.f.lb
+
+} ; # end proc gorilla::RestoreBackup
+
+proc gorilla::RestoreBackupSnapshot { top } {
+
+	# Writes the snapshot selected in the restore dialog to a file chosen
+	# by the user.  The password of the current database is tried first,
+	# the user is asked for the password of the snapshot if it differs.
+
+	ArrangeIdleTimeout
+
+	set selection [ $top.f.lb curselection ]
+	if { [ llength $selection ] == 0 } {
+		return
+	}
+	set snapshot [ $top.f.lb get [ lindex $selection 0 ] ]
+	set storeDir $::gorilla::restoreStoreDir
+
+	set fileName [ filename_query Save -parent $top \
+		-title [ mc "Save restored password database ..." ] ]
+	if { $fileName eq "" } {
+		return
+	}
+
+	set myOldCursor [ . cget -cursor ]
+	. configure -cursor watch
+	update idletasks
+
+	set password [ $::gorilla::db getPassword ]
+	if { [ catch { set db [ pwsafe::store::restore $storeDir $snapshot $password ] } ] } {
+		. configure -cursor $myOldCursor
+		if { [ catch { set password [ GetPassword 0 [ mc "Password of the snapshot:" ] ] } ] } {
+			pwsafe::int::randomizeVar password
+			return
+		}
+		. configure -cursor watch
+		update idletasks
+		if { [ catch { set db [ pwsafe::store::restore $storeDir $snapshot $password ] } oops ] } {
+			pwsafe::int::randomizeVar password
+			. configure -cursor $myOldCursor
+			ErrorPopup [ mc "Error Restoring Backup" ] $oops
+			return
+		}
+	}
+	pwsafe::int::randomizeVar password
+
+	set failed [ catch { pwsafe::writeToFile $db $fileName 3 } oops ]
+	itcl::delete object $db
+	. configure -cursor $myOldCursor
+
+	if { $failed } {
+		ErrorPopup [ mc "Error Restoring Backup" ] $oops
+		return
+	}
+
+	set ::gorilla::status [ mc "Snapshot %s restored to %s." $snapshot [ file nativename $fileName ] ]
+
+} ; # end proc gorilla::RestoreBackupSnapshot
+
 # ----------------------------------------------------------------------
 # Rebuild Tree
 # ----------------------------------------------------------------------
@@ -4630,7 +6517,12 @@ proc gorilla::AddAllRecordsToTree {} {
 	}
 }
 
-proc gorilla::AddRecordToTree {rn} {
+proc gorilla::AddRecordToTree {rn {position sorted}} {
+
+	# Adds the login of record rn to the tree and returns its node.  With
+	# position "end" the login is appended to its group instead of being
+	# put in order, and the caller sorts the group, see AddRecordsToTree.
+
 	set groupName [ ::gorilla::dbget group $rn ]
 
 	set parentNode [AddGroupToTree $groupName]
@@ -4647,7 +6539,11 @@ proc gorilla::AddRecordToTree {rn} {
 	#
 
 	# set childNodes [$::gorilla::widgets(tree) nodes $parentNode]
-	set childNodes [$::gorilla::widgets(tree) children $parentNode]
+	if {$position eq "end"} {
+		set childNodes [list]
+	} else {
+		set childNodes [$::gorilla::widgets(tree) children $parentNode]
+	}
 
 	for {set i 0} {$i < [llength $childNodes]} {incr i} {
 		set childNode [lindex $childNodes $i]
@@ -4676,6 +6572,48 @@ proc gorilla::AddRecordToTree {rn} {
 	return $nodename
 }
 
+proc gorilla::AddRecordsToTree {rns} {
+
+	# Adds many records to the tree at once.  The new login nodes are
+	# appended to their groups first, and every group that received new
+	# logins is sorted only once afterwards, instead of searching for the
+	# insert position of each login.
+
+	set tree $::gorilla::widgets(tree)
+	array set touched {}
+
+	foreach rn $rns {
+		set node [AddRecordToTree $rn end]
+		set touched([$tree parent $node]) 1
+	}
+
+	foreach parentNode [array names touched] {
+		SortTreeChildren $parentNode
+	}
+}
+
+proc gorilla::SortTreeChildren {parentNode} {
+
+	# Puts the children of a tree node in order with one sort: groups in
+	# front, logins after them, both in alphabetical order
+
+	set tree $::gorilla::widgets(tree)
+	set groups [list]
+	set logins [list]
+	foreach childNode [$tree children $parentNode] {
+		if {[lindex [$tree item $childNode -values] 0] == "Login"} {
+			lappend logins [list [$tree item $childNode -text] $childNode]
+		} else {
+			lappend groups [list [$tree item $childNode -text] $childNode]
+		}
+	}
+	set children [list]
+	foreach child [concat [lsort -index 0 $groups] [lsort -index 0 $logins]] {
+		lappend children [lindex $child 1]
+	}
+	$tree children $parentNode $children
+}
+
 proc gorilla::AddGroupToTree {groupName} {
 	if {[info exists ::gorilla::groupNodes($groupName)]} {
 		set parentNode $::gorilla::groupNodes($groupName)
@@ -4778,6 +6716,17 @@ proc gorilla::UpdateMenu {} {
     if { ! $::gorilla::hasDownloadsFile } {
 		setmenustate $::gorilla::widgets(main) dld disabled
     }
+
+	# nothing is copied, changed or saved, and no other vault is opened
+	# or switched to, before the whole database is read and authenticated
+
+	if { [ info exists ::gorilla::loading ] } {
+		foreach tag { group login save open conflict vaults } {
+			setmenustate $::gorilla::widgets(main) $tag disabled
+		}
+	} else {
+		setmenustate $::gorilla::widgets(main) vaults normal
+	}
 	
 }
 
@@ -4795,6 +6744,15 @@ proc gorilla::Exit {} {
 
 	set ::gorilla::exiting 1
 
+	#
+	# The other open vaults first, then the current one
+	#
+
+	if {![SaveVaults]} {
+		set ::gorilla::exiting 0
+		return 0
+	}
+
 	#
 	# If the current database was modified, give user a chance to think
 	#
@@ -5539,18 +7497,16 @@ proc gorilla::PasswordPolicyDialog {title settings} {
 # ----------------------------------------------------------------------
 #
 
-proc gorilla::GeneratePassword {settings} {
-	set easyLowercaseLetters "abcdefghkmnpqrstuvwxyz"
-	set notEasyLowercaseLetters "ijlo"
-	set easyUppercaseLetters [string toupper $easyLowercaseLetters]
-	set notEasyUppercaseLetters [string toupper $notEasyLowercaseLetters]
-	set easyDigits "23456789"
-	set notEasyDigits "01"
-	set easySymbols "+-=_@#\$%^&<>/~\\?"
-	set notEasySymbols "!|()"
+#
+# Symbol sets of the password policies used so far, by policy settings
+# without the length
+#
 
+variable gorilla::symbolSets
+array set gorilla::symbolSets {}
+
+proc gorilla::PasswordSymbolSet {settings} {
 	array set params [list \
-		length 0 \
 		uselowercase 0 \
 		useuppercase 0 \
 		usedigits 0 \
@@ -5558,6 +7514,21 @@ proc gorilla::GeneratePassword {settings} {
 		usesymbols 0 \
 		easytoread 0]
 	array set params $settings
+	unset -nocomplain params(length)
+
+	set key [lsort -stride 2 [array get params]]
+	if {[info exists ::gorilla::symbolSets($key)]} {
+		return $::gorilla::symbolSets($key)
+	}
+
+	set easyLowercaseLetters "abcdefghkmnpqrstuvwxyz"
+	set notEasyLowercaseLetters "ijlo"
+	set easyUppercaseLetters [string toupper $easyLowercaseLetters]
+	set notEasyUppercaseLetters [string toupper $notEasyLowercaseLetters]
+	set easyDigits "23456789"
+	set notEasyDigits "01"
+	set easySymbols "+-=_@#\$%^&<>/~\\?"
+	set notEasySymbols "!|()"
 
 	set symbolSet ""
 
@@ -5594,21 +7565,158 @@ proc gorilla::GeneratePassword {settings} {
 			append symbolSet $notEasySymbols
 		}
 	}
- 
-	set numSymbols [string length $symbolSet]
 
-	if {$numSymbols == 0} {
+	if {[string length $symbolSet] == 0} {
+		error "invalid settings"
+	}
+
+	set ::gorilla::symbolSets($key) [split $symbolSet ""]
+	return $::gorilla::symbolSets($key)
+}
+
+#
+# Generates count passwords for the password policy settings. Random
+# bytes are taken from ISAAC in bulk, and a byte is only used if it is
+# below the largest multiple of the number of symbols, so that every
+# symbol is equally likely.
+#
+
+proc gorilla::GeneratePasswords {settings count} {
+	array set params [list length 0]
+	array set params $settings
+
+	set symbols [PasswordSymbolSet $settings]
+	set numSymbols [llength $symbols]
+	set limit [expr {256 - 256 % $numSymbols}]
+	set needed [expr {$count * $params(length)}]
+
+	set indices [list]
+	while {[llength $indices] < $needed} {
+
+		# ask for the expected number of bytes, and a few more
+
+		set missing [expr {$needed - [llength $indices]}]
+		set bytes [::isaac::bytes [expr {$missing * 256 / $limit + 16}]]
+		binary scan $bytes cu* values
+		pwsafe::int::randomizeVar bytes
+
+		foreach value $values {
+			if {$value < $limit} {
+				lappend indices [expr {$value % $numSymbols}]
+			}
+		}
+		pwsafe::int::randomizeVar values
+	}
+
+	set passwords [list]
+	set i 0
+	for {set n 0} {$n < $count} {incr n} {
+		set generatedPassword ""
+		foreach index [lrange $indices $i [expr {$i + $params(length) - 1}]] {
+			append generatedPassword [lindex $symbols $index]
+		}
+		incr i $params(length)
+		lappend passwords $generatedPassword
+	}
+	pwsafe::int::randomizeVar indices
+
+	return $passwords
+}
+
+proc gorilla::GeneratePassword {settings} {
+	return [lindex [GeneratePasswords $settings 1] 0]
+}
+
+#
+# Returns the record numbers of the selected logins, and of all logins
+# in the selected groups and their subgroups
+#
+
+proc gorilla::GetSelectedRecords {} {
+	set rns [list]
+	set nodes [$::gorilla::widgets(tree) selection]
+
+	while {[llength $nodes]} {
+		set nodes [lassign $nodes node]
+		set data [$::gorilla::widgets(tree) item $node -values]
+		if {[lindex $data 0] == "Login"} {
+			lappend rns [lindex $data 1]
+		} else {
+			lappend nodes {*}[$::gorilla::widgets(tree) children $node]
+		}
+	}
+
+	return [lsort -integer -unique $rns]
+}
+
+#
+# Replaces the passwords of many records at once with new ones of the
+# password policy settings. The records are changed in one update of
+# the database, which is marked as dirty only once, so that the tree
+# is refreshed and an immediate save is done once for all of them.
+#
+
+proc gorilla::RotatePasswordsOfRecords {rns settings} {
+	if {![dict exists $settings length] || [dict get $settings length] < 1} {
 		error "invalid settings"
 	}
 
-	set generatedPassword ""
-	for {set i 0} {$i < $params(length)} {incr i} {
-		set rand [::isaac::rand]
-		set randSymbol [expr {int($rand*$numSymbols)}]
-		append generatedPassword [string index $symbolSet $randSymbol]
+	set passwords [GeneratePasswords $settings [llength $rns]]
+	set now [clock seconds]
+
+	set updates [dict create]
+	foreach rn $rns password $passwords {
+		dict set updates $rn [list 6 $password 8 $now 12 $now]
+	}
+	pwsafe::int::randomizeVar passwords
+
+	try {
+		$::gorilla::db updateRecords $updates
+	} finally {
+		pwsafe::int::randomizeVar updates
+	}
+
+	MarkDatabaseAsDirty
+}
+
+proc gorilla::RotatePasswords {} {
+	ArrangeIdleTimeout
+
+	set rns [GetSelectedRecords]
+
+	if {[llength $rns] == 0} {
+		tk_messageBox -parent . \
+			-type ok -icon error -default ok \
+			-title [mc "Rotate Passwords"] \
+			-message [mc "Please select the logins or groups whose passwords\
+			should be replaced."]
+		return
+	}
+
+	set settings [PasswordPolicyDialog [mc "Rotate Passwords"] \
+		[GetDefaultPasswordPolicy]]
+	if {![llength $settings]} {
+		return
+	}
+
+	set answer [tk_messageBox -parent . \
+		-type yesno -icon question -default no \
+		-title [mc "Rotate Passwords"] \
+		-message [mc "Replace the passwords of %d logins with new ones?" \
+			[llength $rns]]]
+	if {$answer != "yes"} {
+		return
+	}
+
+	if {[catch {RotatePasswordsOfRecords $rns $settings} oops]} {
+		tk_messageBox -parent . \
+			-type ok -icon error -default ok \
+			-title [mc "Rotate Passwords"] \
+			-message [mc "The passwords could not be replaced:\n%s" $oops]
+		return
 	}
 
-	return $generatedPassword
+	set ::gorilla::status [mc "Passwords of %d logins replaced." [llength $rns]]
 }
 
 # ----------------------------------------------------------------------
@@ -5692,15 +7800,10 @@ proc gorilla::DatabasePreferencesDialog {} {
 		set delayf [ ttk::labelframe $top.delay -padding {10 5} -text [ mc "Calculate delay time" ] ]
 		pack $delayf -anchor w -side top -fill x -expand true -padx {10 10} -pady {0 2m}
 		
-		ttk::label  $delayf.feedback -text [ mc "Default: %s" $::gorilla::dpd(keyStretchingIterations) ]
-		ttk::button $delayf.compute  -text [ mc "Calculate" ] -command [ namespace code [ subst {
-		  $delayf.compute configure -text "[ mc "Calculating" ]"
-		  update idletasks
-		  $delayf.feedback configure -text \[ mc "%s sec(s) for %d iterations" \
-                                   \[ expr { \[ pwsafe::int::keyStretchMsDelay \[ $top.stretch.spin get ] ] / 1000.0 } ] \
-                                   \[ $top.stretch.spin get ] ]
-		  $delayf.compute configure -text [ mc "Calculate" ]
-		  } ] ]
+		ttk::label  $delayf.feedback -text [ mc "Default: %s" $::gorilla::dpd(keyStretchingIterations) ] \
+			-wraplength 300
+		ttk::button $delayf.compute  -text [ mc "Calculate" ] \
+			-command [ list gorilla::TimeKeyStretch $top ]
 		grid $delayf.feedback $delayf.compute -sticky news -padx {1m 1m} -pady {1m 1m}
 		
 		# === auto iter computation
@@ -5710,14 +7813,10 @@ proc gorilla::DatabasePreferencesDialog {} {
 
 		ttk::label $aiterf.label1 -text [ mc "Delay for" ]
 		spinbox $aiterf.spin -from 1 -to 600 -increment 1 -justify right -width 5 
-		ttk::label $aiterf.spinlabel2 -text [ mc "sec(s)" ]
+		ttk::label $aiterf.spinlabel2 -text [ mc "sec(s) with the %s sha256" \
+			[ KeyStretchBackendName [ pwsafe::int::keyStretchBackend ] ] ]
 		ttk::button $aiterf.calculate -text [ mc "Calculate" ] \
-		  -command [ namespace code [ subst { 
-		    $aiterf.calculate configure -text "[ mc "Calculating" ]"
-		    update idletasks
-		    $top.stretch.spin set \[ pwsafe::int::calculateKeyStrechForDelay \[ $aiterf.spin get ] ]
-		    $aiterf.calculate configure -text [ mc "Calculate" ]
-		  } ] ]
+			-command [ list gorilla::CalibrateKeyStretch $top ]
 		grid $aiterf.label1 $aiterf.spin $aiterf.spinlabel2 $aiterf.calculate -padx {1m 1m} -pady {1m 1m}
 
 		# ===
@@ -5778,27 +7877,138 @@ proc gorilla::DatabasePreferencesDialog {} {
 		}
 	}
 
-	set newVersion $::gorilla::dpd(defaultVersion)
+	set newVersion $::gorilla::dpd(defaultVersion)
+
+	if {$newVersion != $oldVersion} {
+		$::gorilla::db setHeaderField 0 [list $newVersion 0]
+		set isModified 1
+	}
+
+	$::gorilla::db configure -keyStretchingIterations \
+		$::gorilla::dpd(keyStretchingIterations)
+
+	if {$::gorilla::dpd(keyStretchingIterations) != $oldKeyStretchingIterations} {
+		set isModified 1
+	}
+
+	if {$isModified} {
+		MarkDatabaseAsDirty
+	}
+
+	ArrangeIdleTimeout
+
+} ; # end proc gorilla::DatabasePreferencesDialog
+
+proc gorilla::KeyStretchBackendName { backend } {
+
+	# Returns the name shown for a sha256 implementation, as in the About
+	# dialog
+
+	return [ dict get { critcl C tcl Tcl } $backend ]
+
+} ; # end proc gorilla::KeyStretchBackendName
+
+proc gorilla::TwofishBackendName { backend } {
+
+	# Returns the name shown for a Twofish implementation, see
+	# itwofish::itwofish::kernel
+
+	return [ dict get { avx2 "C (AVX2)" scalar C f32 "C f32" tcl Tcl } $backend ]
+
+} ; # end proc gorilla::TwofishBackendName
+
+proc gorilla::KeyStretchCeilingWarning { iterations msPerIteration } {
+
+	# Returns a warning if a keystretch of iterations would take longer
+	# than the keyStretchTclCeiling preference with the pure Tcl sha256,
+	# or an empty string
+	#
+	# msPerIteration - milliseconds per iteration of the pure Tcl sha256
+
+	set ceiling $::gorilla::preference(keyStretchTclCeiling)
+	set seconds [ expr { $iterations * $msPerIteration / 1000.0 } ]
+
+	if { $ceiling == 0 || $seconds <= $ceiling } {
+		return ""
+	}
+	return [ mc "Without the C sha256 extension, opening the database would take about %.0f sec(s), more than the %d sec(s) set in the preferences." $seconds $ceiling ]
+
+} ; # end proc gorilla::KeyStretchCeilingWarning
+
+proc gorilla::ShowKeyStretchResult { top text warning } {
+
+	# Shows text and warning in the feedback label of the Database
+	# Preferences dialog, and warning in a message box as well
+
+	if { $warning ne "" } {
+		append text "\n" $warning
+	}
+	$top.delay.feedback configure -text $text
+	if { $warning ne "" } {
+		tk_messageBox -parent $top -type ok -icon warning -default ok \
+			-title [ mc "Key Stretching" ] -message $warning
+	}
+
+} ; # end proc gorilla::ShowKeyStretchResult
+
+proc gorilla::TimeKeyStretch { top } {
+
+	# Times the iteration count of the Database Preferences dialog with
+	# the sha256 in use, and estimates it for the pure Tcl sha256
+
+	set iterations [ $top.stretch.spin get ]
+	if { ! [ string is integer -strict $iterations ] } {
+		return
+	}
+
+	$top.delay.compute configure -text [ mc "Calculating" ] -state disabled
+	update idletasks
+
+	set backend [ pwsafe::int::keyStretchBackend ]
+	set ms [ pwsafe::int::keyStretchMsDelay $iterations ]
+	if { $backend eq "tcl" } {
+		set tclMs [ expr { $ms / $iterations } ]
+	} else {
+		set tclMs [ dict get [ pwsafe::int::measureKeyStretch tcl 3 ] msPerIteration ]
+	}
+
+	$top.delay.compute configure -text [ mc "Calculate" ] -state normal
 
-	if {$newVersion != $oldVersion} {
-		$::gorilla::db setHeaderField 0 [list $newVersion 0]
-		set isModified 1
-	}
+	ShowKeyStretchResult $top \
+		[ mc "%.2f sec(s) for %d iterations with the %s sha256" \
+			[ expr { $ms / 1000.0 } ] $iterations [ KeyStretchBackendName $backend ] ] \
+		[ KeyStretchCeilingWarning $iterations $tclMs ]
 
-	$::gorilla::db configure -keyStretchingIterations \
-		$::gorilla::dpd(keyStretchingIterations)
+} ; # end proc gorilla::TimeKeyStretch
 
-	if {$::gorilla::dpd(keyStretchingIterations) != $oldKeyStretchingIterations} {
-		set isModified 1
-	}
+proc gorilla::CalibrateKeyStretch { top } {
 
-	if {$isModified} {
-		MarkDatabaseAsDirty
+	# Sets the iteration count of the Database Preferences dialog to the
+	# one that takes the chosen delay with the sha256 in use
+
+	set seconds [ $top.autoiter.spin get ]
+	if { ! [ string is double -strict $seconds ] || $seconds <= 0 } {
+		return
 	}
 
-	ArrangeIdleTimeout
+	$top.autoiter.calculate configure -text [ mc "Calculating" ] -state disabled
+	update idletasks
 
-} ; # end proc gorilla::DatabasePreferencesDialog
+	set result [ pwsafe::int::calibrateKeyStretch $seconds ]
+	set iterations [ dict get $result stretchIterations ]
+
+	$top.autoiter.calculate configure -text [ mc "Calculate" ] -state normal
+	$top.stretch.spin set $iterations
+
+	ShowKeyStretchResult $top \
+		[ mc "%d iterations for %s sec(s) with the %s sha256, %d of %d samples used" \
+			$iterations $seconds \
+			[ KeyStretchBackendName [ dict get $result backend ] ] \
+			[ expr { [ llength [ dict get $result samples ] ] - [ dict get $result rejected ] } ] \
+			[ llength [ dict get $result samples ] ] ] \
+		[ KeyStretchCeilingWarning $iterations [ dict get $result tclMsPerIteration ] ]
+
+} ; # end proc gorilla::CalibrateKeyStretch
 
 # ----------------------------------------------------------------------
 # Preferences Dialog
@@ -5814,6 +8024,8 @@ proc gorilla::PreferencesDialog {} {
 
 	set top .preferencesDialog
 
+	load-package tooltip
+
 	# copy current preferences settings to a temp variable to handle
 	# "canceling" of preference changes
 	
@@ -5915,6 +8127,34 @@ proc gorilla::PreferencesDialog {} {
 		ttk::checkbutton $dpf.ts -text [mc "Time stamp backup"] \
 			-variable ::gorilla::prefTemp(timeStampBackup)
 
+		ttk::frame $dpf.store
+		ttk::checkbutton $dpf.store.c -text [mc "Keep backups in a deduplicated store, up to"] \
+			-variable ::gorilla::prefTemp(backupStore)
+		spinbox $dpf.store.s -from 0 -to 999 -increment 1 \
+			-justify right -width 4 \
+			-textvariable ::gorilla::prefTemp(backupStoreKeep)
+		ttk::label $dpf.store.l -text [mc "snapshots (0=all)"]
+		pack $dpf.store.c $dpf.store.s $dpf.store.l -side left -padx 3
+
+		ttk::checkbutton $dpf.compact -text [mc "Keep records compact in memory"] \
+			-variable ::gorilla::prefTemp(compactRecords)
+
+		ttk::frame $dpf.ceil
+		ttk::label $dpf.ceil.l1 -text [mc "Warn if key stretching takes over"]
+		spinbox $dpf.ceil.s -from 0 -to 999 -increment 1 \
+			-justify right -width 4 \
+			-textvariable ::gorilla::prefTemp(keyStretchTclCeiling)
+		ttk::label $dpf.ceil.l2 -text [mc "sec(s) with the Tcl sha256 (0=never)"]
+		pack $dpf.ceil.l1 $dpf.ceil.s $dpf.ceil.l2 -side left -padx 3
+
+		ttk::frame $dpf.watch
+		ttk::label $dpf.watch.l1 -text [mc "Look for changes of the database file every"]
+		spinbox $dpf.watch.s -from 0 -to 999 -increment 1 \
+			-justify right -width 4 \
+			-textvariable ::gorilla::prefTemp(watchInterval)
+		ttk::label $dpf.watch.l2 -text [mc "sec(s) (0=never)"]
+		pack $dpf.watch.l1 $dpf.watch.s $dpf.watch.l2 -side left -padx 3
+
 		ttk::frame $dpf.bakpath
 # puts $::gorilla::prefTemp(backupPath)
 		ttk::entry $dpf.bakpath.e -textvariable ::gorilla::prefTemp(backupPath)
@@ -5927,7 +8167,7 @@ proc gorilla::PreferencesDialog {} {
 		pack $dpf.bakpath.e -side left -padx 3 -expand 1 -fill x
 		pack $dpf.bakpath.b -side left -padx 3
 
-		pack $dpf.si $dpf.ver $dpf.uni $dpf.ts $dpf.bakpath -side top -anchor w -pady 3 -padx 10 -fill x
+		pack $dpf.si $dpf.ver $dpf.uni $dpf.ts $dpf.store $dpf.compact $dpf.ceil $dpf.watch $dpf.bakpath -side top -anchor w -pady 3 -padx 10 -fill x
 
 		ttk::label $dpf.note -justify center -anchor w -wraplen 300 \
 			-text [mc "Note: these defaults will be applied to new databases. To change a setting for an existing database, go to \"Customize\" in the \"Security\" menu."]
@@ -6147,6 +8387,9 @@ proc gorilla::PreferencesDialog {} {
 		set ::gorilla::preference($pref) $::gorilla::prefTemp($pref)
 	}
 
+	ApplyCompactRecords
+	ArrangeWatchFile
+
 }
 
 proc gorilla::Preferences {} {
@@ -6640,6 +8883,10 @@ proc gorilla::CopyToClipboard { what {mult 1} } {
 	# Consolidates all of the copy to clipboard management code into a
 	# single proc.
 
+	if { [ StillLoading ] } {
+		return
+	}
+
 	switch -exact -- $what {
 		Username { set ::gorilla::activeSelection 1 }
 		Password { set ::gorilla::activeSelection 2 }
@@ -6842,6 +9089,8 @@ proc gorilla::About {} {
 
 		set I [ expr { [ info exists ::sha2::accel(critcl) ] && $::sha2::accel(critcl) ? "C" : "Tcl" } ]
 		ttk::label $w.exten -text [ mc "Using %s sha256 extension." $I ] {*}$stdopts
+		ttk::label $w.twofish -text [ mc "Using %s Twofish implementation." \
+			[ TwofishBackendName [ itwofish::itwofish::kernel ] ] ] {*}$stdopts
 		
 		ttk::frame $w.buttons
 		ttk::button $w.buttons.license -text [mc License] -command gorilla::License
@@ -6855,6 +9104,7 @@ proc gorilla::About {} {
 		pack $w.url -side top -pady 5 
 		pack {*}$ctr -side top -pady 0 -fill x
 		pack $w.exten -side top -pady {2m 0} -fill x
+		pack $w.twofish -side top -fill x
 		pack $w.buttons -side bottom -pady 10
 		pack $w
 		
@@ -6878,6 +9128,15 @@ proc gorilla::About {} {
 proc gorilla::Help {} {
 	ArrangeIdleTimeout
 
+	# the help viewer is not needed before this, so it is only now
+	# loaded
+	if { [ namespace which ::Help::Help ] eq "" } {
+		if { [ catch { uplevel #0 [ list source [ file join $::gorilla::Dir viewhelp.tcl ] ] } oops ] } {
+			ErrorPopup [ mc "Error" ] [ mc "The help viewer could not be loaded: %s" $oops ]
+			return
+		}
+	}
+
 	# ReadHelpFiles is looking in the given directory 
 	# for a file named help.txt
 	::Help::ReadHelpFiles $::gorilla::Dir $::gorilla::preference(lang)
@@ -6889,6 +9148,487 @@ proc gorilla::License {} {
 	ShowTextFile .license [mc "Password Gorilla License"] "LICENSE.txt"
 }
 
+# ----------------------------------------------------------------------
+# Report windows: Timings and Memory Report
+# ----------------------------------------------------------------------
+#
+
+proc gorilla::ShowReport {top title command} {
+
+	# Shows the text returned by command in a window with a Refresh and a
+	# Close button.  Refresh calls command again.
+
+	ArrangeIdleTimeout
+
+	if {![info exists ::gorilla::toplevel($top)]} {
+		toplevel $top -class "Gorilla"
+		wm title $top $title
+
+		set text [text $top.text -relief sunken -width 70 -height 30 \
+			-yscrollcommand "$top.vsb set"]
+		ttk::scrollbar $top.vsb -orient vertical -command "$top.text yview"
+
+		lower [ttk::frame $top.dummy]
+		pack $top.dummy -fill both -expand 1
+		grid $top.text $top.vsb -sticky nsew -in $top.dummy
+		grid columnconfigure $top.dummy 0 -weight 1
+		grid rowconfigure $top.dummy 0 -weight 1
+
+		set botframe [ttk::frame $top.botframe]
+		ttk::button $botframe.refresh -width 10 -text [mc "Refresh"]
+		ttk::button $botframe.but -width 10 -text [mc "Close"] \
+			-command "gorilla::DestroyTextFileDialog $top"
+		pack $botframe.refresh $botframe.but -side left -padx 5
+		pack $botframe -side top -pady 10
+
+		bind $top <Return> "gorilla::DestroyTextFileDialog $top"
+
+		set ::gorilla::toplevel($top) $top
+		wm protocol $top WM_DELETE_WINDOW "gorilla::DestroyTextFileDialog $top"
+	}
+
+	$top.botframe.refresh configure \
+		-command [list gorilla::ShowReportRefresh $top $command]
+	ShowReportRefresh $top $command
+
+	update idletasks
+	wm deiconify $top
+	raise $top
+	focus $top.botframe.but
+}
+
+proc gorilla::ShowReportRefresh {top command} {
+	$top.text configure -state normal
+	$top.text delete 1.0 end
+	$top.text insert end [uplevel #0 $command]
+	$top.text configure -state disabled
+}
+
+proc gorilla::Timings {} {
+
+	# Shows the phase timings and counters of the last opens and saves,
+	# see pwsafe::timing
+
+	ShowReport .timings [mc "Timings"] gorilla::TimingsText
+}
+
+proc gorilla::TimingsText {} {
+	set reports [pwsafe::timing::reports]
+	if {[llength $reports] == 0} {
+		return [mc "No database has been opened or saved yet."]
+	}
+	set text ""
+	# latest first
+	foreach report [lreverse $reports] {
+		append text [pwsafe::timing::table $report] \n
+	}
+	if {$pwsafe::timing::logFile ne ""} {
+		append text [mc "Logged to %s" $pwsafe::timing::logFile]
+	}
+	return $text
+}
+
+proc gorilla::MemoryReport {} {
+
+	# Shows how much memory the open database and its tree take, see
+	# gorilla::MemoryReportText
+
+	ShowReport .memoryReport [mc "Memory Report"] gorilla::MemoryReportText
+}
+
+proc gorilla::MemoryReportText {} {
+
+	# Returns the memory report as text: the record storage of the
+	# database by field type (see pwsafe::db memoryReport), the tree
+	# items, the group node and find state, and the resident memory of
+	# the process if the system tells it.  Sizes other than the record
+	# storage are estimates.
+
+	if {![info exists ::gorilla::db]} {
+		return [mc "No database is open."]
+	}
+
+	set report [$::gorilla::db memoryReport]
+	dict with report {}
+
+	set names {1 UUID 2 Group 3 Title 4 Username 5 Notes 6 Password
+		7 "Creation Time" 8 "Password Modified" 9 "Last Access"
+		10 "Password Lifetime" 11 "Password Policy" 12 "Last Modified"
+		13 URL 14 Autotype}
+
+	set text [mc "Record layout: %s" $layout]\n\n
+	append text [format "  %-24s %10s %12s\n" [mc "Structure"] [mc "Count"] [mc "Bytes"]]
+	append text [format "  %-24s %10d %12d\n" [mc "Record storage"] $fields $storage]
+	append text [format "  %-24s %10d %12d\n" [mc "Field index"] $records $index]
+	append text [format "  %-24s %10s %12d\n" [mc "Array overhead"] "" $overhead]
+
+	set dbBytes [expr {$storage + $index + $overhead}]
+	if {$records > 0} {
+		append text [format "  %-24s %10s %12d\n" [mc "Per record"] "" [expr {$dbBytes / $records}]]
+	}
+
+	# tree items: each node of the treeview holds its text, its values
+	# and an image reference
+
+	set tree $::gorilla::widgets(tree)
+	set items 0
+	set itemBytes 0
+	set nodes [$tree children {}]
+	while {[llength $nodes]} {
+		set nodes [lassign $nodes node]
+		incr items
+		incr itemBytes [expr {[string length [$tree item $node -text]] \
+			+ [string length [$tree item $node -values]] + 100}]
+		lappend nodes {*}[$tree children $node]
+	}
+	append text [format "  %-24s %10d %12d\n" [mc "Tree items"] $items $itemBytes]
+
+	set groupBytes 0
+	foreach {group node} [array get ::gorilla::groupNodes] {
+		incr groupBytes [expr {[string length $group] + [string length $node] + 100}]
+	}
+	append text [format "  %-24s %10d %12d\n" [mc "Group nodes"] \
+		[array size ::gorilla::groupNodes] $groupBytes]
+
+	# find state: the node the last search stopped at, and the search
+	# text and options, which live in the preferences
+
+	set findVars [list ::gorilla::findCurrentNode]
+	foreach name [array names ::gorilla::preference -regexp {^(find|caseSensitiveFind)}] {
+		lappend findVars ::gorilla::preference($name)
+	}
+	set findCount 0
+	set findBytes 0
+	foreach var $findVars {
+		if {[info exists $var]} {
+			incr findCount
+			incr findBytes [expr {[string length $var] + [string length [set $var]] + 100}]
+		}
+	}
+	append text [format "  %-24s %10d %12d\n" [mc "Find state"] $findCount $findBytes]
+
+	append text \n[format "  %-24s %10s %12s\n" [mc "Field type"] [mc "Count"] [mc "Bytes"]]
+	dict for {type entry} $types {
+		lassign $entry count bytes
+		set name [expr {[dict exists $names $type] ? [dict get $names $type] : $type}]
+		append text [format "  %-24s %10d %12d\n" $name $count $bytes]
+	}
+
+	if {![catch {
+		set fd [open /proc/self/status]
+		set status [read $fd]
+		close $fd
+	}] && [regexp {VmRSS:\s+(\d+)\s+kB} $status -> rss]} {
+		append text \n[mc "Resident memory of Password Gorilla: %d kB" $rss]\n
+	}
+
+	return $text
+}
+
+proc gorilla::PasswordEntropy {password} {
+
+	# Returns an estimate of the entropy of password in bits: its
+	# length times the bits of a character drawn from the character
+	# classes it uses.  A character that repeats the one before it, or
+	# continues a run like "abc" or "321", only counts half.
+
+	set pool 0
+	foreach {class size} {
+		{[a-z]} 26  {[A-Z]} 26  {[0-9]} 10
+		{[ -/:-@\[-`\{-~]} 33  {[\x00-\x1f]} 32  {[^\x00-\x7f]} 100
+	} {
+		if {[regexp $class $password]} {
+			incr pool $size
+		}
+	}
+	if {$pool == 0} {
+		return 0.0
+	}
+
+	set length 0.0
+	set previous -2
+	foreach code [scan $password [string repeat %c [string length $password]]] {
+		if {abs($code - $previous) <= 1} {
+			set length [expr {$length + 0.5}]
+		} else {
+			set length [expr {$length + 1}]
+		}
+		set previous $code
+	}
+
+	return [expr {$length * log($pool) / log(2)}]
+}
+
+proc gorilla::PasswordStrength {bits} {
+
+	# Returns the name of the strength class of a password of this many
+	# bits of entropy
+
+	if {$bits < 28} {
+		return [mc "very weak"]
+	} elseif {$bits < 36} {
+		return [mc "weak"]
+	} elseif {$bits < 60} {
+		return [mc "fair"]
+	} elseif {$bits < 128} {
+		return [mc "strong"]
+	}
+	return [mc "very strong"]
+}
+
+proc gorilla::AuditPasswords {db {weakBits 60}} {
+
+	# Checks the passwords of all records of db in one pass, decrypting
+	# each password once.  Reuse is found by putting the records into
+	# buckets by a digest of the password, keyed with random bytes that
+	# are thrown away afterwards, so that no plain text password needs to
+	# be kept for the comparison.  Returns a dict with the keys
+	#
+	#   records  number of records
+	#   empty    records without a password
+	#   reused   lists of the records sharing a password, largest first
+	#   entropy  dict of record number to bits, see PasswordEntropy
+	#   weak     records below weakBits, weakest first
+	#   average  average entropy in bits
+	#   time     microseconds taken
+
+	set start [clock microseconds]
+	set key [::isaac::bytes 32]
+
+	set rns [$db getAllRecordNumbers]
+	set empty [list]
+	set buckets [dict create]
+	set entropy [dict create]
+	set sum 0.0
+
+	foreach rn $rns {
+		# a record without a password field makes getFieldValue fail
+
+		if {[catch {$db getFieldValue $rn 6} password] || $password eq ""} {
+			lappend empty $rn
+			continue
+		}
+
+		set bits [PasswordEntropy $password]
+		dict set entropy $rn $bits
+		set sum [expr {$sum + $bits}]
+
+		dict lappend buckets \
+			[::sha2::sha256 -bin $key[encoding convertto utf-8 $password]] $rn
+		pwsafe::int::randomizeVar password
+	}
+	pwsafe::int::randomizeVar key
+
+	set reused [list]
+	foreach shared [dict values $buckets] {
+		if {[llength $shared] > 1} {
+			lappend reused $shared
+		}
+	}
+	unset buckets
+	set reused [lsort -command {apply {{a b} {
+		expr {[llength $b] - [llength $a]}
+	}}} $reused]
+
+	set weak [list]
+	dict for {rn bits} $entropy {
+		if {$bits < $weakBits} {
+			lappend weak [list $rn $bits]
+		}
+	}
+	set weak [lmap entry [lsort -real -index 1 $weak] {lindex $entry 0}]
+
+	set checked [dict size $entropy]
+	return [dict create records [llength $rns] empty $empty reused $reused \
+		entropy $entropy weak $weak \
+		average [expr {$checked ? $sum / $checked : 0.0}] \
+		time [expr {[clock microseconds] - $start}]]
+}
+
+proc gorilla::PasswordAudit {} {
+
+	# Audits the passwords of the open database and shows the reused and
+	# weak ones in a report window.  Clicking a login in the report
+	# selects it in the tree.
+
+	ArrangeIdleTimeout
+
+	if {![info exists ::gorilla::db]} {
+		tk_messageBox -parent . \
+			-type ok -icon error -default ok \
+			-title [mc "No Database"] \
+			-message [mc "Please create a new database, or open an existing\
+			database first."]
+		return
+	}
+
+	set ::gorilla::status [mc "Checking passwords ..."]
+	. configure -cursor watch
+	update idletasks
+
+	set audit [AuditPasswords $::gorilla::db]
+
+	. configure -cursor ""
+	set ::gorilla::status [mc "Checked %d passwords in %.1f sec(s)." \
+		[dict size [dict get $audit entropy]] \
+		[expr {[dict get $audit time] / 1000000.0}]]
+
+	set top .passwordAudit
+
+	if {![info exists ::gorilla::toplevel($top)]} {
+		toplevel $top -class "Gorilla"
+		wm title $top [mc "Password Audit"]
+
+		set text [text $top.text -relief sunken -width 70 -height 30 \
+			-wrap none -yscrollcommand "$top.vsb set"]
+		ttk::scrollbar $top.vsb -orient vertical -command "$top.text yview"
+
+		lower [ttk::frame $top.dummy]
+		pack $top.dummy -fill both -expand 1
+		grid $top.text $top.vsb -sticky nsew -in $top.dummy
+		grid columnconfigure $top.dummy 0 -weight 1
+		grid rowconfigure $top.dummy 0 -weight 1
+
+		set default_cursor [lindex [$text configure -cursor] 3]
+		$text tag configure link -foreground blue -underline true
+		$text tag bind link <Enter> [list $text configure -cursor hand2]
+		$text tag bind link <Leave> [list $text configure -cursor $default_cursor]
+		$text tag bind link <Button-1> [list gorilla::PasswordAuditClick $text %x %y]
+
+		set botframe [ttk::frame $top.botframe]
+		ttk::button $botframe.refresh -width 10 -text [mc "Refresh"] \
+			-command gorilla::PasswordAudit
+		ttk::button $botframe.but -width 10 -text [mc "Close"] \
+			-command "gorilla::DestroyTextFileDialog $top"
+		pack $botframe.refresh $botframe.but -side left -padx 5
+		pack $botframe -side top -pady 10
+
+		bind $top <Return> "gorilla::DestroyTextFileDialog $top"
+
+		set ::gorilla::toplevel($top) $top
+		wm protocol $top WM_DELETE_WINDOW "gorilla::DestroyTextFileDialog $top"
+	}
+
+	# the tree nodes of the logins, to link the report lines to
+
+	array unset ::gorilla::auditLinks
+	set nodes [dict create]
+	set pending [$::gorilla::widgets(tree) children {}]
+	while {[llength $pending]} {
+		set pending [lassign $pending node]
+		set data [$::gorilla::widgets(tree) item $node -values]
+		if {[lindex $data 0] == "Login"} {
+			dict set nodes [lindex $data 1] $node
+		} else {
+			lappend pending {*}[$::gorilla::widgets(tree) children $node]
+		}
+	}
+
+	set text $top.text
+	$text configure -state normal
+	$text delete 1.0 end
+
+	$text insert end [mc "Logins: %d, without password: %d" \
+		[dict get $audit records] [llength [dict get $audit empty]]]\n
+	$text insert end [mc "Average strength: %.0f bits" [dict get $audit average]]\n\n
+
+	$text insert end [string repeat "-" 70]\n
+	$text insert end [mc "Reused Passwords"]\n
+	$text insert end [string repeat "-" 70]\n\n
+
+	if {[llength [dict get $audit reused]] == 0} {
+		$text insert end [mc "None."]\n
+	}
+	foreach shared [dict get $audit reused] {
+		$text insert end [mc "Used by %d logins:" [llength $shared]]\n
+		foreach rn $shared {
+			PasswordAuditLine $text $nodes $rn "  "
+		}
+		$text insert end \n
+	}
+
+	$text insert end \n[string repeat "-" 70]\n
+	$text insert end [mc "Weak Passwords"]\n
+	$text insert end [string repeat "-" 70]\n\n
+
+	if {[llength [dict get $audit weak]] == 0} {
+		$text insert end [mc "None."]\n
+	}
+	foreach rn [dict get $audit weak] {
+		set bits [dict get $audit entropy $rn]
+		PasswordAuditLine $text $nodes $rn \
+			[format "%4.0f %-12s " $bits [PasswordStrength $bits]]
+	}
+
+	$text configure -state disabled
+
+	update idletasks
+	wm deiconify $top
+	raise $top
+	focus $top.botframe.but
+}
+
+proc gorilla::PasswordAuditLine {text nodes rn prefix} {
+
+	# Appends the group, title and user name of record rn to the audit
+	# report as a link to its tree node
+
+	set label [::gorilla::dbget title $rn]
+	if {[::gorilla::dbget group $rn] ne ""} {
+		set label "[::gorilla::dbget group $rn] / $label"
+	}
+	if {[::gorilla::dbget user $rn] ne ""} {
+		append label " \[" [::gorilla::dbget user $rn] "\]"
+	}
+
+	$text insert end $prefix
+	if {[dict exists $nodes $rn]} {
+		set line [lindex [split [$text index end-1c] .] 0]
+		set ::gorilla::auditLinks($line) [dict get $nodes $rn]
+		$text insert end $label link
+	} else {
+		$text insert end $label
+	}
+	$text insert end \n
+}
+
+proc gorilla::PasswordAuditClick {text x y} {
+
+	# Selects the tree node of the login under the mouse in the audit
+	# report
+
+	set line [lindex [split [$text index @$x,$y] .] 0]
+	if {![info exists ::gorilla::auditLinks($line)]} {
+		return
+	}
+	set node $::gorilla::auditLinks($line)
+	set tree $::gorilla::widgets(tree)
+	if {![$tree exists $node]} {
+		set ::gorilla::status [mc "The login is no longer in the tree."]
+		return
+	}
+
+	set parent [$tree parent $node]
+	while {$parent != "RootNode" && $parent != ""} {
+		$tree item $parent -open 1
+		set parent [$tree parent $parent]
+	}
+	$tree see $node
+	$tree selection set $node
+	focus $tree
+}
+
+proc gorilla::ApplyCompactRecords {} {
+
+	# Makes the record layout of new databases, and of the open one,
+	# follow the compactRecords preference
+
+	set ::pwsafe::compactRecords $::gorilla::preference(compactRecords)
+	if {[info exists ::gorilla::db]} {
+		$::gorilla::db setCompact $::gorilla::preference(compactRecords)
+	}
+}
+
 proc gorilla::DestroyTextFileDialog {top} {
 	ArrangeIdleTimeout
 	catch {destroy $top}
@@ -7313,6 +10053,8 @@ set ::gorilla::images(login) [image create photo -file [file join $::gorilla::Pi
 
 set ::gorilla::images(splash) [image create photo -file [file join $::gorilla::PicsDir splash.gif]]
 
+::gorilla::startup::mark "images and procs"
+
 proc gorilla::CheckDefaultExtension {name extension} {
 	set res [split $name .]
 	if {[llength $res ] == 1} {
@@ -7673,8 +10415,26 @@ namespace eval ::gorilla::dbset {
 
 		} ]
 
+		variable fieldnums
+		dict set fieldnums $procname $fieldnum
+
 	} ; # end foreach procname,fieldnum
 
+	# fields -> sets several fields of a record at once, given as a list
+	# of names and values, e.g. "dbset fields $rn {title x user y}".  In
+	# the compact record layout the record is encrypted only once for all
+	# of them instead of once per field.
+
+	proc fields { rn nameValues } {
+		variable fieldnums
+		set fieldValues [ list ]
+		foreach { name value } $nameValues {
+			lappend fieldValues [ dict get $fieldnums $name ] $value
+		}
+		$::gorilla::db setFieldValues $rn $fieldValues
+		::pwsafe::int::randomizeVar fieldValues
+	} ; # end proc fields
+
         foreach {procname fieldnum} [ list  create-time-string 7  last-pass-change-string 8  last-access-string 9 \
         				 lifetime-string 10 last-modified-string 12 ] {
 
@@ -7684,7 +10444,7 @@ namespace eval ::gorilla::dbset {
 
 	} ; # end foreach procname,fieldnum
 
-	namespace export uuid group title user username notes password url create-time last-pass-change last-access lifetime last-modified
+	namespace export uuid group title user username notes password url create-time last-pass-change last-access lifetime last-modified fields
 
   	namespace ensemble create
 
@@ -7866,7 +10626,8 @@ namespace eval ::gorilla::dnd {
 		# can not drag empty area of tree, nor root node of tree - leave set to
 		# -Inf in those cases
 		
-		if { ( [ $tree identify row $x $y ] ni {"" RootNode} ) } {
+		if { ( [ $tree identify row $x $y ] ni {"" RootNode} ) &&
+		     ( ! [ info exists ::gorilla::loading ] ) } {
 			set clickPx $x
 			set clickPy $y
 		} ; # end if selrow ni ""/RootNode
@@ -8669,7 +11430,12 @@ proc usage {} {
 	puts stdout " Options:"
 	puts stdout "   --rc <name>  Use <name> as configuration file (not the Registry)."
 	puts stdout "   --norc       Do not use a configuration file (or the Registry)."
+	puts stdout "   --startup-timeline  Print the startup timeline when the password is asked."
+	puts stdout "   --timing-log <file> Append the phase timings of every open and save to <file>."
+	puts stdout "   --profile <file>    Write the calls and times of every procedure to <file> on exit."
 	puts stdout "   <database>   Open <database> on startup."
+	puts stdout " Without a window: --list, --get, --export-csv, --verify or --verify-all,"
+	puts stdout " see \"$::argv0 --list\" for the details."
 }
 
 if {$::gorilla::init == 0} {
@@ -8760,6 +11526,26 @@ if {$::gorilla::init == 0} {
 			--test {
 				array set ::gorilla::DEBUG { TEST 1 }
 			}
+			--startup-timeline {
+				# evaluated in gorilla::startup already, accepted here
+			}
+			--timing-log {
+				if {$i+1 >= $argc} {
+					puts stderr "Error: [lindex $argv $i] needs a parameter."
+					exit 1
+				}
+				incr i
+				set pwsafe::timing::logFile [file normalize [lindex $argv $i]]
+			}
+			--profile {
+				if {$i+1 >= $argc} {
+					puts stderr "Error: [lindex $argv $i] needs a parameter."
+					exit 1
+				}
+				incr i
+				source [file join $::gorilla::Dir profile.tcl]
+				set ::gorilla::profile::file [lindex $argv $i]
+			}
 			default {
 				if {$haveDatabaseToLoad} {
 					usage
@@ -8772,9 +11558,19 @@ if {$::gorilla::init == 0} {
 	} ; unset i
 }
 
+# wrap the procedures only now that all of them are defined
+if {[namespace exists ::gorilla::profile] && $::gorilla::profile::file ne ""} {
+	::gorilla::profile::start $::gorilla::profile::file
+}
+
 gorilla::Init
+::gorilla::startup::mark gorilla::Init
 gorilla::LoadPreferences
+gorilla::ApplyCompactRecords
+gorilla::ArrangeWatchFile
+::gorilla::startup::mark gorilla::LoadPreferences
 gorilla::InitGui
+::gorilla::startup::mark gorilla::InitGui
 set ::gorilla::init 1
 
 if {$haveDatabaseToLoad} {
@@ -241,6 +241,35 @@ proc isaac::int32 {} {
     return $res
 }
 
+#
+# Generates a binary string of count random bytes, taking whole words
+# from the current result block instead of one int32 call per word
+#
+
+proc isaac::bytes {count} {
+    variable randcnt
+    variable randrsl
+
+    set result ""
+    set words [expr {($count + 3) / 4}]
+
+    while {$words > 0} {
+	if {$randcnt >= 256} {
+	    isaac
+	}
+	set n [expr {256 - $randcnt}]
+	if {$n > $words} {
+	    set n $words
+	}
+	append result [binary format I* \
+		[lrange $randrsl $randcnt [expr {$randcnt + $n - 1}]]]
+	incr randcnt $n
+	incr words -$n
+    }
+
+    return [string range $result 0 [expr {$count - 1}]]
+}
+
 #
 # Generates a floating-point random number in the [0,1) interval
 #
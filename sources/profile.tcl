@@ -0,0 +1,339 @@
+#
+# ----------------------------------------------------------------------
+# profile.tcl: per-procedure profiler of the Password Gorilla
+# ----------------------------------------------------------------------
+#
+# gorilla.tcl sources this file for the --profile option.  Before the
+# application starts, every proc of the namespaces in "namespaces", and
+# every method and proc of the Itcl classes in them, is wrapped so that
+# entering and leaving it is recorded.  For every procedure the number
+# of calls, the inclusive and exclusive time and the Tcl commands it
+# executed are counted.  Tcl has no allocation counters outside of a
+# memory debugging build, so the executed commands, from info cmdcount,
+# stand in for the work done besides the time.
+#
+# On exit, the report sorted by exclusive time is written to the file
+# given with --profile, and the exclusive time per call stack in the
+# collapsed format of flamegraph.pl to the same name with ".folded"
+# appended.
+#
+# The wrapper is a try ... finally around the original body, in the
+# same stack frame, so that upvar, uplevel and return work as before.
+# The time and commands of the profiler itself are measured once at the
+# start and taken off the callers.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+
+namespace eval ::gorilla::profile {
+
+	# the namespaces whose procs and classes are profiled
+	variable namespaces { ::gorilla ::pwsafe ::itwofish ::sha2 ::isaac }
+
+	# procs left as they are: their body is sent to worker threads that
+	# do not have the profiler
+	variable unwrapped { ::pwsafe::int::computeStretchedKey }
+
+	# the report file, set by --profile
+	variable file ""
+
+	# the frames of the running calls, each a list of the name, the call
+	# stack, the start time and command count, and the time and commands
+	# of the calls made from it
+	variable stack [ list ]
+
+	# per procedure: calls, inclusive and exclusive microseconds,
+	# inclusive and exclusive commands, and the number of running calls
+	variable calls
+	variable inclusive
+	variable exclusive
+	variable inclusiveCmds
+	variable exclusiveCmds
+	variable running
+	array set calls {}
+	array set inclusive {}
+	array set exclusive {}
+	array set inclusiveCmds {}
+	array set exclusiveCmds {}
+	array set running {}
+
+	# exclusive microseconds per call stack, for the collapsed file
+	variable stacks
+	array set stacks {}
+
+	# what one enter and leave cost: the part measured as the time of
+	# the call itself, and all of it as seen by the caller; see calibrate
+	variable baseTime 0
+	variable baseCmds 0
+	variable overheadTime 0
+	variable overheadCmds 0
+
+}
+
+proc ::gorilla::profile::enter { name } {
+
+	variable stack
+	variable running
+
+	incr running($name)
+	if { [ llength $stack ] } {
+		set path "[ lindex $stack end 1 ];$name"
+	} else {
+		set path $name
+	}
+	lappend stack [ list $name $path [ clock microseconds ] [ info cmdcount ] 0 0 ]
+
+} ; # end proc ::gorilla::profile::enter
+
+proc ::gorilla::profile::leave {} {
+
+	variable stack
+	variable calls
+	variable inclusive
+	variable exclusive
+	variable inclusiveCmds
+	variable exclusiveCmds
+	variable running
+	variable stacks
+	variable baseTime
+	variable baseCmds
+	variable overheadTime
+	variable overheadCmds
+
+	set cmds [ info cmdcount ]
+	set now [ clock microseconds ]
+
+	lassign [ lindex $stack end ] name path start startCmds childTime childCmds
+	set stack [ lrange $stack 0 end-1 ]
+
+	set time [ expr { max( 0, $now - $start - $baseTime ) } ]
+	set cmds [ expr { max( 0, $cmds - $startCmds - $baseCmds ) } ]
+
+	incr calls($name)
+	incr exclusive($name) [ expr { $time - $childTime } ]
+	incr exclusiveCmds($name) [ expr { $cmds - $childCmds } ]
+	incr stacks($path) [ expr { $time - $childTime } ]
+
+	# a recursive call is already in the inclusive numbers of the
+	# outermost one
+
+	if { [ incr running($name) -1 ] == 0 } {
+		incr inclusive($name) $time
+		incr inclusiveCmds($name) $cmds
+	}
+
+	if { [ llength $stack ] } {
+		set frame [ lindex $stack end ]
+		lset frame 4 [ expr { [ lindex $frame 4 ] + $time + $overheadTime } ]
+		lset frame 5 [ expr { [ lindex $frame 5 ] + $cmds + $overheadCmds } ]
+		lset stack end $frame
+	}
+
+} ; # end proc ::gorilla::profile::leave
+
+proc ::gorilla::profile::wrap { name body } {
+
+	# Returns body enclosed in the calls of enter and leave for the
+	# procedure name
+
+	set name [ string trimleft $name : ]
+	return "[ list ::gorilla::profile::enter $name ]\ntry \{$body\n\} finally \{\n::gorilla::profile::leave\n\}"
+
+} ; # end proc ::gorilla::profile::wrap
+
+proc ::gorilla::profile::procArgs { name } {
+
+	# Returns the argument list of proc name, with its default values
+
+	set result [ list ]
+	foreach arg [ info args $name ] {
+		if { [ info default $name $arg value ] } {
+			lappend result [ list $arg $value ]
+		} else {
+			lappend result $arg
+		}
+	}
+	return $result
+
+} ; # end proc ::gorilla::profile::procArgs
+
+proc ::gorilla::profile::instrument {} {
+
+	# Wraps the procs and the Itcl methods and procs of the profiled
+	# namespaces.  Returns the number of procedures wrapped.
+
+	variable namespaces
+	variable unwrapped
+
+	set count 0
+	set pending $namespaces
+	while { [ llength $pending ] } {
+		set pending [ lassign $pending ns ]
+		if { ! [ namespace exists $ns ] || $ns eq [ namespace current ] } {
+			continue
+		}
+		lappend pending {*}[ namespace children $ns ]
+
+		foreach name [ info procs ${ns}::* ] {
+			if { $name in $unwrapped } {
+				continue
+			}
+			proc $name [ procArgs $name ] [ wrap $name [ info body $name ] ]
+			incr count
+		}
+	}
+
+	foreach class [ itcl::find classes ] {
+		set class ::[ string trimleft $class : ]
+		set profiled 0
+		foreach ns $namespaces {
+			if { [ string match ${ns}::* $class ] } {
+				set profiled 1
+			}
+		}
+		if { ! $profiled } {
+			continue
+		}
+		foreach function [ namespace eval $class { info function } ] {
+			if { [ namespace qualifiers $function ] ne $class || \
+				[ namespace tail $function ] in { constructor destructor } } {
+				continue
+			}
+			lassign [ namespace eval $class [ list info function $function ] ] \
+				protection type name usage body
+			if { $body eq "" || [ string index $body 0 ] eq "@" } {
+				# not defined yet, or implemented in C
+				continue
+			}
+			# Itcl shows the arguments as usage; the underlying TclOO
+			# definition has them with their default values
+			set arglist [ lindex [ info class definition $class \
+				[ namespace tail $function ] ] 0 ]
+			itcl::body $function $arglist [ wrap $function $body ]
+			incr count
+		}
+	}
+	return $count
+
+} ; # end proc ::gorilla::profile::instrument
+
+proc ::gorilla::profile::calibrate {} {
+
+	# Measures what a call of enter and leave costs.  It is taken off
+	# the time of the call, and added to the calls made from the caller,
+	# so that it is counted for neither.
+
+	variable baseTime
+	variable baseCmds
+	variable overheadTime
+	variable overheadCmds
+	variable calls
+	variable inclusive
+	variable exclusive
+	variable inclusiveCmds
+	variable exclusiveCmds
+	variable running
+	variable stacks
+
+	set n 1000
+	enter calibrate
+	set start [ clock microseconds ]
+	set startCmds [ info cmdcount ]
+	for { set i 0 } { $i < $n } { incr i } {
+		enter calibrate-child
+		leave
+	}
+	set loopCmds [ expr { [ info cmdcount ] - $startCmds } ]
+	set loopTime [ expr { [ clock microseconds ] - $start } ]
+	leave
+
+	# an empty call; the loop itself runs incr on every round
+	set baseCmds [ expr { $inclusiveCmds(calibrate-child) / $n } ]
+	set baseTime [ expr { $inclusive(calibrate-child) / $n } ]
+	set overheadCmds [ expr { $loopCmds / $n - 1 } ]
+	set overheadTime [ expr { $loopTime / $n } ]
+
+	foreach var { calls inclusive exclusive inclusiveCmds exclusiveCmds running stacks } {
+		array unset $var
+	}
+
+} ; # end proc ::gorilla::profile::calibrate
+
+proc ::gorilla::profile::start { fileName } {
+
+	# Instruments the profiled namespaces and arranges that the report
+	# is written to fileName on exit
+
+	variable file [ file normalize $fileName ]
+
+	calibrate
+	set count [ instrument ]
+	trace add execution exit enter ::gorilla::profile::atExit
+	puts stderr "Password Gorilla: profiling $count procedures into $file"
+
+} ; # end proc ::gorilla::profile::start
+
+proc ::gorilla::profile::atExit { args } {
+
+	variable file
+
+	if { [ catch { write $file } oops ] } {
+		puts stderr "Password Gorilla: the profile could not be written: $oops"
+	}
+
+} ; # end proc ::gorilla::profile::atExit
+
+proc ::gorilla::profile::report {} {
+
+	# Returns the report as text: one line per procedure, sorted by
+	# exclusive time
+
+	variable calls
+	variable inclusive
+	variable exclusive
+	variable inclusiveCmds
+	variable exclusiveCmds
+
+	set rows [ list ]
+	foreach name [ array names calls ] {
+		set incl [ expr { [ info exists inclusive($name) ] ? $inclusive($name) : 0 } ]
+		set inclCmds [ expr { [ info exists inclusiveCmds($name) ] ? $inclusiveCmds($name) : 0 } ]
+		lappend rows [ list $name $calls($name) $incl $exclusive($name) \
+			$inclCmds $exclusiveCmds($name) ]
+	}
+
+	set text [ format "%10s %12s %12s %10s %12s %12s  %s\n" \
+		calls "incl ms" "excl ms" "excl us/c" "incl cmds" "excl cmds" procedure ]
+	foreach row [ lsort -integer -decreasing -index 3 $rows ] {
+		lassign $row name n incl excl inclCmds exclCmds
+		append text [ format "%10d %12.1f %12.1f %10.1f %12d %12d  %s\n" \
+			$n [ expr { $incl / 1000.0 } ] [ expr { $excl / 1000.0 } ] \
+			[ expr { double( $excl ) / $n } ] $inclCmds $exclCmds $name ]
+	}
+	return $text
+
+} ; # end proc ::gorilla::profile::report
+
+proc ::gorilla::profile::write { fileName } {
+
+	# Writes the report to fileName and the collapsed stacks to
+	# fileName.folded
+
+	variable stacks
+
+	set f [ open $fileName w ]
+	puts -nonewline $f [ report ]
+	close $f
+
+	set f [ open $fileName.folded w ]
+	foreach path [ lsort [ array names stacks ] ] {
+		if { $stacks($path) > 0 } {
+			puts $f "$path $stacks($path)"
+		}
+	}
+	close $f
+
+} ; # end proc ::gorilla::profile::write
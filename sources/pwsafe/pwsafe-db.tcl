@@ -4,7 +4,14 @@
 # ----------------------------------------------------------------------
 #
 
-namespace eval pwsafe {}
+namespace eval pwsafe {
+    #
+    # If set, new pwsafe::db objects use the compact record layout, see
+    # the Internal data comment of pwsafe::db
+    #
+
+    variable compactRecords 0
+}
 
 catch {
     itcl::delete class pwsafe::db
@@ -179,8 +186,20 @@ itcl::class pwsafe::db {
     # of the type byte, as identified in the pwsafe "documentation."
     # The value of the array element is the field value.
     #
-    # recordnumbers is a list of all record numbers that are available
-    # in the records array
+    # In the compact layout (compact is 1), the index of records is the
+    # record number alone, and the value is one encrypted buffer holding
+    # all fields of the record back to back, in order of their type.
+    # fieldindex is an array with the same index; its value is a binary
+    # string with one entry per field: the type byte, the offset of the
+    # field value within the buffer and its length, as cII. Since the
+    # buffer is encrypted block by block, a field value is read by
+    # decrypting only the blocks it covers. This needs two array
+    # elements per record instead of one per field, and pads each record
+    # instead of each field.
+    #
+    # recordnumbers is an array whose indices are all record numbers
+    # that are available in the records array, so that checking for a
+    # record does not need to scan a list
     #
 
     protected variable engine
@@ -188,6 +207,8 @@ itcl::class pwsafe::db {
     protected variable header
     protected variable preferences
     protected variable records
+    protected variable fieldindex
+    protected variable compact
     protected variable recordnumbers
     protected variable nextrecordnumber
 
@@ -210,7 +231,10 @@ itcl::class pwsafe::db {
 
     constructor {password_} {
 	set nextrecordnumber 0
-	set recordnumbers [list]
+	array set recordnumbers {}
+	array set records {}
+	array set fieldindex {}
+	set compact $::pwsafe::compactRecords
 	set engine [namespace current]::[itwofish::ecb #auto \
 		[pwsafe::int::randomString 16]]
 	set password [encryptField $password_]
@@ -220,6 +244,15 @@ itcl::class pwsafe::db {
 	set warningsDuringOpen [list]
     }
 
+    #
+    # destructor: the engine holds the key of all encrypted fields
+    #
+
+    destructor {
+	pwsafe::int::randomizeVar password
+	catch {itcl::delete object $engine}
+    }
+
     #
     # Encrypt a field, so that we don't store anything in cleartext
     #
@@ -235,24 +268,36 @@ itcl::class pwsafe::db {
 	    append msg [pwsafe::int::randomString $padLen]
 	    incr dataLen $padLen
 	}
-	set blocks [expr {$dataLen/16}]
-	set encryptedMsg ""
-	for {set i 0} {$i < $blocks} {incr i} {
-	    append encryptedMsg [$engine encryptBlock \
-		    [string range $msg [expr {16*$i}] [expr {16*$i+15}]]]
-	}
+	set encryptedMsg [$engine encryptBlocks $msg]
 	pwsafe::int::randomizeVar msg
 	return $encryptedMsg
     }
 
+    #
+    # Decrypts length bytes at offset of the plaintext of a message made
+    # by encryptField, decrypting only the blocks that cover them
+    #
+
+    private method decryptRange {encryptedMsg offset length} {
+	if {$length == 0} {
+	    return ""
+	}
+	# skip the random prefix and the length
+	incr offset 8
+	set first [expr {$offset / 16}]
+	set last [expr {($offset + $length - 1) / 16}]
+	set decryptedMsg [$engine decryptBlocks \
+		[string range $encryptedMsg [expr {16*$first}] [expr {16*$last+15}]]]
+	set start [expr {$offset - 16*$first}]
+	set res [string range $decryptedMsg $start [expr {$start + $length - 1}]]
+	pwsafe::int::randomizeVar decryptedMsg
+	return $res
+    }
+
     private method decryptField {encryptedMsg} {
 	set eml [string length $encryptedMsg]
-	set blocks [expr {$eml/16}]
-	set decryptedMsg ""
-	for {set i 0} {$i < $blocks} {incr i} {
-	    append decryptedMsg [$engine decryptBlock \
-		    [string range $encryptedMsg [expr {16*$i}] [expr {16*$i+15}]]]
-	}
+	set decryptedMsg [$engine decryptBlocks \
+		[string range $encryptedMsg 0 [expr {$eml - $eml%16 - 1}]]]
 	binary scan $decryptedMsg @4I msgLen
 	set res [string range $decryptedMsg 8 [expr {7+$msgLen}]]
 	pwsafe::int::randomizeVar decryptedMsg
@@ -584,19 +629,39 @@ itcl::class pwsafe::db {
 
     public method createRecord {} {
 	set nn [incr nextrecordnumber]
-	lappend recordnumbers $nn
+	set recordnumbers($nn) 1
 	return $nn
     }
 
+    #
+    # Reserve count recordnumbers at once, returns the list of them
+    #
+
+    public method createRecords {count} {
+	set result [list]
+	for {set i 0} {$i < $count} {incr i} {
+	    set nn [incr nextrecordnumber]
+	    set recordnumbers($nn) 1
+	    lappend result $nn
+	}
+	return $result
+    }
+
     #
     # Delete a record
     #
 
     public method deleteRecord {rn} {
-	set index [lsearch -exact -integer $recordnumbers $rn]
-	if {$index != -1} {
-	    set recordnumbers [lreplace $recordnumbers $index $index]
-	    array unset records $rn,*
+	if {[info exists recordnumbers($rn)]} {
+	    unset recordnumbers($rn)
+	    if {$compact} {
+		if {[info exists records($rn)]} {
+		    pwsafe::int::randomizeVar records($rn)
+		    unset records($rn) fieldindex($rn)
+		}
+	    } else {
+		array unset records $rn,*
+	    }
 	}
     }
 
@@ -605,10 +670,7 @@ itcl::class pwsafe::db {
     #
 
     public method existsRecord {rn} {
-	if {[lsearch -exact -integer $recordnumbers $rn] == -1} {
-	    return 0
-	}
-	return 1
+	return [info exists recordnumbers($rn)]
     }
 
     #
@@ -616,7 +678,84 @@ itcl::class pwsafe::db {
     #
 
     public method getAllRecordNumbers {} {
-	return [lsort -integer $recordnumbers]
+	return [lsort -integer [array names recordnumbers]]
+    }
+
+    #
+    # Compact layout helpers: the position of a field in the index of a
+    # record, the fields of a record as a type/raw value dict, and
+    # storing such a dict
+    #
+
+    private method findField {rn field} {
+	if {![info exists fieldindex($rn)]} {
+	    return -1
+	}
+	set index $fieldindex($rn)
+	for {set pos 0} {$pos < [string length $index]} {incr pos 9} {
+	    binary scan $index @${pos}cu type
+	    if {$type == $field} {
+		return $pos
+	    }
+	}
+	return -1
+    }
+
+    private method unpackRecord {rn} {
+	set result [dict create]
+	if {![info exists records($rn)]} {
+	    return $result
+	}
+	set packed [decryptField $records($rn)]
+	set index $fieldindex($rn)
+	for {set pos 0} {$pos < [string length $index]} {incr pos 9} {
+	    binary scan $index @${pos}cuII type offset length
+	    dict set result $type [string range $packed $offset \
+		    [expr {$offset + $length - 1}]]
+	}
+	pwsafe::int::randomizeVar packed
+	return $result
+    }
+
+    private method packRecord {rn fields} {
+	if {[info exists records($rn)]} {
+	    pwsafe::int::randomizeVar records($rn)
+	}
+	if {[dict size $fields] == 0} {
+	    unset -nocomplain records($rn) fieldindex($rn)
+	    return
+	}
+	set packed ""
+	set index ""
+	foreach type [lsort -integer [dict keys $fields]] {
+	    set value [dict get $fields $type]
+	    append index [binary format cII $type [string length $packed] \
+		    [string length $value]]
+	    append packed $value
+	}
+	set records($rn) [encryptField $packed]
+	set fieldindex($rn) $index
+	pwsafe::int::randomizeVar packed value
+    }
+
+    #
+    # Field values are stored as bytes, text fields in UTF-8
+    #
+
+    private method toBytes {field value} {
+	if {$field == 2 || $field == 3 || $field == 4 || \
+		$field == 5 || $field == 6} {
+	    return [encoding convertto utf-8 $value]
+	}
+	return $value
+    }
+
+    private method fromBytes {field value} {
+	if {$field == 2 || $field == 3 || $field == 4 || \
+		$field == 5 || $field == 6} {
+	    return [encoding convertfrom utf-8 $value]
+	}
+	return $value
     }
 
     #
@@ -624,7 +763,12 @@ itcl::class pwsafe::db {
     #
 
     public method existsField {rn field} {
-	if {![info exists records($rn,$field)]} {
+	if {$compact} {
+	    set exists [expr {[findField $rn $field] >= 0}]
+	} else {
+	    set exists [info exists records($rn,$field)]
+	}
+	if {!$exists} {
 	    if {![existsRecord $rn]} {
 		error [ mc "record %d does not exist" $rn ]
 	    }
@@ -638,13 +782,22 @@ itcl::class pwsafe::db {
     #
     
     public method getFieldsForRecord {rn} {
-	set names [array names records -glob $rn,*]
-	if {[llength $names] == 0} {
-	    error [ mc "record %d does not exist" $rn ]
-	}
 	set result [list]
-	foreach name $names {
-	    lappend result [lindex [split $name ,] 1]
+	if {$compact} {
+	    if {[info exists fieldindex($rn)]} {
+		set index $fieldindex($rn)
+		for {set pos 0} {$pos < [string length $index]} {incr pos 9} {
+		    binary scan $index @${pos}cu type
+		    lappend result $type
+		}
+	    }
+	} else {
+	    foreach name [array names records -glob $rn,*] {
+		lappend result [lindex [split $name ,] 1]
+	    }
+	}
+	if {[llength $result] == 0} {
+	    error [ mc "record %d does not exist" $rn ]
 	}
 	return [lsort -integer $result]
     }
@@ -654,21 +807,27 @@ itcl::class pwsafe::db {
     #
     
     public method getFieldValue {rn field} {
-	if {![info exists records($rn,$field)]} {
+	if {$compact} {
+	    set pos [findField $rn $field]
+	    set exists [expr {$pos >= 0}]
+	} else {
+	    set exists [info exists records($rn,$field)]
+	}
+
+	if {!$exists} {
 	    if {![existsRecord $rn]} {
 		error [ mc "record %d does not exist" $rn ]
 	    }
 	    error [ mc "record %d does not have field %s" $rn $field ]
 	}
 
-	if {$field == 2 || $field == 3 || $field == 4 || \
-		$field == 5 || $field == 6} {
-	    # text fields
-	    return [encoding convertfrom utf-8 \
-			[decryptField $records($rn,$field)]]
+	if {$compact} {
+	    binary scan $fieldindex($rn) @${pos}x1II offset length
+	    return [fromBytes $field \
+			[decryptRange $records($rn) $offset $length]]
 	}
 	    
-	return [decryptField $records($rn,$field)]
+	return [fromBytes $field [decryptField $records($rn,$field)]]
     }
 
     #
@@ -676,20 +835,80 @@ itcl::class pwsafe::db {
     #
 
     public method setFieldValue {rn field value} {
+	setFieldValues $rn [list $field $value]
+    }
+
+    #
+    # Set the values of several fields of a record at once, given as a
+    # list of field type and value pairs. In the compact layout this
+    # encrypts the record only once.
+    #
+
+    public method setFieldValues {rn fieldValues} {
 	if {![existsRecord $rn]} {
 	    error [ mc "record %d does not exist" $rn ]
 	}
 
-	if {$field == 2 || $field == 3 || $field == 4 || \
-		$field == 5 || $field == 6} {
-	    # text fields
-	    set records($rn,$field) [encryptField \
-					 [encoding convertto utf-8 $value]]
-	} else {
-	    set records($rn,$field) [encryptField $value]
+	if {$compact} {
+	    set fields [unpackRecord $rn]
+	    foreach {field value} $fieldValues {
+		dict set fields $field [toBytes $field $value]
+	    }
+	    packRecord $rn $fields
+	    pwsafe::int::randomizeVar fields
+	    return
+	}
+
+	foreach {field value} $fieldValues {
+	    set records($rn,$field) [encryptField [toBytes $field $value]]
 	}
     }
 
+    #
+    # Set fields of many records as one change. updates is a dict from
+    # record number to a list of field type and value pairs, as for
+    # setFieldValues. Either all records are changed, or, if one of
+    # them fails, the records changed so far are restored and the
+    # error is raised again.
+    #
+
+    public method updateRecords {updates} {
+	foreach rn [dict keys $updates] {
+	    if {![existsRecord $rn]} {
+		error [ mc "record %d does not exist" $rn ]
+	    }
+	}
+
+	set undo [dict create]
+	try {
+	    dict for {rn fieldValues} $updates {
+		set old [list]
+		foreach {field value} $fieldValues {
+		    if {[existsField $rn $field]} {
+			lappend old $field 1 [getFieldValue $rn $field]
+		    } else {
+			lappend old $field 0 {}
+		    }
+		}
+		dict set undo $rn $old
+		setFieldValues $rn $fieldValues
+	    }
+	} on error {result options} {
+	    dict for {rn old} $undo {
+		foreach {field existed value} $old {
+		    if {$existed} {
+			setFieldValue $rn $field $value
+		    } else {
+			unsetFieldValue $rn $field
+		    }
+		}
+	    }
+	    pwsafe::int::randomizeVar undo
+	    return -options $options $result
+	}
+	pwsafe::int::randomizeVar undo
+    }
+
     #
     # Unset the value of a field. Deletes the record if this was the
     # last field.
@@ -699,15 +918,201 @@ itcl::class pwsafe::db {
 	if {![existsRecord $rn]} {
 	    return
 	}
+	if {$compact} {
+	    if {[findField $rn $field] >= 0} {
+		set fields [unpackRecord $rn]
+		dict unset fields $field
+		packRecord $rn $fields
+		if {[dict size $fields] == 0} {
+		    deleteRecord $rn
+		}
+		pwsafe::int::randomizeVar fields
+	    }
+	    return
+	}
 	if {[info exists records($rn,$field)]} {
 	    pwsafe::int::randomizeVar records($rn,$field)
 	    unset records($rn,$field)
-	    if {[llength [getFieldsForRecord $rn]] == 0} {
+	    if {[llength [array names records -glob $rn,*]] == 0} {
 		deleteRecord $rn
 	    }
 	}
     }
 
+    #
+    # Snapshot of records: returns a dict from record number to a token
+    # that holds the record as it is stored, still encrypted. Setting or
+    # unsetting a field encrypts it anew, with a fresh random prefix, so
+    # a record whose token is unchanged was not changed. snapshotFields
+    # decrypts a token back into a dict of field type and value; this
+    # works as long as the object lives, also after the record was
+    # changed or deleted. rns restricts the snapshot to these records.
+    #
+
+    public method snapshot {{rns ""}} {
+	if {$rns eq ""} {
+	    set rns [array names recordnumbers]
+	}
+	set result [dict create]
+	if {$compact} {
+	    foreach rn $rns {
+		if {[info exists records($rn)]} {
+		    dict set result $rn \
+			    [list compact $records($rn) $fieldindex($rn)]
+		} elseif {[info exists recordnumbers($rn)]} {
+		    dict set result $rn [list compact]
+		}
+	    }
+	    return $result
+	}
+	if {[llength $rns] == 1} {
+	    set names [array names records -glob [lindex $rns 0],*]
+	} else {
+	    set names [array names records]
+	}
+	foreach rn $rns {
+	    if {[info exists recordnumbers($rn)]} {
+		dict set result $rn [list field]
+	    }
+	}
+	foreach name [lsort -dictionary $names] {
+	    lassign [split $name ,] rn type
+	    if {[dict exists $result $rn]} {
+		dict lappend result $rn $type $records($name)
+	    }
+	}
+	return $result
+    }
+
+    public method snapshotFields {token} {
+	set result [dict create]
+	set token [lassign $token layout]
+	if {$layout eq "compact"} {
+	    if {[llength $token] == 0} {
+		return $result
+	    }
+	    lassign $token buffer index
+	    set packed [decryptField $buffer]
+	    for {set pos 0} {$pos < [string length $index]} {incr pos 9} {
+		binary scan $index @${pos}cuII type offset length
+		dict set result $type [fromBytes $type [string range $packed \
+			$offset [expr {$offset + $length - 1}]]]
+	    }
+	    pwsafe::int::randomizeVar packed
+	} else {
+	    foreach {type value} $token {
+		dict set result $type [fromBytes $type [decryptField $value]]
+	    }
+	}
+	return [lsort -integer -stride 2 -index 0 $result]
+    }
+
+    #
+    # Switch between the compact and the per-field record layout,
+    # converting all records
+    #
+
+    public method isCompact {} {
+	return $compact
+    }
+
+    public method setCompact {flag} {
+	set flag [expr {$flag ? 1 : 0}]
+	if {$flag == $compact} {
+	    return
+	}
+	if {$compact} {
+	    foreach rn [array names recordnumbers] {
+		set fields [unpackRecord $rn]
+		packRecord $rn {}
+		dict for {field value} $fields {
+		    set records($rn,$field) [encryptField $value]
+		}
+		pwsafe::int::randomizeVar fields
+	    }
+	} else {
+	    #
+	    # the dictionary sort groups the <rn>,<type> names by record
+	    #
+
+	    set current ""
+	    set fields [dict create]
+	    foreach name [lsort -dictionary [array names records]] {
+		lassign [split $name ,] rn field
+		if {$rn ne $current} {
+		    if {$current ne ""} {
+			packRecord $current $fields
+		    }
+		    set current $rn
+		    set fields [dict create]
+		}
+		dict set fields $field [decryptField $records($name)]
+		pwsafe::int::randomizeVar records($name)
+		unset records($name)
+	    }
+	    if {$current ne ""} {
+		packRecord $current $fields
+	    }
+	    pwsafe::int::randomizeVar fields
+	}
+	set compact $flag
+    }
+
+    #
+    # Memory report: returns a dict with the layout, the number of
+    # records and fields, the bytes held by the record storage and by
+    # the field index, an estimate of the Tcl overhead of all array
+    # elements, and a dict of field type to its number and the bytes of
+    # its values. The overhead estimate assumes about 100 bytes per array
+    # element for the hash entry, the key and the value object.
+    #
+
+    public method memoryReport {} {
+	set storage 0
+	set indexBytes 0
+	set elements 0
+	set fields 0
+	set types [dict create]
+
+	if {$compact} {
+	    foreach {rn value} [array get records] {
+		incr storage [string length $value]
+		incr elements
+	    }
+	    foreach {rn index} [array get fieldindex] {
+		incr indexBytes [string length $index]
+		incr elements
+		for {set pos 0} {$pos < [string length $index]} {incr pos 9} {
+		    binary scan $index @${pos}cux4I type length
+		    dict update types $type entry {
+			lassign [expr {[info exists entry] ? $entry : {0 0}}] n bytes
+			set entry [list [incr n] [incr bytes $length]]
+		    }
+		    incr fields
+		}
+	    }
+	} else {
+	    foreach {name value} [array get records] {
+		set length [string length $value]
+		set type [lindex [split $name ,] 1]
+		incr storage $length
+		incr elements
+		incr fields
+		dict update types $type entry {
+		    lassign [expr {[info exists entry] ? $entry : {0 0}}] n bytes
+		    set entry [list [incr n] [incr bytes $length]]
+		}
+	    }
+	}
+	incr elements [array size recordnumbers]
+
+	return [dict create layout [expr {$compact ? "compact" : "field"}] \
+		records [array size recordnumbers] fields $fields \
+		storage $storage index $indexBytes \
+		overhead [expr {100 * $elements}] \
+		types [lsort -integer -stride 2 -index 0 $types]]
+    }
+
     #
     # Get the value of a header field
     #
@@ -247,24 +247,196 @@ proc pwsafe::int::computeStretchedKey {salt password iterations pvar_in} {
 	return $Xi
 }
 
-proc pwsafe::int::calculateKeyStrechForDelay { seconds } {
+proc pwsafe::int::keyStretchBackend {} {
 
-	set iter 1024
-	set elapsed 0
+	if { [ info exists ::sha2::loaded ] && $::sha2::loaded ne "" } {
+		return $::sha2::loaded
+	}
+	return tcl
 
-	# quickly locate an iteration amount that produces some measurable
-	# time delay - as the iteration count increases by powers of 2 this
-	# should reasonably quickly locate a useful value on very fast CPU's
+	#ruff
+	#
+	# Returns the sha256 implementation that the V3 keystretch uses:
+	# "critcl" for the C extension, "tcl" for the pure Tcl fallback
+	#
 
-	while { $elapsed < 256 } {
-		set iter [ expr { $iter * 2 } ]
-		set elapsed [ pwsafe::int::keyStretchMsDelay $iter ]
+} ; # end proc pwsafe::int::keyStretchBackend
+
+proc pwsafe::int::cryptoBackends {} {
+
+	return [ dict create twofish [ itwofish::itwofish::kernel ] \
+		sha256 [ keyStretchBackend ] ]
+
+	#ruff
+	#
+	# Returns the implementations of Twofish and sha256 in use, as a
+	# dict with the keys twofish and sha256. twofish is avx2 or scalar
+	# for the multi-block C kernel, f32 for the older C extension, or
+	# tcl; sha256 is as for keyStretchBackend
+	#
+
+} ; # end proc pwsafe::int::cryptoBackends
+
+proc pwsafe::int::keptSamples { times } {
+
+	set sorted [ lsort -real $times ]
+	set median [ lindex $sorted [ expr { [ llength $sorted ] / 2 } ] ]
+	set kept [ list ]
+	foreach time $sorted {
+		if { abs( $time - $median ) <= 0.2 * $median } {
+			lappend kept $time
+		}
 	}
+	return $kept
 
-	# compute and return a final iteration amount based upon the located value
-	# above and the requested time delay factor
-  
-	return [ expr { int( ceil( $iter * ( $seconds * 1000.0 / $elapsed ) ) ) } ]
+	#ruff
+	#
+	# Filters keystretch timings.  A sample further than 20% from the
+	# median was disturbed by other work on the machine, or by a
+	# frequency change of the CPU.
+	#
+	# times - list of milliseconds per iteration
+	#
+	# returns the samples within 20% of their median, in ascending order
+	#
+
+} ; # end proc pwsafe::int::keptSamples
+
+proc pwsafe::int::measureKeyStretch { { backend "" } { samples 5 } } {
+
+	set active [ keyStretchBackend ]
+	if { $backend eq "" } {
+		set backend $active
+	}
+
+	# sha256 only registers the first implementation it finds, so the
+	# pure Tcl one has to be made known before it can be switched to
+
+	if { ! $::sha2::accel($backend) } {
+		::sha2::LoadAccelerator $backend
+	}
+	::sha2::SwitchTo $backend
+
+	try {
+
+		# one short run first, so that neither the byte code compilation
+		# nor a cold cache end up in a sample
+
+		keyStretchMsDelay 256
+
+		# locate an iteration amount that takes long enough to be timed
+		# well; the iteration count doubles, as in the original search
+
+		set iter 256
+		while { [ keyStretchMsDelay $iter ] < 64 } {
+			set iter [ expr { $iter * 2 } ]
+		}
+
+		# a single kept sample is no better than an unfiltered one, so
+		# sample again until enough of them agree, within limits
+
+		set minKept [ expr { min( 3, $samples ) } ]
+		set times [ list ]
+		while { 1 } {
+			lappend times [ expr { [ keyStretchMsDelay $iter ] / $iter } ]
+			if { [ llength $times ] < $samples } {
+				continue
+			}
+			set kept [ keptSamples $times ]
+			if { [ llength $kept ] >= $minKept || \
+				[ llength $times ] >= 4 * $samples } {
+				break
+			}
+		}
+
+	} finally {
+		::sha2::SwitchTo $active
+	}
+
+	# on a machine that is too busy to give agreeing samples, fall back
+	# to the ones closest to the median
+
+	if { [ llength $kept ] < $minKept } {
+		set sorted [ lsort -real $times ]
+		set median [ lindex $sorted [ expr { [ llength $sorted ] / 2 } ] ]
+		set distances [ list ]
+		foreach time $times {
+			lappend distances [ list [ expr { abs( $time - $median ) } ] $time ]
+		}
+		set kept [ list ]
+		foreach pair [ lrange [ lsort -real -index 0 $distances ] 0 $minKept-1 ] {
+			lappend kept [ lindex $pair 1 ]
+		}
+	}
+
+	return [ dict create backend $backend iterations $iter \
+		samples $times \
+		rejected [ expr { [ llength $times ] - [ llength $kept ] } ] \
+		msPerIteration [ expr { [ tcl::mathop::+ {*}$kept ] / [ llength $kept ] } ] ]
+
+	#ruff
+	#
+	# Measures the time of one V3 keystretch iteration.  After a warm-up
+	# run, the keystretch is timed "samples" times with an iteration
+	# count that takes at least 64 ms.  Samples further than 20% from
+	# their median are rejected, the others are averaged.  While fewer
+	# than three are kept, more samples are taken, up to four times
+	# "samples"; then the three closest to the median are used.
+	#
+	# backend - the sha256 implementation to measure, "tcl" or "critcl";
+	#           default is the one in use.  It has to be loaded.
+	# samples - the minimum number of timed runs
+	#
+	# returns a dict with the keys backend, iterations (of a sample run),
+	# samples (milliseconds per iteration of each run), rejected (the
+	# number of rejected samples) and msPerIteration
+	#
+
+} ; # end proc pwsafe::int::measureKeyStretch
+
+proc pwsafe::int::calibrateKeyStretch { seconds { samples 5 } } {
+
+	set result [ measureKeyStretch "" $samples ]
+	set iterations [ expr { int( ceil( $seconds * 1000.0 / [ dict get $result msPerIteration ] ) ) } ]
+
+	# the file format requires at least 2048 iterations
+
+	if { $iterations < 2048 } {
+		set iterations 2048
+	}
+	dict set result seconds $seconds
+	dict set result stretchIterations $iterations
+
+	if { [ dict get $result backend ] eq "tcl" } {
+		dict set result tclMsPerIteration [ dict get $result msPerIteration ]
+	} else {
+		dict set result tclMsPerIteration \
+			[ dict get [ measureKeyStretch tcl 3 ] msPerIteration ]
+	}
+
+	return $result
+
+	#ruff
+	#
+	# Computes a V3 keystretch iteration value that produces a time
+	# delay of "seconds" of wall time with the sha256 implementation in
+	# use, see measureKeyStretch.  The pure Tcl implementation is
+	# measured as well, so that the caller can tell how long the delay
+	# would be on a computer without the C extension.
+	#
+	# seconds - the number of seconds that the V3 keystrech function should execute
+	# samples - the number of timed runs
+	#
+	# returns the dict of measureKeyStretch with the additional keys
+	# seconds, stretchIterations (the computed iteration value) and
+	# tclMsPerIteration
+	#
+
+} ; # end proc pwsafe::int::calibrateKeyStretch
+
+proc pwsafe::int::calculateKeyStrechForDelay { seconds } {
+
+	return [ dict get [ calibrateKeyStretch $seconds ] stretchIterations ]
 
 	#ruff
 	#
@@ -281,10 +453,10 @@ proc pwsafe::int::calculateKeyStrechForDelay { seconds } {
 proc pwsafe::int::keyStretchMsDelay { iter } {
 
 	set salt [ pwsafe::int::randomString 32 ]
-	set start [ clock milliseconds ]
+	set start [ clock microseconds ]
 	set junk 0 ; # used as the "progress variable" for computeStretchedKey
 	pwsafe::int::computeStretchedKey $salt "The quick brown fox jumped over the lazy dog." $iter junk
-	return [ expr { [ clock milliseconds ] - $start } ]
+	return [ expr { ( [ clock microseconds ] - $start ) / 1000.0 } ]
 
 	#ruff
 	#
@@ -293,28 +465,187 @@ proc pwsafe::int::keyStretchMsDelay { iter } {
 	#
 	# iter - the number of iterations for the V3 keystretch algorithm
 	#
-	# returns a time value in milliseconds
+	# returns a time value in milliseconds, with a fraction
 
 } ; # end pwsafe::int::keyStretchMsDelay
 
+proc pwsafe::int::computeStretchedKeys { jobs } {
+
+	set values [ list ]
+	set counts [ list ]
+	foreach job $jobs {
+		lassign $job salt password iterations
+		lappend values [ sha2::sha256 -bin "$password$salt" ]
+		lappend counts $iterations
+	}
+
+	if { [ keyStretchBackend ] eq "critcl" && \
+		[ llength [ info commands ::sha2::sha256c_stretch ] ] } {
+		set keys [ ::sha2::sha256c_stretch $values $counts ]
+	} else {
+		set keys [ list ]
+		foreach Xi $values iterations $counts {
+			for { set i 0 } { $i < $iterations } { incr i } {
+				set Xi [ sha2::sha256 -bin $Xi ]
+			}
+			lappend keys $Xi
+			pwsafe::int::randomizeVar Xi
+		}
+	}
+	pwsafe::int::randomizeVar values
+	return $keys
+
+	#ruff
+	#
+	# Computes the stretched keys of several passwords at once, as
+	# computeStretchedKey does for one.  With the sha256 C extension the
+	# chains run side by side in the lanes of sha256c_stretch, four in
+	# plain C or eight with AVX2, so that a batch of up to that many keys
+	# takes about as long as one; otherwise they are computed one after
+	# the other.
+	#
+	# jobs - list of {salt password iterations}
+	#
+	# returns the list of the stretched keys, in the order of jobs
+	#
+
+} ; # end proc pwsafe::int::computeStretchedKeys
+
+#
+# Stretched keys computed ahead of opening a file, see stretchKeys. The
+# array is indexed by a digest of salt, iterations and password, so that
+# a key is only used for the file and password it was computed for.
+#
+
+namespace eval pwsafe::int {
+	variable stretchedKeys
+	array set stretchedKeys {}
+
+	# results of the workers of stretchKeys, one slot per key and call
+	variable stretchResults
+	array set stretchResults {}
+	variable stretchSeq 0
+	variable stretching 0
+}
+
+proc pwsafe::int::stretchedKeyIndex { salt iterations password } {
+
+	return [ sha2::sha256 -hex "$salt[ binary format i $iterations ][ encoding convertto utf-8 $password ]" ]
+
+	#ruff
+	#
+	# Returns the index into stretchedKeys for a V3 keystretch
+	#
+
+} ; # end proc pwsafe::int::stretchedKeyIndex
+
+proc pwsafe::int::takeStretchedKey { salt iterations password } {
+
+	variable stretchedKeys
+
+	set index [ stretchedKeyIndex $salt $iterations $password ]
+	if { ! [ info exists stretchedKeys($index) ] } {
+		return ""
+	}
+	set key $stretchedKeys($index)
+	unset stretchedKeys($index)
+	return $key
+
+	#ruff
+	#
+	# Returns the V3 keystretch of password, salt and iterations if
+	# stretchKeys computed it, and forgets it; otherwise returns an
+	# empty string
+	#
+
+} ; # end proc pwsafe::int::takeStretchedKey
+
+proc pwsafe::int::stretchKeys { jobs } {
+
+	variable stretchedKeys
+	variable stretchResults
+	variable stretchSeq
+	variable stretching
+
+	# the event loop runs while the workers compute; a call from it
+	# leaves the keys to the readers
+
+	if { $stretching || [ llength $jobs ] < 2 || \
+		[ catch { package require Thread } ] } {
+		return 0
+	}
+
+	# every worker gets its own interpreter with the sha256 package and a
+	# copy of computeStretchedKey
+
+	set setup [ list set ::auto_path $::auto_path ]
+	append setup \n [ list package require sha256 ]
+	append setup \n [ list proc computeStretchedKey \
+		[ info args computeStretchedKey ] [ info body computeStretchedKey ] ]
+
+	set stretching 1
+	set workers [ list ]
+	set slots [ list ]
+	foreach job $jobs {
+		lassign $job salt iterations password
+		set slot [ incr stretchSeq ]
+		lappend slots $slot
+		set tid [ thread::create ]
+		lappend workers $tid
+		thread::send $tid $setup
+		thread::send -async $tid \
+			[ list computeStretchedKey $salt $password $iterations progress ] \
+			[ namespace current ]::stretchResults($slot)
+	}
+
+	foreach slot $slots job $jobs {
+		while { ! [ info exists stretchResults($slot) ] } {
+			vwait [ namespace current ]::stretchResults($slot)
+		}
+		lassign $job salt iterations password
+		set stretchedKeys([ stretchedKeyIndex $salt $iterations $password ]) \
+			$stretchResults($slot)
+		randomizeVar stretchResults($slot)
+		unset stretchResults($slot)
+	}
+	set stretching 0
+	set n [ llength $slots ]
+
+	foreach tid $workers {
+		thread::release $tid
+	}
+	return $n
+
+	#ruff
+	#
+	# Computes several V3 keystretches at the same time, one per worker
+	# thread, and keeps the keys for the readers of the files, see
+	# takeStretchedKey.  Nothing is done if there is only one job, or if
+	# the Thread package is not available; the readers compute the keys
+	# themselves then.  The event loop runs while waiting for the
+	# workers; a call made from it meanwhile computes nothing either.
+	#
+	# jobs - list of salt, iteration count and password triples
+	#
+	# returns the number of keys computed
+	#
+
+} ; # end proc pwsafe::int::stretchKeys
+
 #
 # Generate a string of pseudo-random data
 #
 
 proc pwsafe::int::randomString {length} {
-    set randomOctets [list]
     #
     # Use ISAAC PRNG, if present
     #
     if {[namespace exists ::isaac]} {
-	for {set i 0} {$i < $length} {incr i} {
-	    set rand [::isaac::rand]
-	    lappend randomOctets [expr {127-int($rand*256.)}]
-	}
-    } else {
-	for {set i 0} {$i < $length} {incr i} {
-	    lappend randomOctets [expr {127-int(rand()*256.)}]
-	}
+	return [::isaac::bytes $length]
+    }
+    set randomOctets [list]
+    for {set i 0} {$i < $length} {incr i} {
+	lappend randomOctets [expr {127-int(rand()*256.)}]
     }
     return [binary format c* $randomOctets]
 }
@@ -0,0 +1,593 @@
+#
+# ----------------------------------------------------------------------
+# pwsafe::store: a content-addressed, deduplicated backup store
+# ----------------------------------------------------------------------
+#
+# A store is a directory holding snapshots of password databases. Each
+# snapshot is a small manifest that lists chunks; each chunk holds the
+# header fields or one record of the database, encrypted. Chunks are
+# named after a keyed digest of their plaintext, so a record that did
+# not change between two saves is stored only once, and adding a
+# snapshot only writes the chunks of changed records.
+#
+# Layout of a store directory:
+#
+#   key-<n>              wrapped store keys, one per database password
+#   chunks/<xx>/<name>   chunk files, <xx> being the first two
+#                        characters of <name>
+#   snapshots/<stamp>    manifests, <stamp> is %Y-%m-%d-%H-%M-%S
+#
+# A key file uses the same layout as the start of a V3 database:
+# "GST1", SALT (32 bytes), ITER (4 bytes), H(P') (32 bytes) and B1 to
+# B4 (16 bytes each). B1/B2 decrypt to the Twofish key K, B3/B4 to the
+# HMAC key L.
+#
+# The name of a chunk is the hex HMAC-SHA256 of its plaintext under L.
+# A chunk file is SHA256(body) followed by the body, which is an IV
+# and the Twofish-CBC encryption of the plaintext under K. The IV is
+# taken from the chunk name, so that the same plaintext always gives
+# the same chunk. Using the leading SHA256, the integrity of all chunks
+# can be verified without knowing the password.
+#
+# A manifest is a text file with one "keyword value" pair per line:
+# the store format ("gorilla-snapshot 1"), the key file, the source
+# file name, the creation time, the key stretching iterations, the
+# header chunk and one "record" line per record chunk, in order. The
+# last line is "hmac" followed by the hex HMAC-SHA256 under L of the
+# snapshot name, a newline and all lines before it, so that a manifest
+# can neither be changed nor passed off as another snapshot.
+#
+
+namespace eval pwsafe::store {
+    #
+    # Unwrapped store keys of this session, indexed by key file. Each
+    # element is a list {passwordCheck K L}, passwordCheck being a
+    # digest of key file salt and password that allows to reuse the
+    # keys without stretching the password again.
+    #
+
+    variable keys
+    array set keys {}
+}
+
+#
+# Returns the store directory that is used for backups of fileName
+# into backupPath.
+#
+
+proc pwsafe::store::directory {backupPath fileName} {
+    return [file join $backupPath \
+		"[file rootname [file tail $fileName]].store"]
+}
+
+#
+# ----------------------------------------------------------------------
+# Keys
+# ----------------------------------------------------------------------
+#
+
+proc pwsafe::store::passwordCheck {salt password} {
+    return [sha2::sha256 -bin "$salt$password"]
+}
+
+#
+# Read a key file. Returns {salt iter hskey b1 b2 b3 b4}.
+#
+
+proc pwsafe::store::readKeyFile {keyFile} {
+    set file [open $keyFile]
+    fconfigure $file -translation binary
+    set data [read $file]
+    close $file
+
+    if {[string length $data] != 136 || \
+	    ![string equal -length 4 $data "GST1"]} {
+	error [mc "%s is not a backup store key file" $keyFile]
+    }
+
+    binary scan $data @4a32ia32a16a16a16a16 salt iter hskey b1 b2 b3 b4
+    return [list $salt $iter $hskey $b1 $b2 $b3 $b4]
+}
+
+#
+# Unwrap the keys of keyFile with password. Returns {K L}, or an
+# empty list if the password does not fit.
+#
+
+proc pwsafe::store::unwrapKey {keyFile password} {
+    variable keys
+
+    lassign [readKeyFile $keyFile] salt iter hskey b1 b2 b3 b4
+    set check [passwordCheck $salt $password]
+
+    if {[info exists keys($keyFile)]} {
+	if {[string equal [lindex $keys($keyFile) 0] $check]} {
+	    return [lrange $keys($keyFile) 1 2]
+	}
+    }
+
+    set skey [pwsafe::int::computeStretchedKey $salt $password $iter ""]
+    if {![string equal [sha2::sha256 -bin $skey] $hskey]} {
+	pwsafe::int::randomizeVar skey
+	return [list]
+    }
+
+    set hdrEngine [itwofish::ecb \#auto $skey]
+    pwsafe::int::randomizeVar skey
+    set key [$hdrEngine decryptBlock $b1]
+    append key [$hdrEngine decryptBlock $b2]
+    set hmacKey [$hdrEngine decryptBlock $b3]
+    append hmacKey [$hdrEngine decryptBlock $b4]
+    itcl::delete object $hdrEngine
+
+    set keys($keyFile) [list $check $key $hmacKey]
+    return [list $key $hmacKey]
+}
+
+#
+# Write a new key file into storeDir that wraps the keys K and L with
+# password. Returns the name of the key file.
+#
+
+proc pwsafe::store::wrapKey {storeDir password iter key hmacKey} {
+    variable keys
+
+    set n 1
+    while {[file exists [file join $storeDir key-$n]]} {
+	incr n
+    }
+    set keyFile [file join $storeDir key-$n]
+
+    set salt [pwsafe::int::randomString 32]
+    set skey [pwsafe::int::computeStretchedKey $salt $password $iter ""]
+
+    set hdrEngine [itwofish::ecb \#auto $skey]
+    set data "GST1"
+    append data $salt [binary format i $iter] [sha2::sha256 -bin $skey]
+    append data [$hdrEngine encryptBlock [string range $key 0 15]]
+    append data [$hdrEngine encryptBlock [string range $key 16 31]]
+    append data [$hdrEngine encryptBlock [string range $hmacKey 0 15]]
+    append data [$hdrEngine encryptBlock [string range $hmacKey 16 31]]
+    itcl::delete object $hdrEngine
+    pwsafe::int::randomizeVar skey
+
+    set file [open $keyFile {WRONLY CREAT EXCL}]
+    fconfigure $file -translation binary
+    puts -nonewline $file $data
+    close $file
+
+    set keys($keyFile) [list [passwordCheck $salt $password] $key $hmacKey]
+    return $keyFile
+}
+
+#
+# Find the key file of storeDir that opens with password, creating a
+# new one if there is none. Returns {keyFile K L}.
+#
+
+proc pwsafe::store::openKey {storeDir password iter} {
+    variable keys
+
+    set keyFiles [lsort -dictionary \
+		      [glob -nocomplain -types f -directory $storeDir key-*]]
+
+    foreach keyFile $keyFiles {
+	set unwrapped [unwrapKey $keyFile $password]
+	if {[llength $unwrapped] == 2} {
+	    return [list $keyFile {*}$unwrapped]
+	}
+    }
+
+    #
+    # The password changed, or this is a new store. If the keys of this
+    # store are known from earlier in this session, wrap them with the
+    # new password so that existing chunks can still be shared.
+    #
+
+    set key ""
+    foreach keyFile [lreverse $keyFiles] {
+	if {[info exists keys($keyFile)]} {
+	    lassign $keys($keyFile) check key hmacKey
+	    break
+	}
+    }
+
+    if {$key eq ""} {
+	set key [pwsafe::int::randomString 32]
+	set hmacKey [pwsafe::int::randomString 32]
+    }
+
+    set keyFile [wrapKey $storeDir $password $iter $key $hmacKey]
+    return [list $keyFile $key $hmacKey]
+}
+
+#
+# ----------------------------------------------------------------------
+# Chunks
+# ----------------------------------------------------------------------
+#
+
+proc pwsafe::store::chunkFile {storeDir name} {
+    return [file join $storeDir chunks [string range $name 0 1] $name]
+}
+
+#
+# Serialize a list of field types and values into chunk plaintext
+#
+
+proc pwsafe::store::serialize {fields} {
+    set data ""
+    foreach {type value} $fields {
+	set value [encoding convertto utf-8 $value]
+	append data [binary format II $type [string length $value]] $value
+	pwsafe::int::randomizeVar value
+    }
+    return $data
+}
+
+proc pwsafe::store::deserialize {data} {
+    set fields [list]
+    set index 0
+    set length [string length $data]
+    while {$index < $length} {
+	if {[binary scan $data @${index}II type fieldLength] != 2} {
+	    error [mc "truncated backup store chunk"]
+	}
+	incr index 8
+	set value [string range $data $index [expr {$index+$fieldLength-1}]]
+	lappend fields $type [encoding convertfrom utf-8 $value]
+	incr index $fieldLength
+    }
+    return $fields
+}
+
+#
+# Store the plaintext as a chunk, unless it is already present.
+# Returns the chunk name.
+#
+
+proc pwsafe::store::putChunk {storeDir key hmacKey plaintext} {
+    set name [sha2::hmac -hex -key $hmacKey $plaintext]
+    set fileName [chunkFile $storeDir $name]
+
+    if {[file exists $fileName]} {
+	return $name
+    }
+
+    set iv [binary format H32 [string range $name 0 31]]
+    set engine [itwofish::cbc \#auto $key $iv]
+    set body $iv
+    append body [$engine encrypt \
+		     "[binary format I [string length $plaintext]]$plaintext"]
+    itcl::delete object $engine
+
+    file mkdir [file dirname $fileName]
+    set file [open $fileName.tmp {WRONLY CREAT TRUNC}]
+    fconfigure $file -translation binary
+    puts -nonewline $file [sha2::sha256 -bin $body]
+    puts -nonewline $file $body
+    close $file
+    file rename -force -- $fileName.tmp $fileName
+
+    return $name
+}
+
+#
+# Read a chunk. Returns its body after checking the leading digest.
+#
+
+proc pwsafe::store::readChunkBody {storeDir name} {
+    set fileName [chunkFile $storeDir $name]
+    set file [open $fileName]
+    fconfigure $file -translation binary
+    set data [read $file]
+    close $file
+
+    set body [string range $data 32 end]
+    if {![string equal [string range $data 0 31] [sha2::sha256 -bin $body]]} {
+	error [mc "backup store chunk %s is damaged" $name]
+    }
+    return $body
+}
+
+proc pwsafe::store::getChunk {storeDir key hmacKey name} {
+    set body [readChunkBody $storeDir $name]
+
+    set engine [itwofish::cbc \#auto $key [string range $body 0 15]]
+    set data [$engine decrypt [string range $body 16 end]]
+    itcl::delete object $engine
+
+    binary scan $data I length
+    set plaintext [string range $data 4 [expr {$length+3}]]
+    pwsafe::int::randomizeVar data
+
+    if {![string equal [sha2::hmac -hex -key $hmacKey $plaintext] $name]} {
+	pwsafe::int::randomizeVar plaintext
+	error [mc "backup store chunk %s does not match its name" $name]
+    }
+    return $plaintext
+}
+
+#
+# ----------------------------------------------------------------------
+# Snapshots
+# ----------------------------------------------------------------------
+#
+
+#
+# Returns the manifests of storeDir, oldest first
+#
+
+proc pwsafe::store::snapshots {storeDir} {
+    set result [list]
+    foreach fileName [lsort -dictionary [glob -nocomplain -types f \
+				 -directory [file join $storeDir snapshots] *]] {
+	lappend result [file tail $fileName]
+    }
+    return $result
+}
+
+#
+# Read a manifest into a dict with the keys key, source, created,
+# iterations, header, records and hmac. The key signed holds the text
+# that the hmac is computed over; see checkManifest.
+#
+
+proc pwsafe::store::readManifest {storeDir snapshot} {
+    set file [open [file join $storeDir snapshots $snapshot]]
+    set lines [split [string trim [read $file]] "\n"]
+    close $file
+
+    if {[lindex $lines 0] ne "gorilla-snapshot 1"} {
+	error [mc "%s is not a backup store snapshot" $snapshot]
+    }
+
+    set manifest [dict create records [list] hmac ""]
+    if {[string match "hmac *" [lindex $lines end]]} {
+	dict set manifest hmac [string range [lindex $lines end] 5 end]
+	dict set manifest signed \
+	    "$snapshot\n[join [lrange $lines 0 end-1] \n]\n"
+	set lines [lrange $lines 0 end-1]
+    }
+    foreach line [lrange $lines 1 end] {
+	set value [string range $line [expr {[string first " " $line]+1}] end]
+	switch -- [lindex [split $line] 0] {
+	    record {
+		dict lappend manifest records $value
+	    }
+	    hmac {
+		error [mc "backup store snapshot %s is damaged" $snapshot]
+	    }
+	    default {
+		dict set manifest [lindex [split $line] 0] $value
+	    }
+	}
+    }
+    return $manifest
+}
+
+#
+# Check the hmac of a manifest read with readManifest against the
+# store's HMAC key L. Throws an error if it does not match.
+#
+
+proc pwsafe::store::checkManifest {snapshot manifest hmacKey} {
+    set expected ""
+    if {[dict exists $manifest signed]} {
+	set expected [sha2::hmac -hex -key $hmacKey [dict get $manifest signed]]
+    }
+    if {$expected eq "" || \
+	    ![string equal $expected [dict get $manifest hmac]]} {
+	error [mc "backup store snapshot %s is not authentic" $snapshot]
+    }
+}
+
+#
+# Add a snapshot of db to the store, and drop the oldest snapshots so
+# that at most keep remain. Returns the name of the new snapshot. If
+# db did not change since the newest snapshot, no snapshot is added and
+# the name of the newest one is returned.
+#
+
+proc pwsafe::store::addSnapshot {storeDir db sourceName keep} {
+    file mkdir [file join $storeDir snapshots]
+
+    set iter [$db cget -keyStretchingIterations]
+    lassign [openKey $storeDir [$db getPassword] $iter] keyFile key hmacKey
+
+    set fields [list]
+    foreach type [$db getAllHeaderFields] {
+	lappend fields $type [$db getHeaderField $type]
+    }
+    set plaintext [serialize $fields]
+    set header [putChunk $storeDir $key $hmacKey $plaintext]
+
+    set records [list]
+    foreach rn [$db getAllRecordNumbers] {
+	set fields [list]
+	foreach type [$db getFieldsForRecord $rn] {
+	    lappend fields $type [$db getFieldValue $rn $type]
+	}
+	set plaintext [serialize $fields]
+	lappend records [putChunk $storeDir $key $hmacKey $plaintext]
+	pwsafe::int::randomizeVar fields plaintext
+    }
+
+    set newest [lindex [snapshots $storeDir] end]
+    if {$newest ne "" && ![catch {
+	set last [readManifest $storeDir $newest]
+	expr {[dict get $last key] eq [file tail $keyFile] && \
+		  [dict get $last source] eq $sourceName && \
+		  [dict get $last iterations] == $iter && \
+		  [dict get $last header] eq $header && \
+		  [dict get $last records] eq $records}
+    } unchanged] && $unchanged} {
+	pwsafe::int::randomizeVar key hmacKey
+	return $newest
+    }
+
+    set now [clock seconds]
+    set snapshot [clock format $now -format "%Y-%m-%d-%H-%M-%S"]
+    set n 0
+    while {[file exists [file join $storeDir snapshots $snapshot]]} {
+	set snapshot "[clock format $now -format "%Y-%m-%d-%H-%M-%S"]-[incr n]"
+    }
+
+    set manifest "gorilla-snapshot 1\n"
+    append manifest "key [file tail $keyFile]\n"
+    append manifest "source $sourceName\n"
+    append manifest "created $now\n"
+    append manifest "iterations $iter\n"
+    append manifest "header $header\n"
+    foreach name $records {
+	append manifest "record $name\n"
+    }
+    set hmac [sha2::hmac -hex -key $hmacKey "$snapshot\n$manifest"]
+    append manifest "hmac $hmac\n"
+    pwsafe::int::randomizeVar key hmacKey
+
+    set fileName [file join $storeDir snapshots $snapshot]
+    set file [open $fileName.tmp {WRONLY CREAT TRUNC}]
+    puts -nonewline $file $manifest
+    close $file
+    file rename -force -- $fileName.tmp $fileName
+
+    prune $storeDir $keep
+    return $snapshot
+}
+
+#
+# Keep only the newest keep snapshots (all of them if keep is 0), and
+# delete chunks that are no longer used by any snapshot
+#
+
+proc pwsafe::store::prune {storeDir keep} {
+    set snapshots [snapshots $storeDir]
+
+    if {$keep > 0 && [llength $snapshots] > $keep} {
+	foreach snapshot [lrange $snapshots 0 end-$keep] {
+	    file delete [file join $storeDir snapshots $snapshot]
+	}
+	set snapshots [lrange $snapshots end-[expr {$keep-1}] end]
+    } else {
+	return
+    }
+
+    array set used {}
+    foreach snapshot $snapshots {
+	set manifest [readManifest $storeDir $snapshot]
+	set used([dict get $manifest header]) 1
+	foreach name [dict get $manifest records] {
+	    set used($name) 1
+	}
+    }
+
+    foreach fileName [glob -nocomplain -types f \
+			  [file join $storeDir chunks * *]] {
+	if {![info exists used([file tail $fileName])]} {
+	    file delete $fileName
+	}
+    }
+}
+
+#
+# Restore a snapshot into a new pwsafe::db object, which is returned
+#
+
+proc pwsafe::store::restore {storeDir snapshot password} {
+    set manifest [readManifest $storeDir $snapshot]
+    set keyFile [file join $storeDir [dict get $manifest key]]
+
+    set unwrapped [unwrapKey $keyFile $password]
+    if {[llength $unwrapped] != 2} {
+	error [mc "wrong password"]
+    }
+    lassign $unwrapped key hmacKey
+
+    if {[catch {checkManifest $snapshot $manifest $hmacKey} oops]} {
+	set origErrorInfo $::errorInfo
+	pwsafe::int::randomizeVar key hmacKey
+	error $oops $origErrorInfo
+    }
+
+    set db [namespace current]::[pwsafe::db #auto $password]
+    $db configure -keyStretchingIterations [dict get $manifest iterations]
+
+    if {[catch {
+	set plaintext [getChunk $storeDir $key $hmacKey \
+			   [dict get $manifest header]]
+	foreach {type value} [deserialize $plaintext] {
+	    $db setHeaderField $type $value
+	}
+
+	foreach name [dict get $manifest records] {
+	    set plaintext [getChunk $storeDir $key $hmacKey $name]
+	    set rn [$db createRecord]
+	    foreach {type value} [deserialize $plaintext] {
+		$db setFieldValue $rn $type $value
+	    }
+	    pwsafe::int::randomizeVar plaintext value
+	}
+    } oops]} {
+	set origErrorInfo $::errorInfo
+	itcl::delete object $db
+	pwsafe::int::randomizeVar key hmacKey
+	error $oops $origErrorInfo
+    }
+
+    pwsafe::int::randomizeVar key hmacKey
+    return $db
+}
+
+#
+# Verify a store. Without a password, every chunk that a snapshot
+# refers to must exist and match its leading digest. With a password,
+# the manifests of the snapshots whose key opens with it are checked
+# against their hmac, and their chunks are also decrypted and checked
+# against their names. Returns a list of error
+# messages, which is empty if the store is fine.
+#
+
+proc pwsafe::store::verify {storeDir {password ""}} {
+    set errors [list]
+    array set checked {}
+
+    foreach snapshot [snapshots $storeDir] {
+	if {[catch {set manifest [readManifest $storeDir $snapshot]} oops]} {
+	    lappend errors "$snapshot: $oops"
+	    continue
+	}
+
+	set unwrapped [list]
+	if {$password ne ""} {
+	    set keyFile [file join $storeDir [dict get $manifest key]]
+	    if {[catch {set unwrapped [unwrapKey $keyFile $password]} oops]} {
+		lappend errors "$snapshot: $oops"
+	    }
+	}
+	if {[llength $unwrapped] == 2 && [catch {
+	    checkManifest $snapshot $manifest [lindex $unwrapped 1]
+	} oops]} {
+	    lappend errors "$snapshot: $oops"
+	}
+
+	foreach name [list [dict get $manifest header] \
+			  {*}[dict get $manifest records]] {
+	    if {[info exists checked($name,[llength $unwrapped])]} {
+		continue
+	    }
+	    set checked($name,[llength $unwrapped]) 1
+
+	    if {[llength $unwrapped] == 2} {
+		set failed [catch {getChunk $storeDir {*}$unwrapped $name} oops]
+	    } else {
+		set failed [catch {readChunkBody $storeDir $name} oops]
+	    }
+	    if {$failed} {
+		lappend errors "$snapshot: $oops"
+	    }
+	}
+    }
+
+    return $errors
+}
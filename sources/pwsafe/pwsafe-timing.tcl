@@ -0,0 +1,176 @@
+#
+# ----------------------------------------------------------------------
+# pwsafe::timing: phase timers and counters for opening and saving
+# ----------------------------------------------------------------------
+#
+# An operation (e.g., "open" or "save") is bracketed by begin and end.
+# begin returns a handle for the operation, which the other commands
+# take: add accumulates the microseconds spent in named phases and
+# count accumulates counters, such as bytes or records. An empty handle
+# is accepted and ignored. Operations nest by handle: a begin that
+# names a running operation as its parent only adds to it, so that
+# gorilla::Save and pwsafe::writeToFile report into the same result,
+# while operations that run at the same time, e.g., a file that is read
+# from the event loop and a vault that is opened meanwhile, keep apart.
+#
+# A finished operation is a dict with the keys
+#
+#   operation  the name passed to begin
+#   file       the file name passed to begin
+#   time       start time, in seconds
+#   total      microseconds between begin and end
+#   phases     dict of phase name to microseconds, in order of first use
+#   counters   dict of counter name to value, in order of first use
+#
+# The last reports are returned by reports; each one is also appended
+# to logFile as a line of text, if logFile is set.
+#
+
+namespace eval pwsafe::timing {
+    variable serial 0
+    variable running
+    array set running {}
+    variable reports [list]
+    variable keep 20
+    variable logFile ""
+}
+
+#
+# Starts an operation and returns its handle. If parent is the handle
+# of a running operation, the operation is part of it instead, and the
+# handle of parent is returned; it then ends with the last end.
+#
+
+proc pwsafe::timing::begin {operation {fileName ""} {parent ""}} {
+    variable serial
+    variable running
+
+    if {$parent ne "" && [info exists running($parent)]} {
+	dict incr running($parent) depth
+	return $parent
+    }
+
+    set handle [namespace current]::operation[incr serial]
+    set running($handle) [dict create operation $operation file $fileName \
+	    time [clock seconds] total 0 phases {} counters {} \
+	    depth 1 started [clock microseconds]]
+    return $handle
+}
+
+proc pwsafe::timing::end {handle} {
+    variable running
+    variable reports
+    variable keep
+    variable logFile
+
+    if {![info exists running($handle)]} {
+	return
+    }
+    dict incr running($handle) depth -1
+    if {[dict get $running($handle) depth] > 0} {
+	return
+    }
+
+    set report $running($handle)
+    unset running($handle)
+    dict set report total [expr {[clock microseconds] - [dict get $report started]}]
+    set report [dict remove $report depth started]
+    lappend reports $report
+    set reports [lrange $reports end-[expr {$keep - 1}] end]
+
+    if {$logFile ne ""} {
+	catch {
+	    set log [open $logFile {WRONLY CREAT APPEND}]
+	    puts $log [clock format [dict get $report time] \
+		    -format "%Y-%m-%d %H:%M:%S "][summary $report]
+	    close $log
+	}
+    }
+}
+
+#
+# Adds microseconds to a phase of a running operation
+#
+
+proc pwsafe::timing::add {handle phase microseconds} {
+    variable running
+
+    if {[info exists running($handle)]} {
+	dict update running($handle) phases phases {
+	    dict incr phases $phase $microseconds
+	}
+    }
+}
+
+#
+# Adds increment to a counter of a running operation
+#
+
+proc pwsafe::timing::count {handle counter {increment 1}} {
+    variable running
+
+    if {[info exists running($handle)]} {
+	dict update running($handle) counters counters {
+	    dict incr counters $counter $increment
+	}
+    }
+}
+
+#
+# Evaluates script in the caller, adding its run time to phase of the
+# operation handle. Returns the result of script.
+#
+
+proc pwsafe::timing::measure {handle phase script} {
+    set start [clock microseconds]
+    set code [catch {uplevel 1 $script} result options]
+    add $handle $phase [expr {[clock microseconds] - $start}]
+    dict incr options -level
+    return -options $options $result
+}
+
+proc pwsafe::timing::reports {} {
+    variable reports
+    return $reports
+}
+
+#
+# Returns a report as one line of text
+#
+
+proc pwsafe::timing::summary {report} {
+    set line "[dict get $report operation] [file tail [dict get $report file]]:"
+    append line [::format " total %.1f ms" [expr {[dict get $report total] / 1000.0}]]
+    dict for {phase us} [dict get $report phases] {
+	append line [::format ", %s %.1f ms" $phase [expr {$us / 1000.0}]]
+    }
+    dict for {counter value} [dict get $report counters] {
+	append line ", $counter $value"
+    }
+    return $line
+}
+
+#
+# Returns a report as a table, one phase or counter per line. The time
+# not covered by any phase is shown as "other".
+#
+
+proc pwsafe::timing::table {report} {
+    set total [dict get $report total]
+    set text "[dict get $report operation] [dict get $report file]\n"
+    append text [clock format [dict get $report time] -format "%Y-%m-%d %H:%M:%S"] \n
+
+    set rest $total
+    dict for {phase us} [dict get $report phases] {
+	append text [::format "  %-20s %10.1f ms %5.1f %%\n" $phase \
+		[expr {$us / 1000.0}] [expr {$total ? 100.0 * $us / $total : 0}]]
+	incr rest -$us
+    }
+    append text [::format "  %-20s %10.1f ms\n" other [expr {$rest / 1000.0}]]
+    append text [::format "  %-20s %10.1f ms\n" total [expr {$total / 1000.0}]]
+
+    dict for {counter value} [dict get $report counters] {
+	append text [::format "  %-20s %10d\n" $counter $value]
+    }
+    return $text
+}
@@ -41,6 +41,23 @@ itcl::class pwsafe::v3::reader {
 
     protected variable used
 
+    #
+    # State of readRecords between calls: whether the next field begins
+    # a record, the fields of the current record and its number, and
+    # whether the last field was read
+    #
+
+    protected variable first
+    protected variable pending
+    protected variable recordnumber
+    protected variable finished
+
+    #
+    # Handle of the pwsafe::timing operation to report to, if any
+    #
+
+    public variable timing ""
+
     #
     # Read one field; returns [list type data]; or empty list on eof
     #
@@ -183,7 +200,14 @@ itcl::class pwsafe::v3::reader {
 	}
     }
 
-    protected method readAllFields {{percentvar ""}} {
+    #
+    # Read records until maxRecords of them are complete, or up to the
+    # end if maxRecords is negative. Returns the numbers of the records
+    # read. The next call continues where this one stopped, until
+    # atEnd is true.
+    #
+
+    public method readRecords {maxRecords {percentvar ""}} {
 	if {$percentvar != ""} {
 	    upvar $percentvar pcv
 	}
@@ -191,16 +215,33 @@ itcl::class pwsafe::v3::reader {
 	set fileSize [$source size]
 
 	#
-	# Remaining fields are user data
+	# Remaining fields are user data. The fields of a record are
+	# collected in pending and stored with one setFieldValues call at
+	# the end of the record. The time spent decrypting, authenticating
+	# and storing them is summed up locally and handed to
+	# pwsafe::timing once at the end.
 	#
 
-	set first 1
+	set records [list]
+	set fields 0
+	set decryptTime 0
+	set hmacTime 0
+	set storeTime 0
 
-	while {![$source eof]} {
+	while {!$finished && \
+		($maxRecords < 0 || [llength $records] < $maxRecords)} {
+	    if {[$source eof]} {
+		set finished 1
+		break
+	    }
+
+	    set t0 [clock microseconds]
 	    set field [readField]
+	    incr decryptTime [expr {[clock microseconds] - $t0}]
 
 	    if {[llength $field] == 0} {
 		# eof
+		set finished 1
 		break
 	    }
 
@@ -220,6 +261,14 @@ itcl::class pwsafe::v3::reader {
 
 	    if {$fieldType == -1} {
 		set first 1
+		if {[llength $pending]} {
+		    set t0 [clock microseconds]
+		    $db setFieldValues $recordnumber $pending
+		    incr storeTime [expr {[clock microseconds] - $t0}]
+		    pwsafe::int::randomizeVar pending
+		    set pending [list]
+		    lappend records $recordnumber
+		}
 		continue
 	    }
 
@@ -227,8 +276,11 @@ itcl::class pwsafe::v3::reader {
 		set recordnumber [$db createRecord]
 		set first 0
 	    }
+	    incr fields
 
+	    set t0 [clock microseconds]
 	    sha2::HMACUpdate $hmacEngine $fieldValue
+	    incr hmacTime [expr {[clock microseconds] - $t0}]
 
 	    #
 	    # Format the field's type, if necessary
@@ -299,12 +351,66 @@ itcl::class pwsafe::v3::reader {
 		}
 	    }
 
-	    $db setFieldValue $recordnumber $fieldType $fieldValue
+	    lappend pending $fieldType $fieldValue
 	    pwsafe::int::randomizeVar fieldType fieldValue
 	}
+
+	# a last record without end marker
+	if {$finished && [llength $pending]} {
+	    set t0 [clock microseconds]
+	    $db setFieldValues $recordnumber $pending
+	    incr storeTime [expr {[clock microseconds] - $t0}]
+	    pwsafe::int::randomizeVar pending
+	    set pending [list]
+	    lappend records $recordnumber
+	}
+
+	pwsafe::timing::add $timing "body decryption" $decryptTime
+	pwsafe::timing::add $timing "hmac" $hmacTime
+	pwsafe::timing::add $timing "field encryption" $storeTime
+	pwsafe::timing::count $timing records [llength $records]
+	pwsafe::timing::count $timing fields $fields
+	return $records
     }
 
+    #
+    # True when readRecords has read the last field
+    #
+
+    public method atEnd {} {
+	return $finished
+    }
+
+    #
+    # Read the whole file: readHeader, readRecords and checkHmac in one
+    #
+
     public method readFile {{percentvar ""}} {
+	if {$percentvar != ""} {
+	    upvar $percentvar pcv
+	    set pcvp "pcv"
+	} else {
+	    set pcvp ""
+	}
+
+	readHeader $pcvp
+	readRecords -1 $pcvp
+
+	if {![checkHmac]} {
+	    set dbWarnings [$db cget -warningsDuringOpen]
+	    lappend dbWarnings "Database authentication failed. File may\
+		have been tampered with."
+	    $db configure -warningsDuringOpen $dbWarnings
+	}
+    }
+
+    #
+    # Read the header up to the first record: verify the password, set
+    # up the decryption and read the header fields. The records follow
+    # with readRecords, and checkHmac at the end.
+    #
+
+    public method readHeader {{percentvar ""}} {
 	if {$used} {
 	    error [ mc "this object can not be reused" ]
 	}
@@ -388,8 +494,14 @@ itcl::class pwsafe::v3::reader {
 
 	$db configure -keyStretchingIterations $iter
 
-	set myskey [pwsafe::int::computeStretchedKey $salt [$db getPassword] $iter $pcvp]
-	set myhskey [sha2::sha256 -bin $myskey]
+	pwsafe::timing::count $timing "stretch iterations" $iter
+	pwsafe::timing::measure $timing "key stretch" {
+	    set myskey [pwsafe::int::takeStretchedKey $salt $iter [$db getPassword]]
+	    if {$myskey eq ""} {
+		set myskey [pwsafe::int::computeStretchedKey $salt [$db getPassword] $iter $pcvp]
+	    }
+	    set myhskey [sha2::sha256 -bin $myskey]
+	}
 	if {![string equal $hskey $myhskey]} {
 	    pwsafe::int::randomizeVar salt hskey b1 b2 b3 b4 iv myskey myhskey
 	    error [ mc "wrong password" ]
@@ -402,6 +514,7 @@ itcl::class pwsafe::v3::reader {
 	# the stretched passphrase as its key.
 	#
 
+	set t0 [clock microseconds]
 	set hdrEngine [itwofish::ecb \#auto $myskey]
 	pwsafe::int::randomizeVar myskey
 
@@ -420,6 +533,7 @@ itcl::class pwsafe::v3::reader {
 	pwsafe::int::randomizeVar b3 b4 hmacKey
 
 	itcl::delete object $hdrEngine
+	pwsafe::timing::add $timing "header decryption" [expr {[clock microseconds] - $t0}]
 
 	#
 	# Create decryption engine using key and initialization vector
@@ -429,50 +543,50 @@ itcl::class pwsafe::v3::reader {
 	pwsafe::int::randomizeVar key iv
 
 	#
-	# Read data
+	# Read data; the decryption and HMAC engines are released by the
+	# destructor if this fails
 	#
 
-	if {[catch {
-	    readHeaderFields
-	    readAllFields $pcvp
-	} oops]} {
-	    set errorInfo $::errorInfo
-	    sha2::HMACFinal $hmacEngine
-	    itcl::delete object $engine
-	    set engine ""
-	    error $oops $errorInfo
-	}
+	pwsafe::timing::measure $timing "header fields" readHeaderFields
+    }
 
-	#
-	# Read and validate HMAC
-	#
+    #
+    # Read and validate the HMAC after the last record. Returns 1 if
+    # the file is authentic.
+    #
 
+    public method checkHmac {} {
 	set hmac [$source read 32]
-	set myHmac [sha2::HMACFinal $hmacEngine]
-
-	if {![string equal $hmac $myHmac]} {
-	    set dbWarnings [$db cget -warningsDuringOpen]
-	    lappend dbWarnings "Database authentication failed. File may\
-		have been tampered with."
-	    $db configure -warningsDuringOpen $dbWarnings
-	}
+	set myHmac [pwsafe::timing::measure $timing "hmac" {sha2::HMACFinal $hmacEngine}]
+	set hmacEngine ""
+	set authentic [string equal $hmac $myHmac]
 
 	pwsafe::int::randomizeVar hmac myHmac
 	itcl::delete object $engine
 	set engine ""
+	return $authentic
     }
 
     constructor {db_ source_} {
 	set db $db_
 	set source $source_
 	set engine ""
+	set hmacEngine ""
 	set used 0
+	set first 1
+	set pending [list]
+	set recordnumber ""
+	set finished 0
     }
 
     destructor {
 	if {$engine != ""} {
 	    itcl::delete object $engine
 	}
+	if {$hmacEngine != ""} {
+	    sha2::HMACFinal $hmacEngine
+	}
+	pwsafe::int::randomizeVar pending
     }
 }
 
@@ -517,6 +631,12 @@ itcl::class pwsafe::v3::writer {
 
     protected variable used
 
+    #
+    # Handle of the pwsafe::timing operation to report to, if any
+    #
+
+    public variable timing ""
+
     #
     # Write one field
     #
@@ -645,13 +765,19 @@ itcl::class pwsafe::v3::writer {
 	set allRecords [$db getAllRecordNumbers]
 	set numRecords [llength $allRecords]
 	set countRecords 0
+	set fields 0
+	set fetchTime 0
+	set encryptTime 0
+	set hmacTime 0
 
 	foreach recordNumber $allRecords {
 	    incr countRecords
 	    set pcv [expr {100+(100*$countRecords/$numRecords)}]
 
 	    foreach fieldType [$db getFieldsForRecord $recordNumber] {
+		set t0 [clock microseconds]
 		set fieldValue [$db getFieldValue $recordNumber $fieldType]
+		incr fetchTime [expr {[clock microseconds] - $t0}]
 		set ignoreField 0
 
 		switch -- $fieldType {
@@ -730,13 +856,26 @@ itcl::class pwsafe::v3::writer {
 		    continue
 		}
 
+		set t0 [clock microseconds]
 		writeField $fieldType $fieldValue
+		set t1 [clock microseconds]
 		sha2::HMACUpdate $hmacEngine $fieldValue
+		incr encryptTime [expr {$t1 - $t0}]
+		incr hmacTime [expr {[clock microseconds] - $t1}]
+		incr fields
 		pwsafe::int::randomizeVar fieldType fieldValue
 	    }
 
+	    set t0 [clock microseconds]
 	    writeField -1 ""
+	    incr encryptTime [expr {[clock microseconds] - $t0}]
 	}
+
+	pwsafe::timing::add $timing "field decryption" $fetchTime
+	pwsafe::timing::add $timing "body encryption" $encryptTime
+	pwsafe::timing::add $timing "hmac" $hmacTime
+	pwsafe::timing::count $timing records $numRecords
+	pwsafe::timing::count $timing fields $fields
     }
 
     public method writeFile {{percentvar ""}} {
@@ -777,8 +916,11 @@ itcl::class pwsafe::v3::writer {
 
 	set salt [pwsafe::int::randomString 32]
 	set iter [$db cget -keyStretchingIterations]
-	set skey [pwsafe::int::computeStretchedKey $salt [$db getPassword] $iter $pcvp ]
-	set hskey [sha2::sha256 -bin $skey]
+	pwsafe::timing::count $timing "stretch iterations" $iter
+	pwsafe::timing::measure $timing "key stretch" {
+	    set skey [pwsafe::int::computeStretchedKey $salt [$db getPassword] $iter $pcvp ]
+	    set hskey [sha2::sha256 -bin $skey]
+	}
 
 	$sink write "PWS3"
 	$sink write $salt
@@ -790,6 +932,7 @@ itcl::class pwsafe::v3::writer {
 	# the stretched passphrase as its key.
 	#
 
+	set t0 [clock microseconds]
 	set hdrEngine [itwofish::ecb \#auto $skey]
 	pwsafe::int::randomizeVar skey
 
@@ -808,6 +951,7 @@ itcl::class pwsafe::v3::writer {
 	$sink write $b2
 	$sink write $b3
 	$sink write $b4
+	pwsafe::timing::add $timing "header encryption" [expr {[clock microseconds] - $t0}]
 
 	set key $k1
 	append key $k2
@@ -832,7 +976,7 @@ itcl::class pwsafe::v3::writer {
 	# Write data
 	#
 
-	writeHeaderFields
+	pwsafe::timing::measure $timing "header fields" writeHeaderFields
 	writeAllFields $pcvp
 
 	#
@@ -845,7 +989,7 @@ itcl::class pwsafe::v3::writer {
 	# Write HMAC
 	#
 
-	$sink write [sha2::HMACFinal $hmacEngine]
+	$sink write [pwsafe::timing::measure $timing "hmac" {sha2::HMACFinal $hmacEngine}]
 
 	itcl::delete object $engine
 	set engine ""
@@ -18,7 +18,7 @@ namespace eval pwsafe {}
 # ----------------------------------------------------------------------
 #
 
-proc pwsafe::createFromStream {stream password version {percentvar ""}} {
+proc pwsafe::createFromStream {stream password version {percentvar ""} {timing ""}} {
     if {$percentvar != ""} {
 	upvar $percentvar pcv
 	set pcvp "pcv"
@@ -30,6 +30,7 @@ proc pwsafe::createFromStream {stream password version {percentvar ""}} {
 
     if {$version == 3} {
 	set reader [namespace current]::[pwsafe::v3::reader #auto $db $stream]
+	$reader configure -timing $timing
     } else {
 	set reader [namespace current]::[pwsafe::v2::reader #auto $db $stream]
     }
@@ -50,8 +51,10 @@ proc pwsafe::createFromStream {stream password version {percentvar ""}} {
 # createFromFile: create a pwsafe object from a file
 # ----------------------------------------------------------------------
 #
+# timing is a running pwsafe::timing operation to report to, if any
+#
 
-proc pwsafe::createFromFile {fileName password {percentvar ""}} {
+proc pwsafe::createFromFile {fileName password {percentvar ""} {timing ""}} {
     if {$percentvar != ""} {
 	upvar $percentvar pcv
 	set pcvp "pcv"
@@ -63,7 +66,13 @@ proc pwsafe::createFromFile {fileName password {percentvar ""}} {
 	set size -1
     }
 
-    set file [open $fileName "r"]
+    set timing [pwsafe::timing::begin open $fileName $timing]
+    pwsafe::timing::count $timing "bytes read" [expr {max($size, 0)}]
+
+    if {[catch {set file [open $fileName "r"]} oops]} {
+	pwsafe::timing::end $timing
+	error $oops $::errorInfo
+    }
     fconfigure $file -translation binary
 
     #
@@ -77,17 +86,19 @@ proc pwsafe::createFromFile {fileName password {percentvar ""}} {
 
     if {[catch {
 			if {[string equal $magic "PWS3"]} {
-		    set db [pwsafe::createFromStream $stream $password 3 $pcvp]
+		    set db [pwsafe::createFromStream $stream $password 3 $pcvp $timing]
 			} else {
-		    set db [pwsafe::createFromStream $stream $password 2 $pcvp]
+		    set db [pwsafe::createFromStream $stream $password 2 $pcvp $timing]
 			}
 						    } oops]} {
 			set origErrorInfo $::errorInfo
 			itcl::delete object $stream
 			catch {close $file}
+			pwsafe::timing::end $timing
 			error $oops $origErrorInfo
     }
     itcl::delete object $stream
+    pwsafe::timing::end $timing
 
     if {[catch {close $file} oops]} {
 	itcl::delete object $db
@@ -97,6 +108,453 @@ proc pwsafe::createFromFile {fileName password {percentvar ""}} {
     return $db
 }
 
+#
+# ----------------------------------------------------------------------
+# openFile: read a file a few records at a time from the event loop
+# ----------------------------------------------------------------------
+#
+# openFile checks the password and reads the header of a V3 file, and
+# returns the db object still without records. After continueReading,
+# the records are read from the event loop: first firstRecords of them,
+# then slices of about readSlice milliseconds. chunkCommand is called
+# with the db object and the numbers of the records of every slice
+# appended; at the end, doneCommand is called with the db object, 1 if
+# the file is authentic or else 0, and an error message. stopReading
+# abandons the file before that. A V2 file has no HMAC; it is read
+# completely by openFile and handed over in one slice.
+#
+# The timing report of the open lasts until doneCommand returns. It is
+# part of the operation timing, if that is a running pwsafe::timing
+# operation, so that the caller can add to it, e.g., the time to show
+# the records.
+#
+
+namespace eval pwsafe {
+    variable reading
+    array set reading {}
+    variable firstRecords 100
+    variable readSlice 40
+}
+
+proc pwsafe::openFile {fileName password {percentvar ""} {timing ""}} {
+    variable reading
+
+    if {$percentvar != ""} {
+	upvar $percentvar pcv
+	set pcvp "pcv"
+    } else {
+	set pcvp ""
+    }
+
+    set started [clock microseconds]
+
+    if {[catch {set size [file size $fileName]}]} {
+	set size -1
+    }
+
+    set timing [pwsafe::timing::begin open $fileName $timing]
+
+    if {[catch {set file [open $fileName "r"]} oops]} {
+	pwsafe::timing::end $timing
+	error $oops $::errorInfo
+    }
+    fconfigure $file -translation binary
+    set magic [::read $file 4]
+    ::seek $file 0
+
+    if {![string equal $magic "PWS3"]} {
+	close $file
+	if {[catch {set db [pwsafe::createFromFile $fileName $password $pcvp $timing]} oops]} {
+	    set origErrorInfo $::errorInfo
+	    pwsafe::timing::end $timing
+	    error $oops $origErrorInfo
+	}
+	set reading($db) [dict create started $started timing $timing \
+		records [$db getAllRecordNumbers]]
+	return $db
+    }
+
+    pwsafe::timing::count $timing "bytes read" [expr {max($size, 0)}]
+
+    set stream [namespace current]::[pwsafe::io::streamreader #auto $file $size]
+    set db [namespace current]::[pwsafe::db #auto $password]
+    set reader [namespace current]::[pwsafe::v3::reader #auto $db $stream]
+    $reader configure -timing $timing
+
+    if {[catch {$reader readHeader $pcvp} oops]} {
+	set origErrorInfo $::errorInfo
+	itcl::delete object $reader $db $stream
+	catch {close $file}
+	pwsafe::timing::end $timing
+	error $oops $origErrorInfo
+    }
+
+    set reading($db) [dict create started $started timing $timing \
+	    file $file stream $stream reader $reader]
+    return $db
+}
+
+proc pwsafe::continueReading {db chunkCommand doneCommand} {
+    variable reading
+
+    dict set reading($db) chunkCommand $chunkCommand
+    dict set reading($db) doneCommand $doneCommand
+    ScheduleSlice $db
+}
+
+proc pwsafe::isReading {db} {
+    variable reading
+    return [info exists reading($db)]
+}
+
+proc pwsafe::stopReading {db} {
+    variable reading
+
+    if {[info exists reading($db)]} {
+	set timing [dict get $reading($db) timing]
+	CloseReading $db
+	pwsafe::timing::end $timing
+    }
+}
+
+#
+# The slice is started from a timer that is set when idle, so that the
+# window is redrawn between two slices
+#
+
+proc pwsafe::ScheduleSlice {db} {
+    after idle [list after 0 [list pwsafe::ReadSlice $db]]
+}
+
+proc pwsafe::ReadSlice {db} {
+    variable reading
+    variable firstRecords
+    variable readSlice
+
+    if {![info exists reading($db)]} {
+	# stopped meanwhile
+	return
+    }
+    set state $reading($db)
+
+    set authentic -1
+    set message ""
+    if {![dict exists $state reader]} {
+	set records [dict get $state records]
+	set authentic 1
+    } elseif {[catch {
+	set reader [dict get $state reader]
+	if {![dict exists $state shown]} {
+	    set records [$reader readRecords $firstRecords]
+	} else {
+	    set records [list]
+	    set until [expr {[clock milliseconds] + $readSlice}]
+	    while {![$reader atEnd] && [clock milliseconds] < $until} {
+		lappend records {*}[$reader readRecords 10]
+	    }
+	}
+	if {[$reader atEnd]} {
+	    set authentic [$reader checkHmac]
+	    if {!$authentic} {
+		set message [mc "Database authentication failed. File may have been tampered with."]
+	    }
+	}
+    } oops]} {
+	set records [list]
+	set authentic 0
+	set message $oops
+    }
+
+    if {[llength $records]} {
+	uplevel #0 [linsert [dict get $state chunkCommand] end $db $records]
+	if {![dict exists $state shown]} {
+	    pwsafe::timing::count [dict get $state timing] "ms to first records" \
+		    [expr {([clock microseconds] - [dict get $state started]) / 1000}]
+	}
+    }
+    if {[info exists reading($db)]} {
+	dict set reading($db) shown 1
+    }
+
+    if {$authentic == -1} {
+	if {[info exists reading($db)]} {
+	    ScheduleSlice $db
+	}
+	return
+    }
+
+    # doneCommand still reports into the timing of the open
+
+    CloseReading $db
+    catch {
+	uplevel #0 [linsert [dict get $state doneCommand] end $db $authentic $message]
+    } result options
+    pwsafe::timing::end [dict get $state timing]
+    return -options $options $result
+}
+
+proc pwsafe::CloseReading {db} {
+    variable reading
+
+    set state $reading($db)
+    unset reading($db)
+    if {[dict exists $state reader]} {
+	itcl::delete object [dict get $state reader] [dict get $state stream]
+	catch {close [dict get $state file]}
+    }
+}
+
+#
+# ----------------------------------------------------------------------
+# createFromFiles: create pwsafe objects from several files at once
+# ----------------------------------------------------------------------
+#
+# The key stretching of the V3 files runs concurrently in worker
+# threads, see pwsafe::int::stretchKeys; the files are then read one
+# after the other. Returns a list with an element for every file: "ok"
+# and the db object, or "error" and the error message.
+#
+
+proc pwsafe::createFromFiles {fileNames passwords} {
+    set jobs [list]
+    foreach fileName $fileNames password $passwords {
+	if {[catch {
+	    set file [open $fileName "r"]
+	    fconfigure $file -translation binary
+	    set header [::read $file 40]
+	    close $file
+	}]} {
+	    continue
+	}
+	if {[binary scan $header a4a32i magic salt iter] == 3 && \
+		[string equal $magic "PWS3"]} {
+	    lappend jobs [list $salt $iter $password]
+	}
+    }
+
+    pwsafe::int::stretchKeys $jobs
+
+    set result [list]
+    foreach fileName $fileNames password $passwords {
+	if {[catch {pwsafe::createFromFile $fileName $password} db]} {
+	    lappend result [list error $db]
+	} else {
+	    lappend result [list ok $db]
+	}
+    }
+
+    # keys of files that could not be read are not kept
+
+    foreach job $jobs {
+	pwsafe::int::takeStretchedKey {*}$job
+    }
+    pwsafe::int::randomizeVar passwords jobs
+    return $result
+}
+
+#
+# ----------------------------------------------------------------------
+# readRecords: read the records of a file in a worker thread
+# ----------------------------------------------------------------------
+#
+# Returns a dict from record number to a dict of field type and value,
+# with all records of the file. If the Thread package is available, the
+# file is read in a worker thread, key stretching and decryption
+# included, and the event loop keeps running meanwhile; else it is read
+# right here. The records are returned in clear text, so the caller
+# should not keep them longer than needed.
+#
+
+namespace eval pwsafe {
+    variable readResults
+    array set readResults {}
+    variable readSeq 0
+}
+
+proc pwsafe::readRecords {fileName password} {
+    variable readResults
+    variable readSeq
+
+    set read {{fileName password} {
+	set db [pwsafe::createFromFile $fileName $password]
+	set records [dict create]
+	dict for {rn token} [$db snapshot] {
+	    dict set records $rn [$db snapshotFields $token]
+	}
+	itcl::delete object $db
+	return $records
+    }}
+
+    if {[catch {package require Thread}]} {
+	return [apply $read $fileName $password]
+    }
+
+    # itwofish looks for its C library in ::gorilla::Dir
+
+    set tid [thread::create]
+    thread::send $tid [list set ::auto_path $::auto_path]
+    if {[info exists ::gorilla::Dir]} {
+	thread::send $tid [list namespace eval ::gorilla \
+		[list variable Dir $::gorilla::Dir]]
+    }
+    thread::send $tid {
+	package require msgcat
+	namespace import msgcat::*
+	package require pwsafe
+    }
+
+    # the event loop may start another read while this one waits
+    set slot [incr readSeq]
+    thread::send -async $tid [list apply {{read fileName password} {
+	list [catch {apply $read $fileName $password} result] $result
+    }} $read $fileName $password] [namespace current]::readResults($slot)
+    while {![info exists readResults($slot)]} {
+	vwait [namespace current]::readResults($slot)
+    }
+    lassign $readResults($slot) code result
+    unset readResults($slot)
+    thread::release $tid
+
+    if {$code} {
+	error $result
+    }
+    return $result
+}
+
+#
+# ----------------------------------------------------------------------
+# verifyFiles: check that files decrypt and are authentic
+# ----------------------------------------------------------------------
+#
+# Tries the passwords on each file. For V3 files only the key stretch is
+# computed to find the right password, for all files and passwords at
+# once with pwsafe::int::computeStretchedKeys, so that the chains share
+# the lanes of the multi-buffer sha256 kernel. Each file is then read
+# once with the key that fits, which checks the HMAC. Returns a list
+# with one result per file: a list of the outcome, one of "pass",
+# "fail" or "wrong password", and a detail: the number of records, the
+# index of the password and the other warnings of the open, such as too
+# few key stretching iterations, for "pass"; the error message for
+# "fail". Only an error or a failed authentication fails.
+#
+
+proc pwsafe::verifyFiles {fileNames passwords} {
+    set jobs [list]
+    set headers [list]
+    foreach fileName $fileNames {
+	if {[catch {
+	    set file [open $fileName "r"]
+	    fconfigure $file -translation binary
+	    set header [::read $file 72]
+	    close $file
+	} oops]} {
+	    lappend headers [list fail $oops]
+	    continue
+	}
+	if {[binary scan $header a4a32ia32 magic salt iter hskey] == 4 \
+		&& [string equal $magic "PWS3"]} {
+	    lappend headers [list v3 $salt $iter $hskey [llength $jobs]]
+	    foreach password $passwords {
+		lappend jobs [list $salt $password $iter]
+	    }
+	} else {
+	    lappend headers [list v2]
+	}
+    }
+
+    set keys [pwsafe::int::computeStretchedKeys $jobs]
+    pwsafe::int::randomizeVar jobs
+
+    set results [list]
+    foreach fileName $fileNames header $headers {
+	if {[lindex $header 0] eq "fail"} {
+	    lappend results $header
+	    continue
+	}
+	lappend results [verifyFileWithKeys $fileName $passwords \
+			     [lrange $header 1 end] $keys]
+    }
+    pwsafe::int::randomizeVar keys
+    return $results
+}
+
+#
+# Verifies one file for verifyFiles. v3 is empty for a V2 file, else
+# {salt iter hskey first}, first being the index into keys of the
+# stretched key of the first password.
+#
+
+proc pwsafe::verifyFileWithKeys {fileName passwords v3 keys} {
+    set isV3 [expr {[llength $v3] > 0}]
+    lassign $v3 salt iter hskey first
+
+    set index 0
+    foreach password $passwords {
+	set keyIndex ""
+	if {$isV3} {
+	    set key [lindex $keys [expr {$first + $index}]]
+	    if {![string equal [sha2::sha256 -bin $key] $hskey]} {
+		incr index
+		continue
+	    }
+	    set keyIndex [pwsafe::int::stretchedKeyIndex $salt $iter $password]
+	    set ::pwsafe::int::stretchedKeys($keyIndex) $key
+	    pwsafe::int::randomizeVar key
+	}
+
+	set failed [catch {pwsafe::createFromFile $fileName $password} db]
+
+	# the reader takes the key when it gets that far; do not leave
+	# it behind if it did not
+	if {$keyIndex ne "" && \
+		[info exists ::pwsafe::int::stretchedKeys($keyIndex)]} {
+	    pwsafe::int::randomizeVar ::pwsafe::int::stretchedKeys($keyIndex)
+	    unset ::pwsafe::int::stretchedKeys($keyIndex)
+	}
+
+	if {$failed} {
+	    if {$isV3 || ![string equal $db [mc "wrong password"]]} {
+		return [list fail $db]
+	    }
+	    incr index
+	    continue
+	}
+
+	set records [llength [$db getAllRecordNumbers]]
+	set warnings [join [$db cget -warningsDuringOpen] "; "]
+	set authentic [expr {![pwsafe::authenticationFailed $db]}]
+	itcl::delete object $db
+	if {!$authentic} {
+	    return [list fail $warnings]
+	}
+	return [list pass [list $records $index $warnings]]
+    }
+
+    return [list "wrong password" ""]
+}
+
+#
+# Verifies a single file, see verifyFiles
+#
+
+proc pwsafe::verifyFile {fileName passwords} {
+    return [lindex [verifyFiles [list $fileName] $passwords] 0]
+}
+
+#
+# Returns 1 if the HMAC of the file that db was read from did not match,
+# see pwsafe::v3::reader::readFile
+#
+
+proc pwsafe::authenticationFailed {db} {
+    foreach warning [$db cget -warningsDuringOpen] {
+	if {[string match "Database authentication failed*" $warning]} {
+	    return 1
+	}
+    }
+    return 0
+}
+
 #
 # ----------------------------------------------------------------------
 # createFromString: create a pwsafe object from an (in-memory) string
@@ -138,8 +596,10 @@ proc pwsafe::createFromString {data password {percentvar ""}} {
 # writeToFile: write a pwsafe object to a file
 # ----------------------------------------------------------------------
 #
+# timing is a running pwsafe::timing operation to report to, if any
+#
 
-proc pwsafe::writeToFile {db fileName version {percentvar ""}} {
+proc pwsafe::writeToFile {db fileName version {percentvar ""} {timing ""}} {
     if {$percentvar != ""} {
 	upvar $percentvar pcv
 	set pcvp "pcv"
@@ -157,13 +617,19 @@ proc pwsafe::writeToFile {db fileName version {percentvar ""}} {
     set tmpFileName $fileName
     append tmpFileName ".tmp"
 
-    set file [open $tmpFileName "w"]
+    set timing [pwsafe::timing::begin save $fileName $timing]
+
+    if {[catch {set file [open $tmpFileName "w"]} oops]} {
+	pwsafe::timing::end $timing
+	error $oops $::errorInfo
+    }
     fconfigure $file -translation binary
 
     set stream [namespace current]::[pwsafe::io::streamwriter #auto $file]
 
     if {$version == 3} {
 	set writer [namespace current]::[pwsafe::v3::writer #auto $db $stream]
+	$writer configure -timing $timing
     } elseif {$version == 2} {
 	set writer [namespace current]::[pwsafe::v2::writer #auto $db $stream]
     } else {
@@ -176,18 +642,31 @@ proc pwsafe::writeToFile {db fileName version {percentvar ""}} {
 	itcl::delete object $stream
 	catch {close $file}
 	catch {file delete $tmpFileName}
+	pwsafe::timing::end $timing
 	error $oops $origErrorInfo
     }
 
 	itcl::delete object $writer
 	itcl::delete object $stream
-	close $file
 
-	#
-	# Done writing to temporary file.
-	#
+	set failed [catch {
+	    pwsafe::timing::measure $timing "file write" {
+		close $file
+
+		#
+		# Done writing to temporary file.
+		#
 
-	file rename -force -- $tmpFileName $fileName
+		pwsafe::timing::count $timing "bytes written" [file size $tmpFileName]
+		file rename -force -- $tmpFileName $fileName
+	    }
+	} oops]
+	set origErrorInfo $::errorInfo
+	pwsafe::timing::end $timing
+
+	if {$failed} {
+	    error $oops $origErrorInfo
+	}
 	
 } ; # end proc pwsafe::writeToFile
 
@@ -250,10 +729,12 @@ proc pwsafe::dumpAllRecords {db out} {
 
 set pwsafeDir [file dirname [info script]]
 source [file join $pwsafeDir "pwsafe-int.tcl"]
+source [file join $pwsafeDir "pwsafe-timing.tcl"]
 source [file join $pwsafeDir "pwsafe-db.tcl"]
 source [file join $pwsafeDir "pwsafe-io.tcl"]
 source [file join $pwsafeDir "pwsafe-v2.tcl"]
 source [file join $pwsafeDir "pwsafe-v3.tcl"]
+source [file join $pwsafeDir "pwsafe-store.tcl"]
 unset pwsafeDir
 
 #
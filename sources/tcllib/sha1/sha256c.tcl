@@ -170,5 +170,406 @@ namespace eval ::sha2 {
         Tcl_SetObjResult(ip, obj);
         return TCL_OK;
     }
+
+    #
+    # Multi-buffer key stretching. The V3 keystretch hashes a 32 byte
+    # value over and over, and every step depends on the one before, so
+    # a single chain can not use more than one lane of the CPU. Several
+    # chains - other passwords, other files - are independent, though,
+    # and are computed side by side here: four lanes in plain C, or
+    # eight with AVX2 if the CPU supports it. A chain starts with the
+    # 32 byte SHA256(password + salt); each lane that finishes its chain
+    # takes up the next one.
+    #
+    # The kernel is chosen at run time, see sha256c_kernel.
+    #
+
+    critcl::ccode {
+        #include <string.h>
+
+        #if (defined(__GNUC__) || defined(__clang__)) && \
+            (defined(__x86_64__) || defined(__i386__))
+        #define SHA256_AVX2 1
+        #include <immintrin.h>
+        #endif
+
+        #define S256_LANES 8
+
+        typedef unsigned int s256_word;
+
+        static const s256_word s256_k[64] = {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b,
+            0x59f111f1, 0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01,
+            0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7,
+            0xc19bf174, 0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+            0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da, 0x983e5152,
+            0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+            0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc,
+            0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+            0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819,
+            0xd6990624, 0xf40e3585, 0x106aa070, 0x19a4c116, 0x1e376c08,
+            0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f,
+            0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+            0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+        };
+
+        static const s256_word s256_h0[8] = {
+            0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+            0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+        };
+
+        /* 1 if the AVX2 kernel is in use, -1 before the CPU was asked */
+        static int s256_use_avx2 = -1;
+
+        static int
+        s256_avx2_supported(void)
+        {
+        #ifdef SHA256_AVX2
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("avx2") != 0;
+        #else
+            return 0;
+        #endif
+        }
+
+        #define S256_ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+        /*
+         * Hashes x[i][l], word i of the 32 byte value of lane l, n times
+         * for lanes 0..3. The message of every step is the 32 byte value
+         * and its padding in one block, so words 8..15 are constant.
+         */
+
+        static void
+        s256_stretch4(s256_word x[8][S256_LANES], unsigned long n)
+        {
+            s256_word w[16][4], s[8][4], t1, t2;
+            s256_word *a, *b, *c, *d, *e, *f, *g, *h, *t;
+            int i, l, r;
+
+            while (n--) {
+                for (l = 0; l < 4; l++) {
+                    for (i = 0; i < 8; i++) {
+                        w[i][l] = x[i][l];
+                        s[i][l] = s256_h0[i];
+                    }
+                    w[8][l] = 0x80000000;
+                    for (i = 9; i < 15; i++) {
+                        w[i][l] = 0;
+                    }
+                    w[15][l] = 256;
+                }
+
+                a = s[0]; b = s[1]; c = s[2]; d = s[3];
+                e = s[4]; f = s[5]; g = s[6]; h = s[7];
+
+                for (r = 0; r < 64; r++) {
+                    s256_word *wr = w[r & 15];
+                    for (l = 0; l < 4; l++) {
+                        if (r >= 16) {
+                            s256_word w2 = w[(r - 2) & 15][l];
+                            s256_word w15 = w[(r - 15) & 15][l];
+                            wr[l] += (S256_ROR(w2, 17) ^ S256_ROR(w2, 19)
+                                      ^ (w2 >> 10))
+                                + w[(r - 7) & 15][l]
+                                + (S256_ROR(w15, 7) ^ S256_ROR(w15, 18)
+                                   ^ (w15 >> 3));
+                        }
+                        t1 = h[l] + (S256_ROR(e[l], 6) ^ S256_ROR(e[l], 11)
+                                     ^ S256_ROR(e[l], 25))
+                            + ((e[l] & f[l]) ^ (~e[l] & g[l]))
+                            + s256_k[r] + wr[l];
+                        t2 = (S256_ROR(a[l], 2) ^ S256_ROR(a[l], 13)
+                              ^ S256_ROR(a[l], 22))
+                            + ((a[l] & b[l]) ^ (a[l] & c[l]) ^ (b[l] & c[l]));
+                        d[l] += t1;
+                        h[l] = t1 + t2;
+                    }
+                    t = h; h = g; g = f; f = e; e = d; d = c; c = b; b = a;
+                    a = t;
+                }
+
+                /* after 64 rounds a..h point to s[0..7] again */
+                for (i = 0; i < 8; i++) {
+                    for (l = 0; l < 4; l++) {
+                        x[i][l] = s256_h0[i] + s[i][l];
+                    }
+                }
+            }
+        }
+
+        #ifdef SHA256_AVX2
+
+        /* The same for lanes 0..7, with word i of all lanes in a register */
+
+        #define S256_ROR8(x, n) _mm256_or_si256(_mm256_srli_epi32((x), (n)), \
+                                                _mm256_slli_epi32((x), 32 - (n)))
+        #define S256_ADD8(x, y) _mm256_add_epi32((x), (y))
+        #define S256_XOR8(x, y) _mm256_xor_si256((x), (y))
+
+        #define S256_ROUND8(a, b, c, d, e, f, g, h, r) \
+            do { \
+                __m256i t1 = S256_ADD8(S256_ADD8(h, \
+                    S256_XOR8(S256_XOR8(S256_ROR8(e, 6), S256_ROR8(e, 11)), \
+                              S256_ROR8(e, 25))), \
+                    S256_ADD8(S256_XOR8(_mm256_and_si256(e, f), \
+                                        _mm256_andnot_si256(e, g)), \
+                              S256_ADD8(_mm256_set1_epi32((int) s256_k[r]), \
+                                        w[(r) & 15]))); \
+                __m256i t2 = S256_ADD8( \
+                    S256_XOR8(S256_XOR8(S256_ROR8(a, 2), S256_ROR8(a, 13)), \
+                              S256_ROR8(a, 22)), \
+                    S256_XOR8(S256_XOR8(_mm256_and_si256(a, b), \
+                                        _mm256_and_si256(a, c)), \
+                              _mm256_and_si256(b, c))); \
+                d = S256_ADD8(d, t1); \
+                h = S256_ADD8(t1, t2); \
+            } while (0)
+
+        __attribute__((target("avx2"))) static void
+        s256_stretch8(s256_word x[8][S256_LANES], unsigned long n)
+        {
+            __m256i w[16], a, b, c, d, e, f, g, h, v[8];
+            int i, r;
+
+            for (i = 0; i < 8; i++) {
+                v[i] = _mm256_loadu_si256((const __m256i *) x[i]);
+            }
+
+            while (n--) {
+                for (i = 0; i < 8; i++) {
+                    w[i] = v[i];
+                }
+                w[8] = _mm256_set1_epi32((int) 0x80000000);
+                for (i = 9; i < 15; i++) {
+                    w[i] = _mm256_setzero_si256();
+                }
+                w[15] = _mm256_set1_epi32(256);
+
+                a = _mm256_set1_epi32((int) s256_h0[0]);
+                b = _mm256_set1_epi32((int) s256_h0[1]);
+                c = _mm256_set1_epi32((int) s256_h0[2]);
+                d = _mm256_set1_epi32((int) s256_h0[3]);
+                e = _mm256_set1_epi32((int) s256_h0[4]);
+                f = _mm256_set1_epi32((int) s256_h0[5]);
+                g = _mm256_set1_epi32((int) s256_h0[6]);
+                h = _mm256_set1_epi32((int) s256_h0[7]);
+
+                for (r = 0; r < 64; r += 8) {
+                    if (r >= 16) {
+                        for (i = r; i < r + 8; i++) {
+                            __m256i w2 = w[(i - 2) & 15];
+                            __m256i w15 = w[(i - 15) & 15];
+                            w[i & 15] = S256_ADD8(S256_ADD8(w[i & 15],
+                                S256_XOR8(S256_XOR8(S256_ROR8(w2, 17),
+                                                    S256_ROR8(w2, 19)),
+                                          _mm256_srli_epi32(w2, 10))),
+                                S256_ADD8(w[(i - 7) & 15],
+                                S256_XOR8(S256_XOR8(S256_ROR8(w15, 7),
+                                                    S256_ROR8(w15, 18)),
+                                          _mm256_srli_epi32(w15, 3))));
+                        }
+                    }
+                    S256_ROUND8(a, b, c, d, e, f, g, h, r);
+                    S256_ROUND8(h, a, b, c, d, e, f, g, r + 1);
+                    S256_ROUND8(g, h, a, b, c, d, e, f, r + 2);
+                    S256_ROUND8(f, g, h, a, b, c, d, e, r + 3);
+                    S256_ROUND8(e, f, g, h, a, b, c, d, r + 4);
+                    S256_ROUND8(d, e, f, g, h, a, b, c, r + 5);
+                    S256_ROUND8(c, d, e, f, g, h, a, b, r + 6);
+                    S256_ROUND8(b, c, d, e, f, g, h, a, r + 7);
+                }
+
+                v[0] = S256_ADD8(a, _mm256_set1_epi32((int) s256_h0[0]));
+                v[1] = S256_ADD8(b, _mm256_set1_epi32((int) s256_h0[1]));
+                v[2] = S256_ADD8(c, _mm256_set1_epi32((int) s256_h0[2]));
+                v[3] = S256_ADD8(d, _mm256_set1_epi32((int) s256_h0[3]));
+                v[4] = S256_ADD8(e, _mm256_set1_epi32((int) s256_h0[4]));
+                v[5] = S256_ADD8(f, _mm256_set1_epi32((int) s256_h0[5]));
+                v[6] = S256_ADD8(g, _mm256_set1_epi32((int) s256_h0[6]));
+                v[7] = S256_ADD8(h, _mm256_set1_epi32((int) s256_h0[7]));
+            }
+
+            for (i = 0; i < 8; i++) {
+                _mm256_storeu_si256((__m256i *) x[i], v[i]);
+            }
+        }
+
+        #endif
+    }
+
+    critcl::ccommand sha256c_stretch {dummy ip objc objv} {
+
+        /* sha256c_stretch values iterations
+
+           values is a list of 32 byte values, iterations a list of as
+           many iteration counts. Returns the list of the values, each
+           hashed with SHA256 as often as its iteration count says.
+        */
+
+        Tcl_Obj **values, **counts, *result;
+        s256_word (*chain)[8] = NULL, x[8][S256_LANES];
+        Tcl_WideInt *left = NULL, step;
+        int lane[S256_LANES];
+        int n, nCounts, next, lanes, i, j, l, size, status = TCL_ERROR;
+        unsigned char *data, bytes[32];
+
+        if (objc != 3) {
+            Tcl_WrongNumArgs(ip, 1, objv, "values iterations");
+            return TCL_ERROR;
+        }
+        if (Tcl_ListObjGetElements(ip, objv[1], &n, &values) != TCL_OK
+            || Tcl_ListObjGetElements(ip, objv[2], &nCounts, &counts) != TCL_OK) {
+            return TCL_ERROR;
+        }
+        if (n != nCounts) {
+            Tcl_SetObjResult(ip, Tcl_NewStringObj(
+                "values and iterations differ in length", -1));
+            return TCL_ERROR;
+        }
+
+        if (s256_use_avx2 < 0) {
+            s256_use_avx2 = s256_avx2_supported();
+        }
+        lanes = s256_use_avx2 ? 8 : 4;
+
+        chain = (s256_word (*)[8]) ckalloc(sizeof *chain * (n ? n : 1));
+        left = (Tcl_WideInt *) ckalloc(sizeof *left * (n ? n : 1));
+        memset(x, 0, sizeof x);
+        memset(bytes, 0, sizeof bytes);
+
+        for (j = 0; j < n; j++) {
+            data = Tcl_GetByteArrayFromObj(values[j], &size);
+            if (size != 32) {
+                Tcl_SetObjResult(ip, Tcl_NewStringObj(
+                    "values must be 32 bytes long", -1));
+                goto done;
+            }
+            if (Tcl_GetWideIntFromObj(ip, counts[j], &left[j]) != TCL_OK) {
+                goto done;
+            }
+            if (left[j] < 0) {
+                Tcl_SetObjResult(ip, Tcl_NewStringObj(
+                    "iterations must not be negative", -1));
+                goto done;
+            }
+            for (i = 0; i < 8; i++) {
+                chain[j][i] = ((s256_word) data[4*i] << 24)
+                    | ((s256_word) data[4*i+1] << 16)
+                    | ((s256_word) data[4*i+2] << 8) | data[4*i+3];
+            }
+        }
+
+        /* lane[l] is the chain in lane l, or -1 */
+        for (l = 0; l < S256_LANES; l++) {
+            lane[l] = -1;
+        }
+        next = 0;
+
+        for (;;) {
+            for (l = 0; l < lanes; l++) {
+                while (lane[l] < 0 && next < n) {
+                    if (left[next] > 0) {
+                        lane[l] = next;
+                        for (i = 0; i < 8; i++) {
+                            x[i][l] = chain[next][i];
+                        }
+                    }
+                    next++;
+                }
+            }
+
+            /* run all lanes until the first chain in them is done */
+            step = 0;
+            for (l = 0; l < lanes; l++) {
+                if (lane[l] >= 0 && (step == 0 || left[lane[l]] < step)) {
+                    step = left[lane[l]];
+                }
+            }
+            if (step == 0) {
+                break;
+            }
+
+        #ifdef SHA256_AVX2
+            if (s256_use_avx2) {
+                s256_stretch8(x, (unsigned long) step);
+            } else
+        #endif
+            s256_stretch4(x, (unsigned long) step);
+
+            for (l = 0; l < lanes; l++) {
+                if (lane[l] < 0) {
+                    continue;
+                }
+                left[lane[l]] -= step;
+                if (left[lane[l]] == 0) {
+                    for (i = 0; i < 8; i++) {
+                        chain[lane[l]][i] = x[i][l];
+                    }
+                    lane[l] = -1;
+                }
+            }
+        }
+
+        result = Tcl_NewListObj(0, NULL);
+        for (j = 0; j < n; j++) {
+            for (i = 0; i < 8; i++) {
+                bytes[4*i] = (unsigned char) (chain[j][i] >> 24);
+                bytes[4*i+1] = (unsigned char) (chain[j][i] >> 16);
+                bytes[4*i+2] = (unsigned char) (chain[j][i] >> 8);
+                bytes[4*i+3] = (unsigned char) chain[j][i];
+            }
+            Tcl_ListObjAppendElement(ip, result, Tcl_NewByteArrayObj(bytes, 32));
+        }
+        Tcl_SetObjResult(ip, result);
+        status = TCL_OK;
+
+    done:
+        memset(x, 0, sizeof x);
+        memset(bytes, 0, sizeof bytes);
+        memset(chain, 0, sizeof *chain * (n ? n : 1));
+        ckfree((char *) chain);
+        ckfree((char *) left);
+        return status;
+    }
+
+    critcl::ccommand sha256c_kernel {dummy ip objc objv} {
+
+        /* sha256c_kernel ?kernel?
+
+           Returns the kernel in use by sha256c_stretch, avx2 or scalar.
+           With an argument, switches to that kernel; avx2 is an error if
+           the CPU does not support it.
+        */
+
+        static const char * kernels[] = { "scalar", "avx2", NULL };
+        int kernel;
+
+        if (objc != 1 && objc != 2) {
+            Tcl_WrongNumArgs(ip, 1, objv, "?kernel?");
+            return TCL_ERROR;
+        }
+
+        if (s256_use_avx2 < 0) {
+            s256_use_avx2 = s256_avx2_supported();
+        }
+
+        if (objc == 2) {
+            if (Tcl_GetIndexFromObj(ip, objv[1], kernels, "kernel", 0,
+                    &kernel) != TCL_OK) {
+                return TCL_ERROR;
+            }
+            if (kernel == 1 && !s256_avx2_supported()) {
+                Tcl_SetObjResult(ip,
+                    Tcl_NewStringObj("the CPU does not support avx2", -1));
+                return TCL_ERROR;
+            }
+            s256_use_avx2 = kernel;
+        }
+
+        Tcl_SetObjResult(ip,
+            Tcl_NewStringObj(s256_use_avx2 ? "avx2" : "scalar", -1));
+        return TCL_OK;
+    }
 }
 
@@ -246,3 +246,527 @@ package provide f32-critcl 1.0
         return TCL_OK;
 
     } ; # end critcl::ccommand
+
+    # -----------------------------------------------------------------
+    #
+    # Multi-block kernel
+    #
+    # f32_critcl still leaves the rounds in Tcl, which costs a command
+    # call per f32 and per block. The commands below run whole blocks
+    # in C, using a key schedule that is computed once per key by
+    # twofish_schedule_critcl: the whitening and round subkeys, and the
+    # four key dependent S-boxes with the MDS matrix already applied,
+    # so that f32 becomes four table lookups.
+    #
+    # ECB and CBC decryption are block independent. They run four
+    # blocks at a time, interleaving the lookups of the blocks, or
+    # eight blocks at a time with AVX2 gathers if the CPU supports it.
+    # The kernel is chosen at run time, see twofish_kernel_critcl.
+    #
+
+    critcl::ccode {
+      #include <string.h>
+
+      #if (defined(__GNUC__) || defined(__clang__)) && \
+          (defined(__x86_64__) || defined(__i386__))
+      #define TWOFISH_AVX2 1
+      #include <immintrin.h>
+      #endif
+
+      typedef struct {
+          unsigned int s[4][256];   /* key dependent S-boxes and MDS */
+          unsigned int k[40];       /* whitening and round subkeys */
+      } twofish_schedule;
+
+      #define TF_ROL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+      #define TF_ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+      #define TF_G(sc, x) ((sc)->s[0][(x) & 255] ^ \
+                           (sc)->s[1][((x) >> 8) & 255] ^ \
+                           (sc)->s[2][((x) >> 16) & 255] ^ \
+                           (sc)->s[3][(x) >> 24])
+
+      /* 1 if the AVX2 kernel is in use, -1 before the CPU was asked */
+      static int tf_use_avx2 = -1;
+
+      static int
+      tf_avx2_supported(void)
+      {
+      #ifdef TWOFISH_AVX2
+          __builtin_cpu_init();
+          return __builtin_cpu_supports("avx2") != 0;
+      #else
+          return 0;
+      #endif
+      }
+
+      static unsigned int
+      tf_load(const unsigned char * p)
+      {
+          return (unsigned int) p[0] | ((unsigned int) p[1] << 8) |
+                 ((unsigned int) p[2] << 16) | ((unsigned int) p[3] << 24);
+      }
+
+      static void
+      tf_store(unsigned char * p, unsigned int x)
+      {
+          p[0] = x & 255;
+          p[1] = (x >> 8) & 255;
+          p[2] = (x >> 16) & 255;
+          p[3] = (x >> 24) & 255;
+      }
+
+      /*
+       * Because the MDS matrix is linear, f32(x) is the xor of f32 of
+       * each byte of x at its position, with f32(0) counted once more
+       * for every byte but one. This builds the tables from
+       * c_f32_critcl, so that both always agree.
+       */
+
+      static void
+      tf_make_schedule(twofish_schedule * sc, const unsigned int * subKeys,
+                       unsigned int * sboxKeys, int keyLen)
+      {
+          unsigned int zero = c_f32_critcl(0, sboxKeys, keyLen);
+          unsigned int b;
+          for (b = 0; b < 256; b++) {
+              sc->s[0][b] = c_f32_critcl(b, sboxKeys, keyLen) ^ zero;
+              sc->s[1][b] = c_f32_critcl(b << 8, sboxKeys, keyLen);
+              sc->s[2][b] = c_f32_critcl(b << 16, sboxKeys, keyLen);
+              sc->s[3][b] = c_f32_critcl(b << 24, sboxKeys, keyLen);
+          }
+          memcpy(sc->k, subKeys, sizeof(sc->k));
+      }
+
+      /* Encrypts n <= 4 blocks at p in place, interleaving the blocks */
+
+      static void
+      tf_encrypt4(const twofish_schedule * sc, unsigned char * p, int n)
+      {
+          unsigned int x0[4], x1[4], x2[4], x3[4], t0, t1;
+          const unsigned int * k = sc->k;
+          int b, r;
+
+          for (b = 0; b < n; b++) {
+              x0[b] = tf_load(p + 16*b) ^ k[0];
+              x1[b] = tf_load(p + 16*b + 4) ^ k[1];
+              x2[b] = tf_load(p + 16*b + 8) ^ k[2];
+              x3[b] = tf_load(p + 16*b + 12) ^ k[3];
+          }
+
+          for (r = 0; r < 8; r++) {
+              for (b = 0; b < n; b++) {
+                  t0 = TF_G(sc, x0[b]);
+                  t1 = TF_G(sc, TF_ROL(x1[b], 8));
+                  x2[b] = TF_ROR(x2[b] ^ (t0 + t1 + k[8 + 4*r]), 1);
+                  x3[b] = TF_ROL(x3[b], 1) ^ (t0 + 2*t1 + k[9 + 4*r]);
+              }
+              for (b = 0; b < n; b++) {
+                  t0 = TF_G(sc, x2[b]);
+                  t1 = TF_G(sc, TF_ROL(x3[b], 8));
+                  x0[b] = TF_ROR(x0[b] ^ (t0 + t1 + k[10 + 4*r]), 1);
+                  x1[b] = TF_ROL(x1[b], 1) ^ (t0 + 2*t1 + k[11 + 4*r]);
+              }
+          }
+
+          for (b = 0; b < n; b++) {
+              tf_store(p + 16*b, x2[b] ^ k[4]);
+              tf_store(p + 16*b + 4, x3[b] ^ k[5]);
+              tf_store(p + 16*b + 8, x0[b] ^ k[6]);
+              tf_store(p + 16*b + 12, x1[b] ^ k[7]);
+          }
+      }
+
+      /* Decrypts n <= 4 blocks at p in place, interleaving the blocks */
+
+      static void
+      tf_decrypt4(const twofish_schedule * sc, unsigned char * p, int n)
+      {
+          unsigned int x0[4], x1[4], x2[4], x3[4], t0, t1;
+          const unsigned int * k = sc->k;
+          int b, r;
+
+          for (b = 0; b < n; b++) {
+              x0[b] = tf_load(p + 16*b) ^ k[4];
+              x1[b] = tf_load(p + 16*b + 4) ^ k[5];
+              x2[b] = tf_load(p + 16*b + 8) ^ k[6];
+              x3[b] = tf_load(p + 16*b + 12) ^ k[7];
+          }
+
+          for (r = 7; r >= 0; r--) {
+              for (b = 0; b < n; b++) {
+                  t0 = TF_G(sc, x0[b]);
+                  t1 = TF_G(sc, TF_ROL(x1[b], 8));
+                  x2[b] = TF_ROL(x2[b], 1) ^ (t0 + t1 + k[10 + 4*r]);
+                  x3[b] = TF_ROR(x3[b] ^ (t0 + 2*t1 + k[11 + 4*r]), 1);
+              }
+              for (b = 0; b < n; b++) {
+                  t0 = TF_G(sc, x2[b]);
+                  t1 = TF_G(sc, TF_ROL(x3[b], 8));
+                  x0[b] = TF_ROL(x0[b], 1) ^ (t0 + t1 + k[8 + 4*r]);
+                  x1[b] = TF_ROR(x1[b] ^ (t0 + 2*t1 + k[9 + 4*r]), 1);
+              }
+          }
+
+          for (b = 0; b < n; b++) {
+              tf_store(p + 16*b, x2[b] ^ k[0]);
+              tf_store(p + 16*b + 4, x3[b] ^ k[1]);
+              tf_store(p + 16*b + 8, x0[b] ^ k[2]);
+              tf_store(p + 16*b + 12, x1[b] ^ k[3]);
+          }
+      }
+
+      #ifdef TWOFISH_AVX2
+
+      /*
+       * The AVX2 kernel keeps word i of eight blocks in one register and
+       * does the S-box lookups of all eight blocks with one gather per
+       * table. Only x86 is little endian enough to gather the words
+       * straight from the data.
+       */
+
+      #define TF_ROL8(x, n) _mm256_or_si256(_mm256_slli_epi32((x), (n)), \
+                                            _mm256_srli_epi32((x), 32 - (n)))
+      #define TF_ROR8(x, n) TF_ROL8((x), 32 - (n))
+
+      __attribute__((target("avx2"))) static inline __m256i
+      tf_g8(const twofish_schedule * sc, __m256i x)
+      {
+          const __m256i m = _mm256_set1_epi32(255);
+          __m256i r;
+          r = _mm256_i32gather_epi32((const int *) sc->s[0],
+                  _mm256_and_si256(x, m), 4);
+          r = _mm256_xor_si256(r, _mm256_i32gather_epi32(
+                  (const int *) sc->s[1],
+                  _mm256_and_si256(_mm256_srli_epi32(x, 8), m), 4));
+          r = _mm256_xor_si256(r, _mm256_i32gather_epi32(
+                  (const int *) sc->s[2],
+                  _mm256_and_si256(_mm256_srli_epi32(x, 16), m), 4));
+          r = _mm256_xor_si256(r, _mm256_i32gather_epi32(
+                  (const int *) sc->s[3], _mm256_srli_epi32(x, 24), 4));
+          return r;
+      }
+
+      /* Words i of blocks 0..7 at p, and back */
+
+      __attribute__((target("avx2"))) static inline __m256i
+      tf_load8(const unsigned char * p, int i)
+      {
+          const __m256i idx = _mm256_setr_epi32(0, 4, 8, 12, 16, 20, 24, 28);
+          return _mm256_i32gather_epi32((const int *) (p + 4*i), idx, 4);
+      }
+
+      __attribute__((target("avx2"))) static inline void
+      tf_store8(unsigned char * p, int i, __m256i x)
+      {
+          unsigned int w[8];
+          int b;
+          _mm256_storeu_si256((__m256i *) w, x);
+          for (b = 0; b < 8; b++) {
+              memcpy(p + 16*b + 4*i, &w[b], 4);
+          }
+      }
+
+      #define TF_K8(i) _mm256_set1_epi32((int) k[i])
+
+      __attribute__((target("avx2"))) static void
+      tf_encrypt8(const twofish_schedule * sc, unsigned char * p)
+      {
+          const unsigned int * k = sc->k;
+          __m256i x0, x1, x2, x3, t0, t1;
+          int r;
+
+          x0 = _mm256_xor_si256(tf_load8(p, 0), TF_K8(0));
+          x1 = _mm256_xor_si256(tf_load8(p, 1), TF_K8(1));
+          x2 = _mm256_xor_si256(tf_load8(p, 2), TF_K8(2));
+          x3 = _mm256_xor_si256(tf_load8(p, 3), TF_K8(3));
+
+          for (r = 0; r < 8; r++) {
+              t0 = tf_g8(sc, x0);
+              t1 = tf_g8(sc, TF_ROL8(x1, 8));
+              x2 = _mm256_xor_si256(x2, _mm256_add_epi32(
+                      _mm256_add_epi32(t0, t1), TF_K8(8 + 4*r)));
+              x2 = TF_ROR8(x2, 1);
+              x3 = _mm256_xor_si256(TF_ROL8(x3, 1), _mm256_add_epi32(
+                      _mm256_add_epi32(t0, _mm256_add_epi32(t1, t1)),
+                      TF_K8(9 + 4*r)));
+
+              t0 = tf_g8(sc, x2);
+              t1 = tf_g8(sc, TF_ROL8(x3, 8));
+              x0 = _mm256_xor_si256(x0, _mm256_add_epi32(
+                      _mm256_add_epi32(t0, t1), TF_K8(10 + 4*r)));
+              x0 = TF_ROR8(x0, 1);
+              x1 = _mm256_xor_si256(TF_ROL8(x1, 1), _mm256_add_epi32(
+                      _mm256_add_epi32(t0, _mm256_add_epi32(t1, t1)),
+                      TF_K8(11 + 4*r)));
+          }
+
+          tf_store8(p, 0, _mm256_xor_si256(x2, TF_K8(4)));
+          tf_store8(p, 1, _mm256_xor_si256(x3, TF_K8(5)));
+          tf_store8(p, 2, _mm256_xor_si256(x0, TF_K8(6)));
+          tf_store8(p, 3, _mm256_xor_si256(x1, TF_K8(7)));
+      }
+
+      __attribute__((target("avx2"))) static void
+      tf_decrypt8(const twofish_schedule * sc, unsigned char * p)
+      {
+          const unsigned int * k = sc->k;
+          __m256i x0, x1, x2, x3, t0, t1;
+          int r;
+
+          x0 = _mm256_xor_si256(tf_load8(p, 0), TF_K8(4));
+          x1 = _mm256_xor_si256(tf_load8(p, 1), TF_K8(5));
+          x2 = _mm256_xor_si256(tf_load8(p, 2), TF_K8(6));
+          x3 = _mm256_xor_si256(tf_load8(p, 3), TF_K8(7));
+
+          for (r = 7; r >= 0; r--) {
+              t0 = tf_g8(sc, x0);
+              t1 = tf_g8(sc, TF_ROL8(x1, 8));
+              x2 = _mm256_xor_si256(TF_ROL8(x2, 1), _mm256_add_epi32(
+                      _mm256_add_epi32(t0, t1), TF_K8(10 + 4*r)));
+              x3 = _mm256_xor_si256(x3, _mm256_add_epi32(
+                      _mm256_add_epi32(t0, _mm256_add_epi32(t1, t1)),
+                      TF_K8(11 + 4*r)));
+              x3 = TF_ROR8(x3, 1);
+
+              t0 = tf_g8(sc, x2);
+              t1 = tf_g8(sc, TF_ROL8(x3, 8));
+              x0 = _mm256_xor_si256(TF_ROL8(x0, 1), _mm256_add_epi32(
+                      _mm256_add_epi32(t0, t1), TF_K8(8 + 4*r)));
+              x1 = _mm256_xor_si256(x1, _mm256_add_epi32(
+                      _mm256_add_epi32(t0, _mm256_add_epi32(t1, t1)),
+                      TF_K8(9 + 4*r)));
+              x1 = TF_ROR8(x1, 1);
+          }
+
+          tf_store8(p, 0, _mm256_xor_si256(x2, TF_K8(0)));
+          tf_store8(p, 1, _mm256_xor_si256(x3, TF_K8(1)));
+          tf_store8(p, 2, _mm256_xor_si256(x0, TF_K8(2)));
+          tf_store8(p, 3, _mm256_xor_si256(x1, TF_K8(3)));
+      }
+
+      #endif
+
+      /* Encrypts or decrypts blocks independent blocks at p in place */
+
+      static void
+      tf_crypt(const twofish_schedule * sc, int decrypt, unsigned char * p,
+               int blocks)
+      {
+          int done = 0;
+          int n;
+
+          if (tf_use_avx2 < 0) {
+              tf_use_avx2 = tf_avx2_supported();
+          }
+
+      #ifdef TWOFISH_AVX2
+          if (tf_use_avx2) {
+              for (; blocks - done >= 8; done += 8) {
+                  if (decrypt) {
+                      tf_decrypt8(sc, p + 16*done);
+                  } else {
+                      tf_encrypt8(sc, p + 16*done);
+                  }
+              }
+          }
+      #endif
+
+          for (; done < blocks; done += n) {
+              n = blocks - done < 4 ? blocks - done : 4;
+              if (decrypt) {
+                  tf_decrypt4(sc, p + 16*done, n);
+              } else {
+                  tf_encrypt4(sc, p + 16*done, n);
+              }
+          }
+      }
+
+      static int
+      tf_get_words(Tcl_Interp * interp, Tcl_Obj * list, unsigned int * words,
+                   int max, const char * what)
+      {
+          Tcl_Obj ** data;
+          Tcl_WideInt temp;
+          int len, i;
+
+          if (Tcl_ListObjGetElements(interp, list, &len, &data) != TCL_OK)
+            return TCL_ERROR;
+          if (len > max) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("too many %s", what));
+            return TCL_ERROR;
+          }
+          for (i = 0; i < len; i++) {
+            if (Tcl_GetWideIntFromObj(interp, data[i], &temp) != TCL_OK)
+              return TCL_ERROR;
+            words[i] = temp & 0xffffffff;
+          }
+          return TCL_OK;
+      }
+
+    } ; # end critcl::ccode
+
+
+    critcl::ccommand twofish_schedule_critcl { cd interp objc objv } {
+
+      /* Returns the key schedule of the multi-block kernel, as a byte
+         array, for the subKeys, sboxKeys and keyLen of an itwofish
+         object.
+      */
+
+        twofish_schedule sc;
+        unsigned int subKeys[40] = { 0 };
+        unsigned int sboxKeys[4] = { 0, 0, 0, 0 };
+        int keyLen;
+
+        if (objc != 4) {
+          Tcl_WrongNumArgs(interp, 1, objv, "subKeys sboxKeys keyLen");
+          return TCL_ERROR;
+        }
+
+        if (tf_get_words(interp, objv[1], subKeys, 40, "subkeys") != TCL_OK)
+          return TCL_ERROR;
+        if (tf_get_words(interp, objv[2], sboxKeys, 4, "sbox keys") != TCL_OK)
+          return TCL_ERROR;
+        if (Tcl_GetIntFromObj(interp, objv[3], &keyLen) != TCL_OK)
+          return TCL_ERROR;
+
+        tf_make_schedule(&sc, subKeys, sboxKeys, keyLen);
+        Tcl_SetObjResult(interp,
+            Tcl_NewByteArrayObj((unsigned char *) &sc, sizeof(sc)));
+
+        memset(&sc, 0, sizeof(sc));
+        memset(subKeys, 0, sizeof(subKeys));
+        memset(sboxKeys, 0, sizeof(sboxKeys));
+        return TCL_OK;
+
+    } ; # end critcl::ccommand
+
+
+    critcl::ccommand twofish_blocks_critcl { cd interp objc objv } {
+
+      /* twofish_blocks_critcl mode schedule data ?iv?
+
+         Encrypts or decrypts data, a multiple of 16 bytes, with a key
+         schedule made by twofish_schedule_critcl. The mode is one of
+         encrypt and decrypt (ECB), or cbc-encrypt and cbc-decrypt,
+         which need the 16 byte initialization vector iv.
+      */
+
+        static const char * modes[] = {
+          "encrypt", "decrypt", "cbc-encrypt", "cbc-decrypt", NULL
+        };
+        enum { ECB_ENCRYPT, ECB_DECRYPT, CBC_ENCRYPT, CBC_DECRYPT };
+
+        twofish_schedule sc;
+        unsigned char * schedule, * data, * iv = NULL, * out;
+        int mode, scheduleLen, dataLen, ivLen, i, j;
+        Tcl_Obj * result;
+
+        if (objc != 4 && objc != 5) {
+          Tcl_WrongNumArgs(interp, 1, objv, "mode schedule data ?iv?");
+          return TCL_ERROR;
+        }
+
+        if (Tcl_GetIndexFromObj(interp, objv[1], modes, "mode", 0, &mode)
+            != TCL_OK)
+          return TCL_ERROR;
+
+        schedule = Tcl_GetByteArrayFromObj(objv[2], &scheduleLen);
+        if (scheduleLen != sizeof(sc)) {
+          Tcl_SetObjResult(interp, Tcl_NewStringObj("invalid key schedule", -1));
+          return TCL_ERROR;
+        }
+
+        data = Tcl_GetByteArrayFromObj(objv[3], &dataLen);
+        if (dataLen % 16 != 0) {
+          Tcl_SetObjResult(interp,
+              Tcl_NewStringObj("data must be a multiple of 16 bytes", -1));
+          return TCL_ERROR;
+        }
+
+        if (mode == CBC_ENCRYPT || mode == CBC_DECRYPT) {
+          if (objc != 5
+              || (iv = Tcl_GetByteArrayFromObj(objv[4], &ivLen), ivLen != 16)) {
+            Tcl_SetObjResult(interp, Tcl_NewStringObj("iv must be 16 bytes", -1));
+            return TCL_ERROR;
+          }
+        }
+
+        /* the byte array of a Tcl_Obj need not be aligned for the tables */
+        memcpy(&sc, schedule, sizeof(sc));
+
+        result = Tcl_NewByteArrayObj(data, dataLen);
+        out = Tcl_GetByteArrayFromObj(result, NULL);
+
+        switch (mode) {
+        case ECB_ENCRYPT:
+          tf_crypt(&sc, 0, out, dataLen / 16);
+          break;
+        case ECB_DECRYPT:
+          tf_crypt(&sc, 1, out, dataLen / 16);
+          break;
+        case CBC_ENCRYPT:
+          /* chained, one block at a time */
+          for (i = 0; i < dataLen; i += 16) {
+            for (j = 0; j < 16; j++) {
+              out[i + j] ^= (i == 0 ? iv[j] : out[i + j - 16]);
+            }
+            tf_crypt(&sc, 0, out + i, 1);
+          }
+          break;
+        case CBC_DECRYPT:
+          /* the blocks are independent, only the xor needs the chain */
+          tf_crypt(&sc, 1, out, dataLen / 16);
+          for (i = 0; i < dataLen; i += 16) {
+            for (j = 0; j < 16; j++) {
+              out[i + j] ^= (i == 0 ? iv[j] : data[i + j - 16]);
+            }
+          }
+          break;
+        }
+
+        memset(&sc, 0, sizeof(sc));
+        Tcl_SetObjResult(interp, result);
+        return TCL_OK;
+
+    } ; # end critcl::ccommand
+
+
+    critcl::ccommand twofish_kernel_critcl { cd interp objc objv } {
+
+      /* twofish_kernel_critcl ?kernel?
+
+         Returns the kernel in use by twofish_blocks_critcl, avx2 or
+         scalar. With an argument, switches to that kernel; avx2 is an
+         error if the CPU does not support it.
+      */
+
+        static const char * kernels[] = { "scalar", "avx2", NULL };
+        int kernel;
+
+        if (objc != 1 && objc != 2) {
+          Tcl_WrongNumArgs(interp, 1, objv, "?kernel?");
+          return TCL_ERROR;
+        }
+
+        if (tf_use_avx2 < 0) {
+          tf_use_avx2 = tf_avx2_supported();
+        }
+
+        if (objc == 2) {
+          if (Tcl_GetIndexFromObj(interp, objv[1], kernels, "kernel", 0,
+                &kernel) != TCL_OK)
+            return TCL_ERROR;
+          if (kernel == 1 && !tf_avx2_supported()) {
+            Tcl_SetObjResult(interp,
+                Tcl_NewStringObj("the CPU does not support avx2", -1));
+            return TCL_ERROR;
+          }
+          tf_use_avx2 = kernel;
+        }
+
+        Tcl_SetObjResult(interp,
+            Tcl_NewStringObj(tf_use_avx2 ? "avx2" : "scalar", -1));
+        return TCL_OK;
+
+    } ; # end critcl::ccommand
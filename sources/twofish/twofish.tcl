@@ -136,6 +136,21 @@ itcl::class ::itwofish::itwofish {
       set callmap [ list -m:f32- f32_critcl ]
     }
 
+    #
+    # Libraries built from the current f32-critcl.tcl also have a kernel
+    # that encrypts and decrypts whole blocks, several at a time. Then
+    # each object keeps a key schedule for it, and the ECB and CBC
+    # methods hand all their blocks to it in one call. blocks is 0 if
+    # the kernel is switched off (see kernel), fallback is what is used
+    # instead.
+    #
+
+    protected common haveBlocks [ expr {
+	[ info commands twofish_blocks_critcl ] ne "" } ]
+    protected common blocks $haveBlocks
+    protected common fallback [ expr {
+	[ lindex $callmap 1 ] eq "f32" ? "tcl" : "f32" } ]
+
 # ---------------------------------------------------
 
 
@@ -207,6 +222,31 @@ itcl::class ::itwofish::itwofish {
 			  0x100000000}]
     }
 
+    #
+    # Returns the implementation that encrypts and decrypts blocks:
+    # avx2 or scalar for the multi-block kernel, f32 if the C extension
+    # only has f32_critcl, tcl without C extension. With an argument,
+    # switches to that implementation, e.g., to test them against each
+    # other.
+    #
+
+    public proc kernel {{name ""}} {
+	if {$name eq $fallback} {
+	    set blocks 0
+	} elseif {$name ne ""} {
+	    if {!$haveBlocks || [lsearch -exact {scalar avx2} $name] < 0} {
+		error "unknown kernel \"$name\""
+	    }
+	    twofish_kernel_critcl $name
+	    set blocks 1
+	}
+
+	if {$blocks} {
+	    return [twofish_kernel_critcl]
+	}
+	return $fallback
+    }
+
     private common RS_GF_FDBK 0x14d
 
     public proc RS_rem {x} {
@@ -245,6 +285,12 @@ itcl::class ::itwofish::itwofish {
     public variable sboxKeys
     public variable subKeys
 
+    #
+    # Key schedule of the multi-block kernel, if there is one
+    #
+
+    protected variable schedule ""
+
     #
     # Initialize with key
     #
@@ -305,6 +351,7 @@ itcl::class ::itwofish::itwofish {
 	set subkeyCnt [expr {$ROUND_SUBKEYS + 32}]
 	set k64Cnt [expr {($keyLen + 63) / 64}]
 	set sboxKeys [list]
+	set subKeys [list]
 
 	for {set i 0} {$i < $k64Cnt} {incr i} {
 	    set ke [lindex $key32 [expr {2*$i}]]
@@ -328,6 +375,10 @@ itcl::class ::itwofish::itwofish {
 	    lappend subKeys [expr {($A + $B) % 0x100000000}]
 	    lappend subKeys [expr {(($Ap2B << $SK_ROTL) % 0x100000000) | ($Ap2B >> (32 - $SK_ROTL))}]
 	}
+
+	if {$haveBlocks} {
+	    set schedule [twofish_schedule_critcl $subKeys $sboxKeys $keyLen]
+	}
     } ]
 
     #
@@ -487,6 +538,54 @@ itcl::class itwofish::ecb {
 	set d  [intDecrypt $x0 $x1 $x2 $x3]
 	return [binary format i4 $d]
     }
+
+    #
+    # Encrypt a message of several blocks; its length must be a
+    # multiple of 16 bytes. The blocks are independent, so that the
+    # multi-block kernel works on several of them at once.
+    #
+
+    public method encryptBlocks {message} {
+	if {([string length $message] % 16) != 0} {
+	    error "message must be a multiple of 16 bytes"
+	}
+	if {$blocks} {
+	    return [twofish_blocks_critcl encrypt $schedule $message]
+	}
+	binary scan $message i* words
+	set result ""
+	foreach {x0 x1 x2 x3} $words {
+	    set x0 [expr {($x0 + 0x100000000) % 0x100000000}]
+	    set x1 [expr {($x1 + 0x100000000) % 0x100000000}]
+	    set x2 [expr {($x2 + 0x100000000) % 0x100000000}]
+	    set x3 [expr {($x3 + 0x100000000) % 0x100000000}]
+	    append result [binary format i4 [intEncrypt $x0 $x1 $x2 $x3]]
+	}
+	return $result
+    }
+
+    #
+    # Decrypt a message of several blocks, see encryptBlocks
+    #
+
+    public method decryptBlocks {message} {
+	if {([string length $message] % 16) != 0} {
+	    error "message must be a multiple of 16 bytes"
+	}
+	if {$blocks} {
+	    return [twofish_blocks_critcl decrypt $schedule $message]
+	}
+	binary scan $message i* words
+	set result ""
+	foreach {x0 x1 x2 x3} $words {
+	    set x0 [expr {($x0 + 0x100000000) % 0x100000000}]
+	    set x1 [expr {($x1 + 0x100000000) % 0x100000000}]
+	    set x2 [expr {($x2 + 0x100000000) % 0x100000000}]
+	    set x3 [expr {($x3 + 0x100000000) % 0x100000000}]
+	    append result [binary format i4 [intDecrypt $x0 $x1 $x2 $x3]]
+	}
+	return $result
+    }
 }
 
 #
@@ -562,6 +661,14 @@ itcl::class itwofish::cbc {
 	    incr mlen
 	}
 
+	if {$blocks} {
+	    set result [twofish_blocks_critcl cbc-encrypt $schedule $message $salt]
+	    if {$mlen > 0} {
+		set salt [string range $result end-15 end]
+	    }
+	    return $result
+	}
+
 	set result ""
 
 	for {set i 0} {$i < $mlen} {incr i 16} {
@@ -599,6 +706,18 @@ itcl::class itwofish::cbc {
 	    error "message must be a multiple of 16 bytes"
 	}
 
+	#
+	# Unlike encryption, all blocks can be decrypted at once
+	#
+
+	if {$blocks} {
+	    set result [twofish_blocks_critcl cbc-decrypt $schedule $message $salt]
+	    if {$mlen > 0} {
+		set salt [string range $message end-15 end]
+	    }
+	    return $result
+	}
+
 	set result ""
 
 	for {set i 0} {$i < $mlen} {incr i 16} {
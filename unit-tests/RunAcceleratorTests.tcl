@@ -0,0 +1,42 @@
+# RunAcceleratorTests.tcl
+#
+# Runs the tests of the C accelerators and the Twofish kernels without
+# Tk, i.e., without starting Password Gorilla. Used by "make test" in
+# the top directory, which sets GORILLA_REQUIRE_ACCELERATORS so that a
+# missing or broken library is a failure rather than a silent fallback.
+#
+# Use:
+# bash:		tclsh unit-tests/RunAcceleratorTests.tcl
+#
+# Exits with 1 if a test failed.
+# ----------------------------------------------------------------------
+
+package require tcltest 2.2
+
+tcltest::workingDirectory [file dirname [file normalize [info script]]]
+tcltest::singleProcess 1
+tcltest::verbose { pass }
+
+namespace eval ::gorilla {
+	variable Dir [ file normalize [ file join [ tcltest::workingDirectory ] .. sources ] ]
+}
+
+# the packages that gorilla.tcl loads for opening a database
+
+source [ file join $::gorilla::Dir cli.tcl ]
+::gorilla::cli::load
+puts "Backends: [ pwsafe::int::cryptoBackends ]"
+
+set testFolderList [ list accelerators twofish ]
+
+foreach testFolder $testFolderList {
+	cd [file join [tcltest::workingDirectory] $testFolder]
+	foreach testFile [glob *.test] {
+		source $testFile
+	}
+	cd ..
+}
+
+set failed $tcltest::numTests(Failed)
+tcltest::cleanupTests
+exit [ expr { $failed > 0 } ]
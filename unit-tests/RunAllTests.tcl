@@ -19,7 +19,7 @@ tcltest::singleProcess 1	;# caller environment will be used
 tcltest::verbose { pass }
 
 # set testFolderList [list csv-import csv-export merge lock-database]
-set testFolderList [ list csv-import csv-export lock-database backup ]
+set testFolderList [ list csv-import csv-export merge lock-database backup twofish accelerators watch-file progressive-open rotate-passwords group-nodes ]
 
 foreach testFolder $testFolderList {
 	cd [file join [tcltest::workingDirectory] $testFolder]
@@ -0,0 +1,187 @@
+#! /bin/sh
+# the next line restarts using tclsh \
+exec tclsh "$0" ${1+"$@"}
+
+# Turn a critcl source file into a plain C file that the system compiler
+# can build as a Tcl extension, so that the accelerators can be built
+# without a tclkit and critcl2.kit. Used by the Makefile in the top
+# directory.
+#
+# This program is free software; you can redistribute it and/or modify it
+# under the terms of the GNU General Public License as published by the Free
+# Software Foundation; either version 2 of the License, or (at your option)
+# any later version.
+#
+# This program is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+# or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+# for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation 51
+# Franklin Street, Suite 500 Boston, MA 02110-1335
+
+# A copy of the GNU GPL may be found in the LICENCE.txt file in the main
+# gorilla/sources directory.
+#
+# Use:
+#
+#   critcl-c.tcl <critcl file> <C file> <Init name>
+#	Writes the C file, with an <Init name>_Init function that creates
+#	the commands of the critcl file. Prints the compiler arguments the
+#	critcl file asks for: defines, include directories and the extra
+#	C sources to compile with it.
+#
+#   critcl-c.tcl --target f32|sha256c
+#	Prints the path, relative to sources/, where Password Gorilla looks
+#	for the library on this machine.
+#
+#   critcl-c.tcl --tcl-config
+#	Prints the path of the tclConfig.sh of the running tclsh.
+#
+# Only the parts of critcl that the Gorilla extensions use are supported:
+# ccode, ccommand, cheaders and csources.
+
+namespace eval ::critcl {
+	variable code ""
+	variable commands [ list ]
+	variable compilerArgs [ list ]
+	variable dir ""
+}
+
+proc ::critcl::ccode { body } {
+	variable code
+	append code $body \n
+}
+
+proc ::critcl::ccommand { name arglist body } {
+	variable code
+	variable commands
+
+	# commands are created in the namespace that the critcl file is in
+	set ns [ uplevel 1 { namespace current } ]
+	if { ! [ string match ::* $name ] } {
+		set name [ string trimright $ns : ]::$name
+	}
+	set cname c_[ string map { :: _ } [ string trimleft $name : ] ]_cmd
+
+	lassign $arglist cd interp objc objv
+	append code "static int\n${cname}(ClientData $cd, Tcl_Interp *$interp,\
+		int $objc, Tcl_Obj *CONST $objv\[\])\n\{\n$body\n\}\n\n"
+	lappend commands $name $cname
+}
+
+proc ::critcl::cheaders { args } {
+	variable compilerArgs
+	variable dir
+	foreach arg $args {
+		if { [ string match -* $arg ] } {
+			lappend compilerArgs $arg
+		} else {
+			lappend compilerArgs -I[ file dirname [ file join $dir $arg ] ]
+		}
+	}
+}
+
+proc ::critcl::csources { args } {
+	variable compilerArgs
+	variable dir
+	foreach arg $args {
+		lappend compilerArgs [ file join $dir $arg ]
+	}
+}
+
+foreach cmd { cache cdata cdefines cflags cinit clibraries config debug \
+	ldflags license tk tsources } {
+	proc ::critcl::$cmd args {}
+}
+unset cmd
+
+#
+# Returns where twofish.tcl and the sha256c package index look for the
+# library, following their own naming of the platform
+#
+
+proc target { name } {
+	switch -- $name {
+		f32 {
+			set machine $::tcl_platform(machine)
+			set os $::tcl_platform(os)
+			switch -glob -- $machine {
+				intel -
+				i*86* { set machine x86 }
+			}
+			switch -glob -- $os {
+				Windows* { set os Windows }
+			}
+			return [ file join twofish f32-$os-$machine[ info sharedlibextension ] ]
+		}
+		sha256c {
+			set dir [ file join [ file dirname [ info script ] ] .. sources tcllib sha256c ]
+			set i [ interp create ]
+			$i eval [ list source [ file join $dir critcl.tcl ] ]
+			set platform [ $i eval { ::critcl::platform } ]
+			interp delete $i
+			return [ file join tcllib sha256c $platform sha256c[ info sharedlibextension ] ]
+		}
+		default {
+			error "unknown target \"$name\": must be f32 or sha256c"
+		}
+	}
+}
+
+proc tclConfig { } {
+	set candidates [ list [ file dirname [ info library ] ] ]
+	catch { lappend candidates [ ::tcl::pkgconfig get libdir,install ] }
+	lappend candidates /usr/lib /usr/lib64 /usr/local/lib
+	set version [ info tclversion ]
+	foreach dir $candidates {
+		foreach file [ list [ file join $dir tclConfig.sh ] \
+			[ file join $dir tcl$version tclConfig.sh ] ] {
+			if { [ file exists $file ] } {
+				return $file
+			}
+		}
+	}
+	error "tclConfig.sh not found, set TCLCONFIG"
+}
+
+switch -- [ lindex $argv 0 ] {
+	--target {
+		puts [ target [ lindex $argv 1 ] ]
+		exit 0
+	}
+	--tcl-config {
+		puts [ tclConfig ]
+		exit 0
+	}
+}
+
+if { [ llength $argv ] != 3 } {
+	puts stderr "usage: $argv0 <critcl file> <C file> <Init name>"
+	puts stderr "       $argv0 --target f32|sha256c"
+	puts stderr "       $argv0 --tcl-config"
+	exit 1
+}
+
+lassign $argv source output init
+set ::critcl::dir [ file normalize [ file dirname $source ] ]
+
+package provide critcl 2.0
+source $source
+
+set out [ open $output w ]
+puts $out "/* Generated by [ file tail [ info script ] ] from [ file tail $source ], do not edit */"
+puts $out "#include <stdlib.h>\n#include <string.h>\n#include \"tcl.h\"\n"
+puts $out $::critcl::code
+puts $out "int\n${init}_Init(Tcl_Interp *interp)\n\{"
+puts $out "    if (Tcl_InitStubs(interp, \"8.4\", 0) == NULL) {"
+puts $out "        return TCL_ERROR;"
+puts $out "    }"
+foreach { name cname } $::critcl::commands {
+	puts $out "    Tcl_CreateObjCommand(interp, \"$name\", $cname, NULL, NULL);"
+}
+puts $out "    return TCL_OK;\n\}"
+close $out
+
+puts [ join $::critcl::compilerArgs ]